@@ -8,7 +8,50 @@ TEMPLATE = app
 SOURCES += midi_player.cpp \
     main.cpp \
     player.cpp \
-    file_parser.cpp
-HEADERS += midi_player.h
+    file_parser.cpp \
+    seq_session.cpp \
+    device_registry.cpp \
+    queue_timer.cpp \
+    realtime.cpp \
+    midi_decoder.cpp \
+    parse_bench.cpp \
+    player_stats.cpp \
+    lookahead.cpp \
+    meta_text.cpp \
+    note_index.cpp \
+    piano_roll.cpp \
+    song_analysis.cpp \
+    voice_limiter.cpp \
+    smf_writer.cpp \
+    recorder.cpp \
+    live_thru.cpp \
+    render.cpp \
+    smf_convert.cpp \
+    control_socket.cpp \
+    transform.cpp
+HEADERS += midi_player.h \
+    seq_session.h \
+    device_registry.h \
+    options.h \
+    realtime.h \
+    midi_decoder.h \
+    parse_bench.h \
+    midi_file.h \
+    player_stats.h \
+    lookahead.h \
+    meta_text.h \
+    note_index.h \
+    piano_roll.h \
+    song_analysis.h \
+    voice_limiter.h \
+    smf_writer.h \
+    recorder.h \
+    live_thru.h \
+    tempo_map.h \
+    render.h \
+    smf_convert.h \
+    control_socket.h \
+    transform.h
 FORMS += midi_player.ui
 DEFINES += QT_NO_DEBUG_OUTPUT
+QMAKE_CXXFLAGS += -std=gnu++11
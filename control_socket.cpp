@@ -0,0 +1,173 @@
+// control_socket.cpp -- part of MIDI_PLAYER
+// line protocol server on a Unix-domain socket, see control_socket.h
+// contains:
+//      CONTROL_SERVER() -- constructor
+//      start()         -- bind, listen and start the thread
+//      stop()          -- wake the thread, join, close everything
+//      run()           -- the poll loop
+//      acceptClient()
+//      readClient()    -- split input into lines, one reply per line
+//      closeAll()
+
+#include "control_socket.h"
+#include "player_stats.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+CONTROL_SERVER::CONTROL_SERVER(HANDLER h, void *c) :
+    handler(h), context(c), listen_fd(-1), running(false)
+{
+    wake[0] = wake[1] = -1;
+}
+
+CONTROL_SERVER::~CONTROL_SERVER() {
+    stop();
+}
+
+bool CONTROL_SERVER::start(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error = QString("Control socket path too long: %1") .arg(socket_path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    // a socket left behind by a previous run is in the way, nothing else is
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        chmod(socket_path, 0600) < 0 || listen(listen_fd, MAX_CLIENTS) < 0 ||
+        pipe2(wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+        error = QString("Cannot serve control socket %1\n%2") .arg(socket_path) .arg(strerror(errno));
+        closeAll();
+        return false;
+    }
+    path = socket_path;
+    running = true;
+    pthread_create(&thread, NULL, thread_main, this);
+    return true;
+}   // end start
+
+void CONTROL_SERVER::stop() {
+    if (running) {
+        char c = 0;
+        while (write(wake[1], &c, 1) < 0 && errno == EINTR)
+            ;
+        pthread_join(thread, NULL);
+        running = false;
+        unlink(path.toLocal8Bit().data());
+    }
+    closeAll();
+}
+
+void CONTROL_SERVER::closeAll() {
+    for (size_t i = 0; i < clients.size(); ++i)
+        close(clients[i].fd);
+    clients.clear();
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+    for (int i = 0; i < 2; ++i) {
+        if (wake[i] >= 0)
+            close(wake[i]);
+        wake[i] = -1;
+    }
+}
+
+void *CONTROL_SERVER::thread_main(void *self) {
+    static_cast<CONTROL_SERVER *>(self)->run();
+    return 0;
+}
+
+void CONTROL_SERVER::run() {
+    std::vector<struct pollfd> fds;
+    for (;;) {
+        fds.resize(2 + clients.size());
+        fds[0].fd = wake[0];
+        fds[1].fd = listen_fd;
+        for (size_t i = 0; i < clients.size(); ++i)
+            fds[2 + i].fd = clients[i].fd;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[0].revents)
+            return;
+        // clients first, a new one has nothing to read yet
+        for (size_t i = clients.size(); i-- > 0; ) {
+            if (!fds[2 + i].revents)
+                continue;
+            if (!readClient(clients[i])) {
+                close(clients[i].fd);
+                clients.erase(clients.begin() + i);
+            }
+        }
+        if (fds[1].revents)
+            acceptClient();
+    }
+}   // end run
+
+void CONTROL_SERVER::acceptClient() {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (clients.size() >= MAX_CLIENTS) {
+        static const char busy[] = "ERR too many clients\n";
+        send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+    client c;
+    c.fd = fd;
+    clients.push_back(c);
+}
+
+bool CONTROL_SERVER::readClient(client &c) {
+    // false when the client is gone or misbehaves
+    char buf[MAX_LINE];
+    ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (n == 0)
+        return false;
+    long long received = stats_now();
+    char reply[REPLY_SIZE];
+    for (ssize_t i = 0; i < n; ++i) {
+        if (buf[i] != '\n') {
+            if (c.line.size() >= MAX_LINE)
+                return false;
+            c.line.push_back(buf[i]);
+            continue;
+        }
+        if (!c.line.empty() && c.line.back() == '\r')
+            c.line.pop_back();
+        c.line.push_back(0);
+        reply[0] = 0;
+        if (c.line[0])
+            handler(context, &c.line[0], received, reply, sizeof(reply) - 1);
+        c.line.clear();
+        if (!reply[0])
+            continue;   // empty line, empty answer
+        // replies are short and the client is waiting for them; one that
+        // can't take a line is dropped rather than stalling the others
+        size_t len = strlen(reply);
+        reply[len++] = '\n';
+        if (send(c.fd, reply, len, MSG_NOSIGNAL) != static_cast<ssize_t>(len))
+            return false;
+    }
+    return true;
+}   // end readClient
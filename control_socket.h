@@ -0,0 +1,52 @@
+#ifndef CONTROL_SOCKET_H
+#define CONTROL_SOCKET_H
+
+#include <pthread.h>
+#include <QString>
+#include <vector>
+
+// A Unix-domain stream socket that takes one command per line and
+// answers each with one line, for show-control scripts:
+//      echo play | socat - UNIX-CONNECT:/tmp/midi_player.sock
+// One thread polls the listening socket and every client; commands are
+// handed to the handler on that thread as they arrive, never through the
+// Qt event loop, so their latency does not depend on what the GUI is
+// doing.  The handler writes its reply ("OK ..." or "ERR ...") and
+// returns.  Implemented in control_socket.cpp.
+class CONTROL_SERVER {
+public:
+    // command without its newline, reply without one, size bytes of room
+    typedef void (*HANDLER)(void *context, char *command, long long received, char *reply, int size);
+
+    CONTROL_SERVER(HANDLER handler, void *context);
+    ~CONTROL_SERVER();
+
+    bool start(const char *path);       // false with errorString() set
+    void stop();
+    const QString &errorString() const { return error; }
+
+private:
+    enum { MAX_CLIENTS = 16, MAX_LINE = 4096, REPLY_SIZE = 1024 };
+    struct client {
+        int fd;
+        std::vector<char> line;         // bytes after the last newline
+    };
+
+    static void *thread_main(void *);
+    void run();
+    void acceptClient();
+    bool readClient(client &);
+    void closeAll();
+
+    HANDLER handler;
+    void *context;
+    int listen_fd;
+    int wake[2];        // a byte here ends the thread
+    bool running;
+    pthread_t thread;
+    QString path;
+    QString error;
+    std::vector<client> clients;    // the thread's alone while it runs
+};
+
+#endif // CONTROL_SOCKET_H
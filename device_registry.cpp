@@ -0,0 +1,175 @@
+// device_registry.cpp -- part of MIDI_PLAYER
+// cache of writable sequencer ports and raw MIDI output devices.
+// The full scan runs once; after that the session feeds us the client
+// and port start/exit/change events from the system announce port.
+// contains:
+//      build()       -- initial scan of ports and raw devices
+//      handleEvent() -- apply one announce event, true if the list changed
+//      findPort()    -- name -> client:port
+//      findRawDev()  -- name -> "hw:card,dev,subdev"
+//      addPort(), removePort(), removeClient(), scanRawDevs() -- helpers
+
+#include "device_registry.h"
+#include <QtDebug>
+
+DEVICE_REGISTRY::DEVICE_REGISTRY() {
+}
+
+void DEVICE_REGISTRY::build(snd_seq_t *seq) {
+    names.clear();
+    by_name.clear();
+    by_addr.clear();
+    snd_seq_client_info_t *cinfo;
+    snd_seq_port_info_t *pinfo;
+    snd_seq_client_info_alloca(&cinfo);
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_client_info_set_client(cinfo, -1);
+    while (snd_seq_query_next_client(seq, cinfo) >= 0) {
+        int client = snd_seq_client_info_get_client(cinfo);
+        snd_seq_port_info_set_client(pinfo, client);
+        snd_seq_port_info_set_port(pinfo, -1);
+        while (snd_seq_query_next_port(seq, pinfo) >= 0)
+            addPort(pinfo);
+    }
+    scanRawDevs();
+}   // end build
+
+bool DEVICE_REGISTRY::handleEvent(snd_seq_t *seq, const snd_seq_event_t *ev) {
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+    const snd_seq_addr_t &a = ev->data.addr;
+    switch (ev->type) {
+    case SND_SEQ_EVENT_PORT_START:
+        if (snd_seq_get_any_port_info(seq, a.client, a.port, pinfo) < 0)
+            return false;
+        return addPort(pinfo);
+    case SND_SEQ_EVENT_PORT_CHANGE: {
+        // name or capabilities may have changed, re-read it
+        bool changed = removePort(a.client, a.port);
+        if (snd_seq_get_any_port_info(seq, a.client, a.port, pinfo) >= 0)
+            changed |= addPort(pinfo);
+        return changed;
+    }
+    case SND_SEQ_EVENT_PORT_EXIT:
+        return removePort(a.client, a.port);
+    case SND_SEQ_EVENT_CLIENT_START:
+        // kernel clients are sound cards, their raw devices came with them
+        if (a.client < 128)
+            scanRawDevs();
+        return false;   // its ports announce themselves
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+        if (a.client < 128)
+            scanRawDevs();
+        return removeClient(a.client);
+    default:
+        return false;
+    }
+}   // end handleEvent
+
+bool DEVICE_REGISTRY::findPort(const QString &name, snd_seq_addr_t *addr) const {
+    if (!by_name.contains(name))
+        return false;
+    *addr = by_name.value(name);
+    return true;
+}
+
+QString DEVICE_REGISTRY::findRawDev(const QString &name) const {
+    return raw_devs.value(name);
+}
+
+bool DEVICE_REGISTRY::addPort(snd_seq_port_info_t *pinfo) {
+    /* we need both WRITE and SUBS_WRITE */
+    if ((snd_seq_port_info_get_capability(pinfo)
+         & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
+        != (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
+        return false;
+    QString name = snd_seq_port_info_get_name(pinfo);
+    snd_seq_addr_t addr;
+    addr.client = snd_seq_port_info_get_client(pinfo);
+    addr.port = snd_seq_port_info_get_port(pinfo);
+    by_addr.insert(addrKey(addr.client, addr.port), name);
+    if (by_name.contains(name))
+        return false;   // first port with a given name wins, as before
+    by_name.insert(name, addr);
+    names.append(name);
+    qDebug() << "port:" << name;
+    return true;
+}   // end addPort
+
+bool DEVICE_REGISTRY::removePort(int client, int port) {
+    int key = addrKey(client, port);
+    if (!by_addr.contains(key))
+        return false;
+    QString name = by_addr.value(key);
+    by_addr.remove(key);
+    snd_seq_addr_t addr = by_name.value(name);
+    if (addr.client != client || addr.port != port)
+        return false;   // the name belongs to another port
+    // hand the name to the next live port that carries it, lowest address first
+    int next = -1;
+    for (QHash<int, QString>::const_iterator i = by_addr.constBegin(); i != by_addr.constEnd(); ++i) {
+        if (i.value() == name && (next < 0 || i.key() < next))
+            next = i.key();
+    }
+    if (next >= 0) {
+        addr.client = next >> 8;
+        addr.port = next & 0xff;
+        by_name.insert(name, addr);
+        qDebug() << "port moved:" << name << addr.client << ":" << addr.port;
+        return true;
+    }
+    by_name.remove(name);
+    names.removeAll(name);
+    qDebug() << "port gone:" << name;
+    return true;
+}   // end removePort
+
+bool DEVICE_REGISTRY::removeClient(int client) {
+    bool changed = false;
+    for (int port = 0; port < 256; ++port) {
+        if (by_addr.contains(addrKey(client, port)))
+            changed |= removePort(client, port);
+    }
+    return changed;
+}
+
+void DEVICE_REGISTRY::scanRawDevs() {
+    raw_devs.clear();
+    int card_num = -1;
+    int dev_num, subdev_num;
+    char str[64];
+    snd_rawmidi_info_t *rawMidiInfo;
+    snd_ctl_t *cardHandle;
+    snd_rawmidi_info_alloca(&rawMidiInfo);
+    if (snd_card_next(&card_num) < 0)
+        return;     // no MIDI cards found in the system
+    while (card_num >= 0) {
+        sprintf(str, "hw:%i", card_num);
+        if (snd_ctl_open(&cardHandle, str, 0) < 0)
+            break;
+        dev_num = -1;
+        if (snd_ctl_rawmidi_next_device(cardHandle, &dev_num) < 0)
+            dev_num = -1;   // card exists, but no midi device was found
+        while (dev_num >= 0) {
+            memset(rawMidiInfo, 0, snd_rawmidi_info_sizeof());
+            snd_rawmidi_info_set_device(rawMidiInfo, dev_num);
+            snd_rawmidi_info_set_stream(rawMidiInfo, SND_RAWMIDI_STREAM_OUTPUT);
+            subdev_num = 1;
+            for (int i = 0; i < subdev_num; ++i) {
+                snd_rawmidi_info_set_subdevice(rawMidiInfo, i);
+                if (snd_ctl_rawmidi_info(cardHandle, rawMidiInfo) < 0)
+                    continue;
+                if (!i)
+                    subdev_num = snd_rawmidi_info_get_subdevices_count(rawMidiInfo);
+                QString name = snd_rawmidi_info_get_subdevice_name(rawMidiInfo);
+                if (!raw_devs.contains(name))
+                    raw_devs.insert(name, "hw:" + QString::number(card_num) + "," + QString::number(dev_num) + "," + QString::number(i));
+            }   // end FOR subdev_num
+            if (snd_ctl_rawmidi_next_device(cardHandle, &dev_num) < 0)
+                break;
+        }   // end WHILE dev_num
+        snd_ctl_close(cardHandle);
+        if (snd_card_next(&card_num) < 0)
+            break;
+    }   // end WHILE card_num
+}   // end scanRawDevs
@@ -0,0 +1,34 @@
+#ifndef DEVICE_REGISTRY_H
+#define DEVICE_REGISTRY_H
+
+#include <alsa/asoundlib.h>
+#include <QHash>
+#include <QStringList>
+
+// Writable sequencer ports and raw MIDI devices, looked up by name.
+// Built once, then kept current from system announce events.
+class DEVICE_REGISTRY {
+public:
+    DEVICE_REGISTRY();
+
+    void build(snd_seq_t *);
+    bool handleEvent(snd_seq_t *, const snd_seq_event_t *);
+
+    const QStringList &portNames() const { return names; }
+    bool findPort(const QString &name, snd_seq_addr_t *addr) const;
+    QString findRawDev(const QString &name) const;
+
+private:
+    static int addrKey(int client, int port) { return (client << 8) | port; }
+    bool addPort(snd_seq_port_info_t *);
+    bool removePort(int client, int port);
+    bool removeClient(int client);
+    void scanRawDevs();
+
+    QStringList names;                      // PortBox order
+    QHash<QString, snd_seq_addr_t> by_name; // the port a name stands for
+    QHash<int, QString> by_addr;            // every port, same names included
+    QHash<QString, QString> raw_devs;       // subdevice name -> "hw:c,d,s"
+};
+
+#endif // DEVICE_REGISTRY_H
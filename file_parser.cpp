@@ -1,53 +1,79 @@
 // file_parser.cpp -- part of MIDI_PLAYER
 // validate the midi file is formatted correctly, then parse the track data
 // and load events into memory images.
-// Requires "seq", "queue", "song_length_seconds" vars
+// MIDI_FILE members only: no window or sequencer, safe on a worker thread
 // contains:
-//      parseFile() -- main process that calls the other functions
+//      MIDI_FILE() -- constructor
+//      load()      -- main process that calls the other functions
 //      read_riff() -- RIFF is a (potential) wrapper around SMF data, strip it off
 //      read_smf()  -- this is the heavy lifting of parsing the Standard Midi File (SMF) data
 //      read_track() -- called from read_smf to get midi data
+//      TRACK_SINK  -- stores what decode_track_scan() (midi_decoder.h) finds
 //      read_id()   -- INLINE helper function
 //      read_byte()   -- INLINE helper function
 //      skip()   -- INLINE helper function
+//      at_eof()   -- INLINE helper function
 //      tick_comp()   -- sort helper function
+//      TEMPO_MAP::build() -- the tempo changes of a song, see tempo_map.h
+//      tickToSeconds() -- follow the tempo map
+//      secondsToTick() -- follow the tempo map
 //      read_32_le()   -- helper function
 //      read_int()   -- helper function
-//      read_var()   -- helper function
 
-#include "midi_player.h"
-#include "ui_midi_player.h"
+#include "midi_file.h"
+#include "midi_decoder.h"
+#include "player_stats.h"
 #include <alsa/asoundlib.h>
 #include <algorithm>
 #include <QDebug>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 
 #define MAKE_ID(c1, c2, c3, c4) ((c1) | ((c2) << 8) | ((c3) << 16) | ((c4) << 24))
 
-bool MIDI_PLAYER::minor_key=false;
-int MIDI_PLAYER::sf=0;  // 0=Cmajor, <0 = #flats, >0 = #sharps
-double MIDI_PLAYER::BPM=0,MIDI_PLAYER::PPQ=0;
-int smpte_timing;
-int file_offset;
-int prev_tick;
-FILE *file;
+MIDI_FILE::MIDI_FILE() :
+    init_tempo(500000),
+    PPQ(0), BPM(0),
+    song_length_seconds(0),
+    minor_key(false),
+    sf(0),      // 0=Cmajor, <0 = #flats, >0 = #sharps
+    parse_ns(0), map_ns(0), tracks_ns(0), sort_ns(0), index_ns(0),
+    file_bytes(0),
+    file_data(0),
+    file_size(0),
+    file_offset(0),
+    prev_tick(0),
+    smpte_timing(0)
+{
+}
 
 // helper functions, most are INLINE
-int MIDI_PLAYER::read_id(void) {
+int MIDI_FILE::read_id(void) {
     return read_32_le();
 }
-int MIDI_PLAYER::read_byte(void) {
-    ++file_offset;
-    return getc(file);
+int MIDI_FILE::read_byte(void) {
+    // reading past the end still advances, so at_eof() behaves like feof()
+    if (file_offset >= file_size) {
+        ++file_offset;
+        return EOF;
+    }
+    return file_data[file_offset++];
+}
+bool MIDI_FILE::at_eof(void) {
+    return file_offset > file_size;
 }
-int MIDI_PLAYER::read_32_le(void) {
+int MIDI_FILE::read_32_le(void) {
     int value = read_byte();
     value |= read_byte() << 8;
     value |= read_byte() << 16;
     value |= read_byte() << 24;
-    return !feof(file) ? value : -1;
+    return !at_eof() ? value : -1;
 }
-int MIDI_PLAYER::read_int(int bytes) {
+int MIDI_FILE::read_int(int bytes) {
     int value = 0;
     do {
         int c = read_byte();
@@ -57,33 +83,14 @@ int MIDI_PLAYER::read_int(int bytes) {
     } while (--bytes);
     return value;
 }
-int MIDI_PLAYER::read_var(void) {
-    int c = read_byte();
-    int value = c & 0x7f;
-    if (c & 0x80) {
-        c = read_byte();
-        value = (value << 7) | (c & 0x7f);
-        if (c & 0x80) {
-            c = read_byte();
-            value = (value << 7) | (c & 0x7f);
-            if (c & 0x80) {
-                c = read_byte();
-                value = (value << 7) | c;
-                if (c & 0x80)
-                    return -1;
-            }
-        }
-    }
-    return !feof(file) ? value : -1;
-}   // end read_var
-void MIDI_PLAYER::skip(int bytes) {
-    while (bytes > 0)
-        read_byte(), --bytes;
+void MIDI_FILE::skip(int bytes) {
+    if (bytes > 0)
+        file_offset += bytes;
 }
 
 
 // start of data reading functions
-int MIDI_PLAYER::read_riff(char *file_name) {
+int MIDI_FILE::read_riff(const char *file_name) {
     // skip file length
     read_byte();
     read_byte();
@@ -92,16 +99,16 @@ int MIDI_PLAYER::read_riff(char *file_name) {
     // check file type ("RMID" = RIFF MIDI)
     if (read_id() != MAKE_ID('R', 'M', 'I', 'D')) {
 invalid_format:
-        QMessageBox::critical(this, "MIDI Player", QString("%1: invalid file format") .arg(file_name));
+        error = QString("%1: invalid file format") .arg(file_name);
         return 0;
     }
     // search for "data" chunk
     for (;;) {
         int id = read_id();
         int len = read_32_le();
-        if (feof(file)) {
+        if (at_eof()) {
 data_not_found:
-            QMessageBox::critical(this, "MIDI Player", QString("%1: data chunk not found") .arg(file_name));
+            error = QString("%1: data chunk not found") .arg(file_name);
             return 0;
         }
         if (id == MAKE_ID('d', 'a', 't', 'a'))
@@ -115,23 +122,23 @@ data_not_found:
     return read_smf(file_name);
 }   // end read_riff
 
-int MIDI_PLAYER::read_smf(char *file_name) {
+int MIDI_FILE::read_smf(const char *file_name) {
     // read midi data into memory, parsing it into events
     // the starting position is immediately after the "MThd" id
    int  header_len = read_int(4);   // header length
     if (header_len < 6) {
 invalid_format:
-        QMessageBox::critical(this, "MIDI Player", QString("%1: invalid file format") .arg(file_name));
+        error = QString("%1: invalid file format") .arg(file_name);
         return 0;
     }
     int type = read_int(2);     // midi type 0 or 1
     if (type != 0 && type != 1) {
-        QMessageBox::critical(this, "MIDI Player", QString("%1: type %2 format is not supported") .arg(file_name) .arg(type));
+        error = QString("%1: type %2 format is not supported") .arg(file_name) .arg(type);
         return 0;
     }
     int num_tracks = read_int(2);       // number of tracks
     if (num_tracks < 1 || num_tracks > 1000) {
-        QMessageBox::critical(this, "MIDI Player", QString("%1: invalid number of tracks (%2)") .arg(file_name) .arg(num_tracks));
+        error = QString("%1: invalid number of tracks (%2)") .arg(file_name) .arg(num_tracks);
         num_tracks = 0;
         return 0;
     }
@@ -139,14 +146,13 @@ invalid_format:
     qDebug() << "time_division/ppq: " << time_division;
     if (time_division < 0)
         goto invalid_format;
-    // interpret and set tempo
-    snd_seq_queue_tempo_t *queue_tempo;
-    snd_seq_queue_tempo_alloca(&queue_tempo);
+    // interpret the tempo, the player hands it to its queue
+    int tempo, ppq;
     smpte_timing = !!(time_division & 0x8000);
     if (!smpte_timing) {
         // time_division is ticks per quarter
-        snd_seq_queue_tempo_set_tempo(queue_tempo, 500000); // default: 120 bpm
-        snd_seq_queue_tempo_set_ppq(queue_tempo, time_division);
+        tempo = 500000;     // default: 120 bpm
+        ppq = time_division;
     } else {
         // upper byte is negative frames per second
         int i = 0x80 - ((time_division >> 8) & 0x7f);
@@ -155,35 +161,31 @@ invalid_format:
         // now pretend that we have quarter-note based timing
         switch (i) {
         case 24:
-            snd_seq_queue_tempo_set_tempo(queue_tempo, 500000);
-            snd_seq_queue_tempo_set_ppq(queue_tempo, 12 * time_division);
+            tempo = 500000;
+            ppq = 12 * time_division;
             break;
         case 25:
-            snd_seq_queue_tempo_set_tempo(queue_tempo, 400000);
-            snd_seq_queue_tempo_set_ppq(queue_tempo, 10 * time_division);
+            tempo = 400000;
+            ppq = 10 * time_division;
             break;
         case 29: // 30 drop-frame
-            snd_seq_queue_tempo_set_tempo(queue_tempo, 100000000);
-            snd_seq_queue_tempo_set_ppq(queue_tempo, 2997 * time_division);
+            tempo = 100000000;
+            ppq = 2997 * time_division;
             break;
         case 30:
-            snd_seq_queue_tempo_set_tempo(queue_tempo, 500000);
-            snd_seq_queue_tempo_set_ppq(queue_tempo, 15 * time_division);
+            tempo = 500000;
+            ppq = 15 * time_division;
             break;
         default:
-            QMessageBox::critical(this, "MIDI Player", QString("%1: invalid number of SMPTE frames per second (%2)") .arg(file_name) .arg(i));
+            error = QString("%1: invalid number of SMPTE frames per second (%2)") .arg(file_name) .arg(i);
             return 0;
         }
     }
-    int err = snd_seq_set_queue_tempo(seq, queue, queue_tempo);
-    if (err < 0) {
-        QMessageBox::critical(this, "MIDI Player", QString("Cannot set queue tempo (%1/%2") .arg(snd_seq_queue_tempo_get_tempo(queue_tempo)) .arg(snd_seq_queue_tempo_get_ppq(queue_tempo)));
-        return 0;
-    }
-    PPQ = snd_seq_queue_tempo_get_ppq(queue_tempo);
-    qDebug() << "Initial Tempo: " << snd_seq_queue_tempo_get_tempo(queue_tempo);
+    PPQ = ppq;
+    init_tempo = tempo;
+    qDebug() << "Initial Tempo: " << tempo;
     if (PPQ != time_division) qDebug() << "New ppq: " << PPQ;
-    BPM = static_cast<double>(1000000/static_cast<double>(snd_seq_queue_tempo_get_tempo(queue_tempo))*60);
+    BPM = static_cast<double>(1000000/static_cast<double>(tempo)*60);
     song_length_seconds = prev_tick = 0;
     // read len data from track unless EOF or new track found
     for (int j = 0; j < num_tracks; ++j) {
@@ -193,12 +195,12 @@ invalid_format:
         for (;;) {
             int id = read_id();
             len = read_int(4);      // track length
-            if (feof(file)) {
-                QMessageBox::critical(this, "MIDI Player", QString("%1: unexpected end of file") .arg(file_name));
+            if (at_eof()) {
+                error = QString("%1: unexpected end of file") .arg(file_name);
                 return 0;
             }
             if (len < 0 || len >= 0x10000000) {
-                QMessageBox::critical(this, "MIDI Player", QString("%1: invalid chunk length %2") .arg(file_name) .arg(len));
+                error = QString("%1: invalid chunk length %2") .arg(file_name) .arg(len);
                 return 0;
             }
             if (id == MAKE_ID('M', 'T', 'r', 'k'))
@@ -206,188 +208,238 @@ invalid_format:
             skip(len);
         }   // end FOR (infinite)
         // do the actual reading of midi data from the file
+        long long t0 = stats_now();
         if (!read_track(file_offset + len, file_name)) return 0;
+        track_ns.push_back(stats_now() - t0);
+        tracks_ns += track_ns.back();
     }   // end FOR j
 
+    if (events.empty()) {
+        error = QString("%1: no MIDI events") .arg(file_name);
+        return 0;
+    }
     // sort the event vector in tick order
-//    std::sort(all_events.begin(), all_events.end(), tick_comp);
-    std::stable_sort(all_events.begin(), all_events.end(), tick_comp);
+//    std::sort(events.begin(), events.end(), tick_comp);
+    long long t0 = stats_now();
+    std::stable_sort(events.begin(), events.end(), tick_comp);
+    std::stable_sort(signatures.begin(), signatures.end(),
+                     [](const signature &a, const signature &b) { return a.tick < b.tick; });
+    texts.finish();
+    sort_ns = stats_now() - t0;
+    t0 = stats_now();
+    notes.finish();
+    index_ns = stats_now() - t0;
     if (song_length_seconds == 0) {
-        song_length_seconds = (60000/(BPM*PPQ)) * all_events.back().tick / 1000 ;
+        song_length_seconds = (60000/(BPM*PPQ)) * events.back().tick / 1000 ;
         qDebug() << "Song length: " << song_length_seconds;
     }
     else {
-        song_length_seconds += (60000/(BPM*PPQ)) * (all_events.back().tick-prev_tick) / 1000 ;
+        song_length_seconds += (60000/(BPM*PPQ)) * (events.back().tick-prev_tick) / 1000 ;
         qDebug() << "Song length: " << song_length_seconds;
     }
     return 1;   // good return, all data read ok
 }   // end read_smf
 
-bool MIDI_PLAYER::tick_comp(const struct event& e1, const struct event& e2) { 
+bool MIDI_FILE::tick_comp(const struct event& e1, const struct event& e2) { 
   return (e1.tick<e2.tick);
 }
 
-int MIDI_PLAYER::read_track(int track_end, char *file_name) {
-// read one complete track from the file, parse it into events
-    int tick = 0;
-    unsigned char last_cmd = 0;
-    struct event Event;
-    Event.port=0;
-    // the current file position is after the track ID and length
-    while (file_offset < track_end) {
-        unsigned char cmd;
-        int len, c;
+void TEMPO_MAP::build(const MIDI_FILE &song) {
+    changes.clear();
+    change c = { 0, 0, song.init_tempo / 1e6 / song.PPQ };
+    changes.push_back(c);
+    for (size_t i = 0; i < song.events.size(); ++i) {
+        const MIDI_FILE::event &e = song.events[i];
+        if (e.type != SND_SEQ_EVENT_TEMPO)
+            continue;
+        c.seconds += (e.tick - c.tick) * c.sec_per_tick;
+        c.tick = e.tick;
+        c.sec_per_tick = e.data.tempo / 1e6 / song.PPQ;
+        changes.push_back(c);
+    }
+}   // end build
 
-        int delta_ticks = read_var();
-        if (delta_ticks < 0)
-            break;
-        tick += delta_ticks;
-        c = read_byte();
-        if (c < 0)
-            break;      // bad data, exit with rc
-        if (c & 0x80) {
-            // have command
-            cmd = c;
-            if (cmd < 0xf0)
-                last_cmd = cmd;
+double MIDI_FILE::tickToSeconds(unsigned int tick) const {
+    // a binary search, markers and the control socket call this often
+    if (tempo_map.changes.empty())
+        return 0;   // nothing loaded
+    return tempo_map.seconds(tick);
+}
+
+unsigned int MIDI_FILE::secondsToTick(double seconds) const {
+    if (tempo_map.changes.empty())
+        return 0;
+    return tempo_map.tick(seconds);
+}
+
+// receives the messages decode_track() finds in one track and turns
+// them into events; tempo and key signature also update the song data
+struct TRACK_SINK {
+    MIDI_FILE *file;
+    MIDI_FILE::event Event;
+    int open_sysex;     // index of an F0 event still waiting for its F7 packets
+    int track;
+    unsigned int last_tick;
+
+    TRACK_SINK(MIDI_FILE *f, int t) : file(f), open_sysex(-1), track(t), last_tick(0) {
+        Event.port = 0;
+    }
+
+    void channel(unsigned int tick, unsigned char type, unsigned char ch, unsigned char d1, unsigned char d2) {
+        // pair notes for the note index; velocity 0 is a note-off
+        if (type == SND_SEQ_EVENT_NOTEON && d2)
+            file->notes.noteOn(track, tick, ch, d1, d2);
+        else if (type == SND_SEQ_EVENT_NOTEON || type == SND_SEQ_EVENT_NOTEOFF)
+            file->notes.noteOff(tick, ch, d1);
+        last_tick = tick;
+        Event.type = type;
+        Event.tick = tick;
+        Event.data.d[0] = ch;
+        Event.data.d[1] = d1;
+        Event.data.d[2] = d2;
+        file->events.push_back(Event);
+    }
+
+    bool sysex(unsigned int tick, unsigned char cmd, const unsigned char *data, unsigned int len) {
+        last_tick = tick;
+        std::vector<unsigned char> &arena = file->sysex_arena;
+        if (cmd == 0xf7 && open_sysex >= 0) {
+            // continuation packet: append to the message it belongs to;
+            // only realtime bytes may come between packets, so the
+            // open payload is still the last one in the arena
+            MIDI_FILE::event &open = file->events[open_sysex];
+            if (open.data.sysex.offset + open.data.sysex.length != arena.size())
+                return false;
+            arena.insert(arena.end(), data, data + len);
+            open.data.sysex.length += len;
         } else {
-            // running status
-            ungetc(c, file);
-            file_offset--;
-            cmd = last_cmd;
-            if (!cmd)
-                goto _error;
-        }
-        unsigned int x = cmd >> 4;
-        static unsigned char cmd_type[0xf];
-        switch(x) {
-        case 0x8:
-            cmd_type[x] = SND_SEQ_EVENT_NOTEOFF;
-            break;
-        case 0x9:
-            cmd_type[x] = SND_SEQ_EVENT_NOTEON;
-            break;
-        case 0xA:
-            cmd_type[x] = SND_SEQ_EVENT_KEYPRESS;
-            break;
-        case 0xB:
-            cmd_type[x] = SND_SEQ_EVENT_CONTROLLER;
-            break;
-        case 0xC:
-            cmd_type[x] = SND_SEQ_EVENT_PGMCHANGE;
-            break;
-        case 0xD:
-            cmd_type[x] = SND_SEQ_EVENT_CHANPRESS;
-            break;
-        case 0xE:
-            cmd_type[x] = SND_SEQ_EVENT_PITCHBEND;
-            break;
-        }
-        switch(x) {
-        case 0x8: // channel msg with 2 parameter bytes
-        case 0x9:
-        case 0xa:
-        case 0xb:
-        case 0xe:
-            Event.type = cmd_type[cmd >> 4];
+            // new message (F0 is stored with it) or an escaped F7 sequence sent as is
+            Event.type = SND_SEQ_EVENT_SYSEX;
             Event.tick = tick;
-            Event.data.d[0] = cmd & 0x0f;
-            Event.data.d[1] = read_byte() & 0x7f;
-            Event.data.d[2] = read_byte() & 0x7f;
-            all_events.push_back(Event);
-            break;
-        case 0xc: // channel msg with 1 parameter byte
-        case 0xd:
-            Event.type = cmd_type[cmd >> 4];
+            Event.data.sysex.offset = arena.size();
+            Event.data.sysex.length = len + (cmd == 0xf0);
+            if (cmd == 0xf0)
+                arena.push_back(0xf0);
+            arena.insert(arena.end(), data, data + len);
+            file->events.push_back(Event);
+            if (cmd == 0xf0)
+                open_sysex = file->events.size() - 1;
+        }
+        // the message is complete once its last packet ends with F7
+        if (open_sysex >= 0 && arena.back() == 0xf7)
+            open_sysex = -1;
+        return true;
+    }   // end sysex
+
+    bool meta(unsigned int tick, unsigned char type, const unsigned char *data, unsigned int len) {
+        last_tick = tick;
+        switch (type) {
+        case 0x21: // port number
+            return len >= 1;
+        case 0x51: // tempo
+            if (len < 3)
+                return false;
+            if (file->smpte_timing)
+                return true;    // SMPTE timing doesn't change
+            Event.type = SND_SEQ_EVENT_TEMPO;
             Event.tick = tick;
-            Event.data.d[0] = cmd & 0x0f;
-            Event.data.d[1] = read_byte() & 0x7f;
-            all_events.push_back(Event);
-            break;
-        case 0xf:
-            switch (cmd) {
-            case 0xf0: // sysex
-            case 0xf7: // continued sysex, or escaped commands
-                len = read_var();
-                if (len < 0) goto _error;
-                if (cmd == 0xf0) ++len;
-                Event.type = SND_SEQ_EVENT_SYSEX;
-                Event.tick = tick;
-                Event.data.length = len;
-                if (cmd == 0xf0) {
-                    Event.sysex.push_back(0xf0);
-                    c = 1;
-                } else {
-                    c = 0;
-                }
-                for (; c < len; ++c)
-                    Event.sysex.push_back(read_byte());
-                all_events.push_back(Event);
-                break;
-            case 0xff: // meta event
-                c = read_byte();
-                len = read_var();
-                if (len < 0) goto _error;
-                switch (c) {
-                 case 0x21: // port number
-                    if (len < 1) goto _error;
-                    skip(len);
-                    break;
-                 case 0x2f: // end of track
-                    skip(track_end - file_offset);
-                    return 1;   // this is the successful exit point, end of the track
-                 case 0x51: // tempo
-                    if (len < 3) goto _error;
-                    if (smpte_timing) {
-                        // SMPTE timing doesn't change
-                        skip(len);
-                    } else {
-                        Event.type = SND_SEQ_EVENT_TEMPO;
-                        Event.tick = tick;
-                        Event.data.tempo = read_byte() << 16;
-                        Event.data.tempo |= read_byte() << 8;
-                        Event.data.tempo |= read_byte();
-                        all_events.push_back(Event);
-                        skip(len - 3);
-                        song_length_seconds += (60000/(BPM*PPQ)) * (tick-prev_tick) / 1000 ;
-                        prev_tick = tick;
-                        BPM = static_cast<double>(1000000/static_cast<double>(Event.data.tempo)*60);
-                        qDebug() << "New tempo: " << Event.data.tempo;
-                        qDebug() << " BPM: " << BPM << " at tick " << Event.tick;
-                        qDebug() << "New song_len: " << song_length_seconds;
-                    }
-                    break;
-                 case 0x59:  // Key Signature
-                    if (len<2) goto _error;
-                    sf = read_byte();
-                    minor_key = read_byte();
-                    break;
-                 default: // ignore all other meta events
-                    skip(len);
-                    break;
-                }   // end SWITCH (meta-event byte value)
-                break;
-            default: // invalid Fx command
-                goto _error;
-            }   // end SWITCH (cmd)
-            break;
-        default: // cannot happen
-            goto _error;
-        }   // end switch
-    }   // end WHILE (one complete track)
-_error:
-    QMessageBox::critical(this, "MIDI Player", QString("%1: invalid MIDI data (offset %2)") .arg(file_name) .arg(file_offset));
-    return 0;
+            Event.data.tempo = (data[0] << 16) | (data[1] << 8) | data[2];
+            file->events.push_back(Event);
+            file->song_length_seconds += (60000/(file->BPM*file->PPQ)) * (tick-file->prev_tick) / 1000 ;
+            file->prev_tick = tick;
+            file->BPM = static_cast<double>(1000000/static_cast<double>(Event.data.tempo)*60);
+            qDebug() << "New tempo: " << Event.data.tempo;
+            qDebug() << " BPM: " << file->BPM << " at tick " << Event.tick;
+            qDebug() << "New song_len: " << file->song_length_seconds;
+            return true;
+        case 0x58:  // Time Signature
+            if (len < 4)
+                return true;    // skipped, as before signatures were kept
+            signature(tick, type, data, 4);
+            return true;
+        case 0x59:  // Key Signature
+            if (len < 2)
+                return false;
+            file->sf = static_cast<signed char>(data[0]);
+            file->minor_key = data[1];
+            signature(tick, type, data, 2);
+            return true;
+        default: {
+            // text, lyric, marker and cue point go to the string store;
+            // end of track and all other meta events carry nothing we keep
+            int kind = META_TEXT::kindOf(type);
+            if (kind >= 0)
+                file->texts.add(kind, tick, data, len);
+            return true;
+        }
+        }   // end SWITCH (meta-event byte value)
+    }   // end meta
+
+    void signature(unsigned int tick, unsigned char type, const unsigned char *data, int len) {
+        MIDI_FILE::signature sig = { tick, type, { 0, 0, 0, 0 } };
+        memcpy(sig.data, data, len);
+        file->signatures.push_back(sig);
+    }
+};  // end TRACK_SINK
+
+int MIDI_FILE::read_track(int track_end, const char *file_name) {
+// decode one complete track straight from the mapped file
+    // the current file position is after the track ID and length
+    if (track_end > file_size)
+        track_end = file_size;
+    TRACK_SINK sink(this, track_ns.size());
+    const unsigned char *error_at = file_data + file_offset;
+    size_t len = track_end - file_offset;
+    scan_mask.resize(scan_mask_words(len));
+    scan_high_bits(file_data + file_offset, len, &scan_mask[0]);
+    if (!decode_track_scan(file_data + file_offset, file_data + track_end, &scan_mask[0], sink, &error_at)) {
+        file_offset = error_at - file_data;
+        error = QString("%1: invalid MIDI data (offset %2)") .arg(file_name) .arg(file_offset);
+        return 0;
+    }
+    notes.endTrack(sink.last_tick);   // notes held to the end of the track
+    file_offset = track_end;    // anything after end-of-track is ignored
+    return 1;   // this is the successful exit point, end of the track
 }   // end read_track
 
-int MIDI_PLAYER::parseFile(char *file_name) {
-    // parse the midi file
-    file = fopen(file_name, "rb");
-    if (!file) {
-        QMessageBox::critical(this, "MIDI Player", QString("Cannot open %s - %s") .arg(file_name) .arg(strerror(errno)));
+bool MIDI_FILE::load(const char *file_name, bool analyze) {
+    // parse the midi file, replacing whatever was loaded before
+    long long start = stats_now();
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        error = QString("Cannot open %1 - %2") .arg(file_name) .arg(strerror(errno));
+        if (fd >= 0) ::close(fd);
+        return 0;
+    }
+    if (st.st_size == 0) {
+        // mmap() of nothing fails, and errno says nothing about why
+        error = QString("Cannot open %1 - empty file") .arg(file_name);
+        ::close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        error = QString("Cannot map %1 - %2") .arg(file_name) .arg(strerror(errno));
         return 0;
     }
+    file_data = static_cast<const unsigned char *>(map);
+    file_size = st.st_size;
+    file_bytes = file_size;
     file_offset = 0;
+    map_ns = stats_now() - start;
+    tracks_ns = sort_ns = 0;
+    track_ns.clear();
+    events.clear();
+    signatures.clear();
+    texts.clear();
+    notes.clear();
+    index_ns = 0;
+    error = QString();
+    // payloads never outgrow the file, so the arena is never reallocated
+    sysex_arena.clear();
+    sysex_arena.reserve(file_size);
     int ok = 0;
     // validate and load the midi data into memory for playing
     switch (read_id()) {
@@ -398,9 +450,20 @@ int MIDI_PLAYER::parseFile(char *file_name) {
         ok = read_riff(file_name);
         break;
     default:
-        QMessageBox::critical(this, "MIDI Player", QString("%1 is not a Standard MIDI File") .arg(file_name));
+        error = QString("%1 is not a Standard MIDI File") .arg(file_name);
         break;
     }
-    fclose(file);   // all data loaded or invalid file
+    munmap(map, file_size);   // all data loaded or invalid file
+    file_data = 0;
+    if (ok)
+        tempo_map.build(*this);
+    else
+        tempo_map.changes.clear();
+    parse_ns = stats_now() - start;
+    // cheap enough to do for every file, timed on its own
+    if (ok && analyze)
+        analyze_song(*this, analysis);
+    else
+        analysis.clear();
     return ok;
-}   // end parseFile
+}   // end load
@@ -0,0 +1,485 @@
+// live_thru.cpp -- part of MIDI_PLAYER
+// live input merged into a zone's destination, see live_thru.h
+// contains:
+//      thru_notes_create()  -- the block the player and thru threads share
+//      thru_notes_destroy()
+//      thru_notes_reset()
+//      LIVE_THRU()     -- constructor, map and filter from the options
+//      parseMap(), parseFilter() -- option syntax
+//      start()         -- client, stamping port and queue, thread
+//      stop()
+//      dropScheduled(), dropFile() -- the player stopped, asked and done
+//      report()        -- counts and latency for the Live menu
+//      run()           -- thru thread: input, forward
+//      forward()       -- filter, map, send, measure
+//      noteOn(), noteOff() -- bookkeeping shared with the file stream
+//      send(), queueTick(), cleanup()
+
+#include "live_thru.h"
+#include "options.h"
+#include "realtime.h"
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+enum {
+    FILTER_NOTES = 1, FILTER_CONTROL = 2, FILTER_PROGRAM = 4, FILTER_PRESSURE = 8,
+    FILTER_BEND = 16, FILTER_SYSEX = 32, FILTER_REALTIME = 64
+};
+
+static const char *const filter_names[] = {
+    "notes", "control", "program", "pressure", "bend", "sysex", "realtime"
+};
+
+THRU_NOTES *thru_notes_create() {
+    // no live notes; the file side starts out as after a stop
+    THRU_NOTES *notes = static_cast<THRU_NOTES *>(calloc(1, sizeof(THRU_NOTES)));
+    thru_notes_reset(notes);
+    return notes;
+}
+
+void thru_notes_destroy(THRU_NOTES *notes) {
+    free(notes);
+}
+
+void thru_notes_reset(THRU_NOTES *notes) {
+    if (!notes)
+        return;
+    memset(notes->owed, 0, sizeof(notes->owed));
+    memset(notes->file_on, 0xff, sizeof(notes->file_on));
+    memset(notes->file_off, 0xff, sizeof(notes->file_off));
+}
+
+static int kindOf(int type) {
+    // 0 for events that are not MIDI, they are never forwarded
+    switch (type) {
+    case SND_SEQ_EVENT_NOTEON:
+    case SND_SEQ_EVENT_NOTEOFF:
+        return FILTER_NOTES;
+    case SND_SEQ_EVENT_CONTROLLER:
+    case SND_SEQ_EVENT_CONTROL14:
+    case SND_SEQ_EVENT_NONREGPARAM:
+    case SND_SEQ_EVENT_REGPARAM:
+        return FILTER_CONTROL;
+    case SND_SEQ_EVENT_PGMCHANGE:
+        return FILTER_PROGRAM;
+    case SND_SEQ_EVENT_KEYPRESS:
+    case SND_SEQ_EVENT_CHANPRESS:
+        return FILTER_PRESSURE;
+    case SND_SEQ_EVENT_PITCHBEND:
+        return FILTER_BEND;
+    case SND_SEQ_EVENT_SYSEX:
+        return FILTER_SYSEX;
+    case SND_SEQ_EVENT_CLOCK:
+    case SND_SEQ_EVENT_TICK:
+    case SND_SEQ_EVENT_START:
+    case SND_SEQ_EVENT_CONTINUE:
+    case SND_SEQ_EVENT_STOP:
+    case SND_SEQ_EVENT_SONGPOS:
+    case SND_SEQ_EVENT_SONGSEL:
+    case SND_SEQ_EVENT_QFRAME:
+    case SND_SEQ_EVENT_TUNE_REQUEST:
+    case SND_SEQ_EVENT_RESET:
+    case SND_SEQ_EVENT_SENSING:
+        return FILTER_REALTIME;
+    }
+    return 0;
+}
+
+int LIVE_THRU::parseMap(const char *spec, signed char map[16]) {
+    // "IN:OUT,..." with channels 1-16; IN * is every channel, OUT 0 drops
+    for (int ch = 0; ch < 16; ++ch)
+        map[ch] = ch;
+    if (!spec)
+        return 0;
+    for (const char *p = spec; *p; ) {
+        int in;
+        char *end;
+        if (*p == '*') {
+            in = 0;
+            end = const_cast<char *>(p + 1);
+        } else {
+            in = strtol(p, &end, 10);
+            if (end == p || in < 1 || in > 16)
+                return -1;
+        }
+        if (*end != ':')
+            return -1;
+        p = end + 1;
+        long out = strtol(p, &end, 10);
+        if (end == p || out < 0 || out > 16)
+            return -1;
+        for (int ch = 0; ch < 16; ++ch)
+            if (!in || ch == in - 1)
+                map[ch] = out - 1;
+        if (*end && *end != ',')
+            return -1;
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}   // end parseMap
+
+int LIVE_THRU::parseFilter(const char *spec) {
+    // comma separated kinds to drop, "none" for none
+    int filter = 0;
+    if (!spec || !strcmp(spec, "none"))
+        return 0;
+    for (const char *p = spec; *p; ) {
+        size_t len = strcspn(p, ",");
+        int bit = 0;
+        for (int i = 0; i < 7; ++i)
+            if (strlen(filter_names[i]) == len && !strncmp(p, filter_names[i], len))
+                bit = 1 << i;
+        if (!bit)
+            return -1;
+        filter |= bit;
+        p += len;
+        if (*p)
+            ++p;
+    }
+    return filter;
+}   // end parseFilter
+
+LIVE_THRU::LIVE_THRU(SEQ_ZONE *z, THRU_NOTES *n) :
+    zone(z), notes(n), seq(0), port(-1), queue(-1), status(0), running(false),
+    drop_asked(0), drop_done(0), events(0), filtered(0), failed(0), latency_sum_ns(0), latency_max_ns(0)
+{
+    // main() has checked both
+    parseMap(options.thru_map, map);
+    filter = parseFilter(options.thru_filter);
+    memset(latency_bins, 0, sizeof(latency_bins));
+    memset(put_back, 0xff, sizeof(put_back));
+    wake[0] = wake[1] = -1;
+    pthread_mutex_init(&drop_lock, NULL);
+    pthread_cond_init(&drop_cond, NULL);
+    snd_seq_queue_status_malloc(&status);
+}
+
+LIVE_THRU::~LIVE_THRU() {
+    stop();
+    snd_seq_queue_status_free(status);
+    pthread_cond_destroy(&drop_cond);
+    pthread_mutex_destroy(&drop_lock);
+}
+
+bool LIVE_THRU::start(const char *source) {
+    if (running)
+        return true;
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+    if (err < 0) {
+        seq = 0;
+        error = QString("Cannot open the sequencer\n%1") .arg(snd_strerror(err));
+        return false;
+    }
+    snd_seq_set_client_name(seq, "midi_player thru");
+    // the queue only runs to stamp arrivals, in real time
+    queue = snd_seq_alloc_named_queue(seq, "thru");
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_port_info_set_name(pinfo, "thru");
+    snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping(pinfo, 1);
+    snd_seq_port_info_set_timestamp_real(pinfo, 1);
+    snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+    err = queue < 0 ? queue : snd_seq_create_port(seq, pinfo);
+    if (err < 0) {
+        error = QString("Cannot create the thru port\n%1") .arg(snd_strerror(err));
+        cleanup();
+        return false;
+    }
+    port = snd_seq_port_info_get_port(pinfo);
+    snd_seq_addr_t addr;
+    err = snd_seq_parse_address(seq, &addr, source);
+    if (err >= 0)
+        err = snd_seq_connect_from(seq, port, addr.client, addr.port);
+    if (err < 0) {
+        error = QString("Cannot take input from %1\n%2") .arg(source) .arg(snd_strerror(err));
+        cleanup();
+        return false;
+    }
+    // the note-offs we put back for the file go on the zone's queue
+    err = snd_seq_set_queue_usage(seq, zone->queue(), 1);
+    if (err < 0) {
+        error = QString("Cannot use the zone's queue\n%1") .arg(snd_strerror(err));
+        cleanup();
+        return false;
+    }
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+        wake[0] = wake[1] = -1;
+        error = QString("Cannot start the thru thread\n%1") .arg(strerror(errno));
+        cleanup();
+        return false;
+    }
+    snd_seq_start_queue(seq, queue, NULL);
+    snd_seq_drain_output(seq);
+    source_name = source;
+    events = filtered = failed = 0;
+    latency_sum_ns = latency_max_ns = 0;
+    memset(latency_bins, 0, sizeof(latency_bins));
+    running = true;
+    pthread_create(&thread, NULL, thread_main, this);
+    return true;
+}   // end start
+
+void LIVE_THRU::stop() {
+    // nothing may stay held: live notes still down would make the player
+    // hold back file note-offs, and closing the client takes the note-offs
+    // we put back with it.  Both end now
+    if (!running)
+        return;
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    unsigned int now = queueTick();
+    snd_seq_event_t off;
+    snd_seq_ev_clear(&off);
+    off.type = SND_SEQ_EVENT_NOTEOFF;
+    snd_seq_ev_set_fixed(&off);
+    for (int ch = 0; ch < 16; ++ch) {
+        for (int key = 0; key < 128; ++key) {
+            bool held = notes->live[ch][key];
+            __atomic_store_n(&notes->live[ch][key], 0, __ATOMIC_SEQ_CST);
+            bool owed = __atomic_exchange_n(&notes->owed[ch][key], 0, __ATOMIC_SEQ_CST);
+            if (!held && !owed && (put_back[ch][key] == THRU_NOTES::NEVER || put_back[ch][key] <= now))
+                continue;
+            off.data.note.channel = ch;
+            off.data.note.note = key;
+            if (zone->hasDest())
+                send(&off);
+        }
+    }
+    memset(put_back, 0xff, sizeof(put_back));
+    cleanup();
+}   // end stop
+
+void LIVE_THRU::cleanup() {
+    if (seq)
+        snd_seq_close(seq);     // frees the queue, the port and what we queued
+    seq = 0;
+    port = queue = -1;
+    for (int i = 0; i < 2; ++i) {
+        if (wake[i] >= 0)
+            close(wake[i]);
+        wake[i] = -1;
+    }
+}
+
+void LIVE_THRU::dropScheduled() {
+    // called by whoever stopped the player.  put_back[], the file side
+    // of the notes and our client handle belong to the thru thread, so
+    // it does the work; without a thread this one can
+    pthread_mutex_lock(&drop_lock);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&drop_lock);
+        thru_notes_reset(notes);
+        return;
+    }
+    unsigned int want = __atomic_add_fetch(&drop_asked, 1, __ATOMIC_RELEASE);
+    char c = 0;
+    while (write(wake[1], &c, 1) < 0 && errno == EINTR)
+        ;
+    while (static_cast<int>(drop_done - want) < 0)     // a later drop answers ours too
+        pthread_cond_wait(&drop_cond, &drop_lock);
+    pthread_mutex_unlock(&drop_lock);
+}   // end dropScheduled
+
+void LIVE_THRU::dropFile() {
+    // the thru thread's side of dropScheduled(): after this no note-off
+    // can be put back for a note of the stopped song
+    pthread_mutex_lock(&drop_lock);
+    unsigned int asked = drop_asked;
+    pthread_mutex_unlock(&drop_lock);
+    thru_notes_reset(notes);
+    if (zone->hasDest()) {
+        // our output buffer is always empty, so this is only the ioctl
+        snd_seq_remove_events_t *rm;
+        snd_seq_remove_events_alloca(&rm);
+        snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_DEST);
+        snd_seq_remove_events_set_queue(rm, zone->queue());
+        snd_seq_remove_events_set_dest(rm, zone->dest());
+        snd_seq_remove_events(seq, rm);
+    }
+    memset(put_back, 0xff, sizeof(put_back));
+    pthread_mutex_lock(&drop_lock);
+    drop_done = asked;
+    pthread_cond_broadcast(&drop_cond);
+    pthread_mutex_unlock(&drop_lock);
+}   // end dropFile
+
+QString LIVE_THRU::report() const {
+    if (!running && !events)
+        return QString("Live thru is off");
+    QString text = QString("Live thru from %1%2\n%3 events forwarded, %4 filtered, %5 failed\n")
+            .arg(source_name) .arg(running ? "" : " (stopped)") .arg(events) .arg(filtered) .arg(failed);
+    if (!events)
+        return text + "No latency measured yet";
+    // 99th percentile to the next bin edge
+    unsigned long long want = events - events / 100, seen = 0;
+    int bin = 0;
+    while (bin < LATENCY_BINS && (seen += latency_bins[bin]) < want)
+        ++bin;
+    QString p99 = bin < LATENCY_BINS ? QString::number((bin + 1) * BIN_NS / 1000) : QString("over 10000");
+    text += QString("Added latency: avg %1 us, 99% under %2 us, worst %3 us")
+            .arg(latency_sum_ns / 1e3 / events, 0, 'f', 1) .arg(p99) .arg(latency_max_ns / 1e3, 0, 'f', 1);
+    return text;
+}   // end report
+
+void *LIVE_THRU::thread_main(void *self) {
+    static_cast<LIVE_THRU *>(self)->run();
+    return 0;
+}
+
+void LIVE_THRU::run() {
+    // the thread alone, the GUI keeps normal scheduling
+    if (options.rt_priority > 0)
+        rt_enter(rt_policy(options.rt_policy), options.rt_priority);
+    int npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
+    struct pollfd pfd[5];
+    if (npfd > 4)
+        npfd = 4;
+    snd_seq_poll_descriptors(seq, pfd, npfd, POLLIN);
+    pfd[npfd].fd = wake[0];
+    pfd[npfd].events = POLLIN;
+    unsigned int drops_seen = 0;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&drop_asked, __ATOMIC_ACQUIRE) != drops_seen) {
+            char c;
+            while (read(wake[0], &c, 1) > 0)
+                ;
+            drops_seen = __atomic_load_n(&drop_asked, __ATOMIC_ACQUIRE);
+            dropFile();
+        }
+        snd_seq_event_t *ev;
+        int err = snd_seq_event_input(seq, &ev);
+        if (err == -EAGAIN) {
+            poll(pfd, npfd + 1, 100);   // wakes up to notice stop() and drops
+            continue;
+        }
+        if (err >= 0)
+            forward(ev);
+    }
+    // running is already off, so a drop asked for after this look does
+    // its own work; one asked for before it is done here
+    pthread_mutex_lock(&drop_lock);
+    bool pending = drop_asked != drop_done;
+    pthread_mutex_unlock(&drop_lock);
+    if (pending)
+        dropFile();
+}   // end run
+
+unsigned int LIVE_THRU::queueTick() {
+    if (snd_seq_get_queue_status(seq, zone->queue(), status) < 0)
+        return 0;
+    return snd_seq_queue_status_get_tick_time(status);
+}
+
+int LIVE_THRU::send(snd_seq_event_t *ev) {
+    ev->source.port = port;
+    ev->dest = *zone->dest();
+    snd_seq_ev_set_direct(ev);
+    int err = snd_seq_event_output_direct(seq, ev);
+    if (err < 0)
+        ++failed;
+    return err;
+}
+
+void LIVE_THRU::forward(snd_seq_event_t *ev) {
+    int kind = kindOf(ev->type);
+    if (!kind || (kind & filter) || !zone->hasDest()) {
+        ++filtered;
+        return;
+    }
+    if (snd_seq_ev_is_channel_type(ev)) {
+        // note and control events keep the channel in the same place
+        int ch = map[ev->data.note.channel & 0x0f];
+        if (ch < 0) {
+            ++filtered;
+            return;
+        }
+        ev->data.note.channel = ch;
+    }
+    snd_seq_real_time_t arrival = ev->time.time;
+    bool release = ev->type == SND_SEQ_EVENT_NOTEOFF ||
+                   (ev->type == SND_SEQ_EVENT_NOTEON && !ev->data.note.velocity);
+    if (release && !noteOff(ev)) {
+        ++events;   // held back, the file still holds the key
+        return;
+    }
+    bool start = ev->type == SND_SEQ_EVENT_NOTEON && ev->data.note.velocity;
+    if (send(ev) < 0)
+        return;
+    // the thru queue's clock, the one that stamped the arrival
+    if (snd_seq_get_queue_status(seq, queue, status) >= 0) {
+        const snd_seq_real_time_t *now = snd_seq_queue_status_get_real_time(status);
+        long long ns = (now->tv_sec - static_cast<long long>(arrival.tv_sec)) * 1000000000LL +
+                       now->tv_nsec - static_cast<long long>(arrival.tv_nsec);
+        if (ns < 0)
+            ns = 0;
+        latency_sum_ns += ns;
+        if (ns > latency_max_ns)
+            latency_max_ns = ns;
+        ++latency_bins[ns / BIN_NS < LATENCY_BINS ? ns / BIN_NS : LATENCY_BINS];
+    }
+    ++events;
+    if (start)
+        noteOn(ev);     // after the note went out, it is the latency that counts
+}   // end forward
+
+void LIVE_THRU::noteOn(snd_seq_event_t *ev) {
+    // a note-off the file has queued for this key would cut the live note
+    // short: take it back, the live release ends the file's note as well.
+    // The removal searches the library output buffer as well as the
+    // queue, so one the player has not drained yet is caught too
+    int ch = ev->data.note.channel & 0x0f, key = ev->data.note.note & 0x7f;
+    unsigned char held = notes->live[ch][key];
+    if (held < 255)
+        __atomic_store_n(&notes->live[ch][key], held + 1, __ATOMIC_SEQ_CST);
+    unsigned int on = __atomic_load_n(&notes->file_on[ch][key], __ATOMIC_SEQ_CST);
+    unsigned int off = __atomic_load_n(&notes->file_off[ch][key], __ATOMIC_SEQ_CST);
+    if (on == THRU_NOTES::NEVER || off == THRU_NOTES::NEVER || off <= queueTick())
+        return;
+    zone->withdrawNoteOff(ch, key);     // under the zone's output lock
+    __atomic_store_n(&notes->owed[ch][key], 1, __ATOMIC_SEQ_CST);
+}   // end noteOn
+
+bool LIVE_THRU::noteOff(snd_seq_event_t *ev) {
+    // true if the note-off goes out now.  While the file holds the key it
+    // ends the note itself; a file note-off we owe is put back at its tick
+    int ch = ev->data.note.channel & 0x0f, key = ev->data.note.note & 0x7f;
+    unsigned char held = notes->live[ch][key];
+    if (!held)
+        return true;    // pressed before the thru started
+    __atomic_store_n(&notes->live[ch][key], held - 1, __ATOMIC_SEQ_CST);
+    if (held > 1)
+        return false;   // another live note on this key, the last release ends it
+    unsigned int on = __atomic_load_n(&notes->file_on[ch][key], __ATOMIC_SEQ_CST);
+    unsigned int off = __atomic_load_n(&notes->file_off[ch][key], __ATOMIC_SEQ_CST);
+    bool owed = __atomic_exchange_n(&notes->owed[ch][key], 0, __ATOMIC_SEQ_CST);
+    if (on == THRU_NOTES::NEVER)
+        return true;
+    unsigned int now = queueTick();
+    if (owed && off != THRU_NOTES::NEVER && off > now) {
+        // on the zone's queue, from our client; dropFile() clears it
+        snd_seq_event_t later;
+        snd_seq_ev_clear(&later);
+        later.type = SND_SEQ_EVENT_NOTEOFF;
+        snd_seq_ev_set_fixed(&later);
+        later.data.note.channel = ch;
+        later.data.note.note = key;
+        later.source.port = port;
+        later.dest = *zone->dest();
+        later.queue = zone->queue();
+        later.flags |= SND_SEQ_TIME_STAMP_TICK;
+        later.time.tick = off;
+        if (snd_seq_event_output_direct(seq, &later) < 0) {
+            // nothing would end the note: the live note-off does it now
+            ++failed;
+            return true;
+        }
+        put_back[ch][key] = off;
+    }
+    return !(on <= now && (off == THRU_NOTES::NEVER || now < off));
+}   // end noteOff
@@ -0,0 +1,87 @@
+#ifndef LIVE_THRU_H
+#define LIVE_THRU_H
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <QString>
+#include "seq_session.h"
+
+// Which notes the file stream and the live input hold on each output
+// channel and key.  The player thread writes the file side when it
+// schedules a note, the thru thread the live side.  A key gets its note-off only when neither
+// side holds it any more.
+struct THRU_NOTES {
+    enum { NEVER = 0xffffffffu };
+    unsigned char live[16][128];    // live note-ons not yet released
+    unsigned char owed[16][128];    // the file's note-off was held back or withdrawn
+    unsigned int file_on[16][128];  // queue tick of the file's last note-on, NEVER if none
+    unsigned int file_off[16][128]; // queue tick of its note-off, NEVER until scheduled
+};
+
+THRU_NOTES *thru_notes_create();
+void thru_notes_destroy(THRU_NOTES *);
+// file side only, when the player stops; not while a thru thread runs,
+// LIVE_THRU::dropScheduled() has it do this
+void thru_notes_reset(THRU_NOTES *);
+
+// Merges a live input port into a zone's destination.  It has its own
+// client, like MIDI_RECORDER, and sends every event as a direct event
+// from its thread as soon as it is read, after the channel map and
+// filter of --thru-map and --thru-filter.  The input port stamps events
+// with the real time of the thru queue; the same clock read right after
+// the output gives the latency the merge adds.
+// Implemented in live_thru.cpp.
+class LIVE_THRU {
+public:
+    LIVE_THRU(SEQ_ZONE *zone, THRU_NOTES *notes);
+    ~LIVE_THRU();
+
+    bool start(const char *source);     // false with errorString() set
+    void stop();
+    bool isRunning() const { return running; }
+    const QString &errorString() const { return error; }
+    // the player has stopped: forget the file side and the note-offs we
+    // queued for it.  The thru thread does it and this waits
+    void dropScheduled();
+    QString report() const;
+
+    // option parsers for main(), -1 on a bad spec
+    static int parseMap(const char *spec, signed char map[16]);
+    static int parseFilter(const char *spec);
+
+private:
+    enum { LATENCY_BINS = 1000, BIN_NS = 10000 };   // 10 us bins up to 10 ms
+
+    static void *thread_main(void *);
+    void run();
+    void forward(snd_seq_event_t *);
+    void noteOn(snd_seq_event_t *);
+    bool noteOff(snd_seq_event_t *);
+    void dropFile();
+    int send(snd_seq_event_t *);
+    unsigned int queueTick();
+    void cleanup();
+
+    SEQ_ZONE *zone;
+    THRU_NOTES *notes;
+    snd_seq_t *seq;
+    int port, queue;
+    snd_seq_queue_status_t *status;
+    signed char map[16];    // output channel of each input channel, -1 drops it
+    int filter;             // event kinds dropped
+    bool running;
+    pthread_t thread;
+    int wake[2];            // a byte here has the thread look at drop_asked
+    pthread_mutex_t drop_lock;
+    pthread_cond_t drop_cond;
+    unsigned int drop_asked, drop_done;     // dropScheduled() calls asked and answered
+    QString source_name;
+    QString error;
+    // written by the thru thread only
+    unsigned long long events, filtered, failed;
+    long long latency_sum_ns, latency_max_ns;
+    unsigned int latency_bins[LATENCY_BINS + 1];
+    unsigned int put_back[16][128];     // tick of a file note-off we queued, NEVER if none
+};
+
+#endif // LIVE_THRU_H
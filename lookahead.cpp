@@ -0,0 +1,127 @@
+// lookahead.cpp -- part of MIDI_PLAYER
+// adaptive lookahead for play_midi(): how far ahead of the queue
+// position events may be scheduled, in milliseconds of the current tempo.
+// contains:
+//      LOOKAHEAD()  -- constructor, reads --lookahead/--lookahead-max
+//      wait()       -- the slow path of feed() and reach(): drain, check, sleep, adapt
+//      now_ns()
+//      outputFree() -- free cells in the zone client's output pool
+
+#include "lookahead.h"
+#include "options.h"
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <algorithm>
+
+// below this many free cells the next write could block in the kernel
+static const int MIN_ROOM = 64;
+
+LOOKAHEAD::LOOKAHEAD(SEQ_ZONE *z, double ticks_per_quarter, int us_per_quarter, PLAYER_STATS *s,
+                     const int *stop) :
+    zone(z), seq(z->handle()), queue(z->queue()), ppq(ticks_per_quarter), tempo(us_per_quarter), stats(s), cancel(stop),
+    status(0), fed(0), horizon(0), worst_late_ns(0), slept_count(0)
+{
+    min_ms = options.lookahead_ms;
+    max_ms = std::max(options.lookahead_max_ms, options.lookahead_ms);
+    target_ms = min_ms;
+    // allocated here, before a real-time loop starts
+    if (min_ms <= 0 || snd_seq_queue_status_malloc(&status) < 0) {
+        status = 0;
+        horizon = UINT_MAX;     // no flow control, the pool limits us as before
+    }
+    if (stats)
+        stats->lookahead_target_ms = target_ms;
+}
+
+LOOKAHEAD::~LOOKAHEAD() {
+    if (status)
+        snd_seq_queue_status_free(status);
+}
+
+unsigned int LOOKAHEAD::msToTicks(double ms) const {
+    return static_cast<unsigned int>(ms * 1000 / tempo * ppq);
+}
+
+double LOOKAHEAD::ticksToMs(unsigned int ticks) const {
+    return ticks / ppq * tempo / 1000;
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int LOOKAHEAD::outputFree() {
+    snd_seq_client_pool_t *pool;
+    snd_seq_client_pool_alloca(&pool);
+    if (snd_seq_get_client_pool(seq, pool) < 0)
+        return INT_MAX;
+    return snd_seq_client_pool_get_output_free(pool);
+}
+
+bool LOOKAHEAD::wait(unsigned int tick, const unsigned int *watch, unsigned int seen) {
+    // the queue can only catch up with what it has been given
+    zone->lockOutput();
+    snd_seq_drain_output(seq);
+    zone->unlockOutput();
+    if (stats)
+        __atomic_add_fetch(&stats->drains, 1, __ATOMIC_RELAXED);
+    bool slept = false, late = false;
+    for (;;) {
+        if (snd_seq_get_queue_status(seq, queue, status) < 0 ||
+            !(snd_seq_queue_status_get_status(status) & 1)) {
+            // stopped or gone: let the pool do the limiting until the next check
+            horizon = tick;
+            break;
+        }
+        unsigned int now = snd_seq_queue_status_get_tick_time(status);
+        double lead = fed > now ? ticksToMs(fed - now) : 0;
+        if (slept && !late && lead < target_ms / 4) {
+            // we overslept and nearly ran dry: the system is loaded
+            late = true;
+            target_ms = std::min(max_ms, target_ms * 1.5);
+            if (stats)
+                ++stats->lookahead_late;
+        }
+        horizon = now + msToTicks(target_ms);
+        if (stats) {
+            stats->lookahead_ms = lead;
+            stats->lookahead_target_ms = target_ms;
+        }
+        if (tick <= horizon && outputFree() >= MIN_ROOM)
+            break;
+        if (watch && __atomic_load_n(watch, __ATOMIC_ACQUIRE) != seen)
+            return false;
+        if (cancel && __atomic_load_n(cancel, __ATOMIC_ACQUIRE))
+            return false;
+        // sleep until the queue is near enough, but never past half the
+        // lead so a slow wakeup still finds events waiting
+        double ms = tick > horizon ? ticksToMs(tick - horizon) : target_ms / 4;
+        ms = std::max(1.0, std::min(ms, target_ms / 2));
+        // to a deadline, so the wakeup latency of the run can be measured
+        long long deadline = now_ns() + static_cast<long long>(ms * 1000000);
+        struct timespec ts = { static_cast<time_t>(deadline / 1000000000), static_cast<long>(deadline % 1000000000) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+        long long late_ns = now_ns() - deadline;
+        slept = true;
+        ++slept_count;
+        if (late_ns > worst_late_ns)
+            worst_late_ns = late_ns;
+        if (stats) {
+            ++stats->lookahead_waits;
+            stats->wakeup_late_ns += late_ns;
+            if (late_ns > stats->wakeup_late_max_ns)
+                stats->wakeup_late_max_ns = late_ns;
+        }
+    }   // end FOR (until the queue is close enough)
+    if (!late && target_ms > min_ms) {
+        // kept up: drift back towards the shortest lookahead
+        target_ms -= (target_ms - min_ms) / 16;
+        if (stats)
+            stats->lookahead_target_ms = target_ms;
+    }
+    return true;
+}   // end wait
@@ -0,0 +1,66 @@
+#ifndef LOOKAHEAD_H
+#define LOOKAHEAD_H
+
+#include <alsa/asoundlib.h>
+#include "player_stats.h"
+#include "seq_session.h"
+
+// Flow control for the player.  Events are kept a bounded musical
+// time ahead of the queue position instead of however many fit in the
+// client output pool.  The target widens when the feeder wakes up late
+// (the system is loaded) and slowly narrows back while it keeps up, so
+// pause, seek and tempo changes have little scheduled audio to wait out.
+// While *cancel is set no wait sleeps: the player is being stopped.
+class LOOKAHEAD {
+public:
+    LOOKAHEAD(SEQ_ZONE *zone, double ppq, int tempo, PLAYER_STATS *stats, const int *cancel);
+    ~LOOKAHEAD();
+
+    // call before scheduling an event at tick; sleeps while the queue is
+    // further behind than the target allows
+    void feed(unsigned int tick) {
+        if (tick > horizon)
+            wait(tick);
+        if (tick > fed)
+            fed = tick;
+    }
+    // the same, but gives up and returns false as soon as *watch is no
+    // longer seen or the player is cancelled, so the caller can act on
+    // that before it goes on
+    bool reach(unsigned int tick, const unsigned int *watch, unsigned int seen) {
+        if (tick > horizon && !wait(tick, watch, seen))
+            return false;
+        if (tick > fed)
+            fed = tick;
+        return true;
+    }
+    void setTempo(int us_per_quarter) { tempo = us_per_quarter; }
+
+    double targetMs() const { return target_ms; }
+    unsigned int lastFed() const { return fed; }
+    // how far past its deadline the latest wakeup of this player was
+    long long worstWakeupNs() const { return worst_late_ns; }
+    unsigned long long sleeps() const { return slept_count; }
+
+private:
+    bool wait(unsigned int tick, const unsigned int *watch = 0, unsigned int seen = 0);
+    unsigned int msToTicks(double ms) const;
+    double ticksToMs(unsigned int ticks) const;
+    int outputFree();
+
+    SEQ_ZONE *zone;
+    snd_seq_t *seq;
+    int queue;
+    double ppq;
+    int tempo;
+    PLAYER_STATS *stats;
+    const int *cancel;
+    snd_seq_queue_status_t *status;
+    double min_ms, max_ms, target_ms;
+    unsigned int fed;       // latest tick handed to the sequencer
+    unsigned int horizon;   // ticks up to here go out without a check
+    long long worst_late_ns;
+    unsigned long long slept_count;
+};
+
+#endif // LOOKAHEAD_H
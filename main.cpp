@@ -1,10 +1,198 @@
 #include <QtGui/QApplication>
 #include "midi_player.h"
+#include "options.h"
+#include "realtime.h"
+#include "parse_bench.h"
+#include "song_analysis.h"
+#include "player_stats.h"
+#include "live_thru.h"
+#include "render.h"
+#include "smf_convert.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <vector>
+
+PLAYER_OPTIONS options = {
+    "auto",     // timer
+    0,          // timer_freq
+    true,       // calibrate
+    0,          // rt_priority
+    "fifo",     // rt_policy
+    0,          // rt_selftest
+    256,        // sysex_chunk
+    3125,       // sysex_rate, MIDI DIN speed
+    1,          // zones
+    false,      // stats
+    0,          // stats_json
+    0,          // stats_log
+    250,        // lookahead_ms
+    2000,       // lookahead_max_ms
+    0,          // voices
+    "oldest",   // voice_steal
+    0,          // voice_priority
+    0,          // thru
+    0,          // thru_map
+    "realtime", // thru_filter
+    0           // control
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+            "  --timer=auto|hrtimer|system|pcm  queue timer source (default auto)\n"
+            "  --timer-freq=HZ                  preferred queue timer frequency\n"
+            "  --no-calibrate                   skip the startup timer measurement\n"
+            "  --rt[=PRIO]                      real-time playback, default priority 50\n"
+            "  --rt-policy=fifo|rr              real-time scheduling policy\n"
+            "  --rt-selftest[=SECONDS]          report worst wakeup latency at startup; the worst\n"
+            "                                   during playback is in the statistics and on stderr\n"
+            "  --sysex-chunk=BYTES              split longer sysex messages (default 256, 0 = never)\n"
+            "  --sysex-rate=BYTES_PER_SEC       pace sysex at this rate (default 3125, 0 = no pacing)\n"
+            "  --zones=N                        open N independent player windows (default 1)\n"
+            "  --stats                          keep parse, output and transport statistics\n"
+            "  --stats-json=FILE                write the statistics as JSON at exit (implies --stats)\n"
+            "  --stats-log=SECONDS              print a statistics line every SECONDS (implies --stats)\n"
+            "  --lookahead=MS                   schedule at least MS ahead of the queue (default 250, 0 = no limit)\n"
+            "  --lookahead-max=MS               widest lookahead under load (default 2000)\n"
+            "  --voices=N                       limit the notes sounding on the destination (max 256)\n"
+            "  --voice-steal=oldest|quietest|priority|drop\n"
+            "                                   what makes room over the limit (default oldest)\n"
+            "  --voice-priority=CH,CH,...       channels that keep their voices longest, first wins\n"
+            "  --thru=CLIENT:PORT               merge this live input into the first window's output\n"
+            "  --thru-map=IN:OUT,...            remap live channels, IN may be *, OUT 0 drops\n"
+            "  --thru-filter=KIND,...|none      live events to drop: notes, control, program, pressure,\n"
+            "                                   bend, sysex, realtime (default realtime)\n"
+            "  --control=PATH                   take transport commands on a Unix socket (first window)\n"
+            "       %s --bench-parse FILE...   compare track decoder speed, no GUI\n"
+            "       %s --analyze FILE...       polyphony, bandwidth and bursts of each file, no GUI\n"
+            "       %s --verify-decoder [TRACKS] check the vectorized decoder on a generated corpus\n"
+            "       %s --verify-analysis [SONGS] check parallel song analysis against one pass\n"
+            "       %s --render FILE OUT.wav [RATE] render to 16-bit stereo WAV with the built-in synth\n"
+            "       %s --convert [--strip] DIR OUTDIR  every MIDI file under DIR to type 0 under OUTDIR\n"
+            "       %s --verify-convert          check what --strip keeps around controller and device resets\n",
+            prog, prog, prog, prog, prog, prog, prog, prog);
+}
 
 int main(int argc, char *argv[])
 {
-    QApplication a(argc, argv);
-    MIDI_PLAYER w;
-    w.show();
-    return a.exec();
+    // modes that work on files only, before any display is needed
+    if (argc > 1 && !strcmp(argv[1], "--bench-parse"))
+        return bench_parse(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "--analyze"))
+        return analyze_files(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "--verify-decoder"))
+        return verify_decoder(argc > 2 ? atoi(argv[2]) : 2000);
+    if (argc > 1 && !strcmp(argv[1], "--verify-analysis"))
+        return verify_analysis(argc > 2 ? atoi(argv[2]) : 20);
+    if (argc > 1 && !strcmp(argv[1], "--render"))
+        return render_file(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "--convert"))
+        return convert_files(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "--verify-convert"))
+        return verify_convert();
+    QApplication a(argc, argv);     // removes the Qt options from argv
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--timer=", 8))
+            options.timer = argv[i] + 8;
+        else if (!strncmp(argv[i], "--timer-freq=", 13))
+            options.timer_freq = atoi(argv[i] + 13);
+        else if (!strcmp(argv[i], "--no-calibrate"))
+            options.calibrate = false;
+        else if (!strcmp(argv[i], "--rt"))
+            options.rt_priority = 50;
+        else if (!strncmp(argv[i], "--rt=", 5))
+            options.rt_priority = atoi(argv[i] + 5);
+        else if (!strncmp(argv[i], "--rt-policy=", 12))
+            options.rt_policy = argv[i] + 12;
+        else if (!strcmp(argv[i], "--rt-selftest"))
+            options.rt_selftest = 5;
+        else if (!strncmp(argv[i], "--rt-selftest=", 14))
+            options.rt_selftest = atof(argv[i] + 14);
+        else if (!strncmp(argv[i], "--sysex-chunk=", 14))
+            options.sysex_chunk = atoi(argv[i] + 14);
+        else if (!strncmp(argv[i], "--sysex-rate=", 13))
+            options.sysex_rate = atoi(argv[i] + 13);
+        else if (!strncmp(argv[i], "--zones=", 8))
+            options.zones = atoi(argv[i] + 8);
+        else if (!strcmp(argv[i], "--stats"))
+            options.stats = true;
+        else if (!strncmp(argv[i], "--stats-json=", 13)) {
+            options.stats = true;
+            options.stats_json = argv[i] + 13;
+        }
+        else if (!strncmp(argv[i], "--lookahead=", 12))
+            options.lookahead_ms = atoi(argv[i] + 12);
+        else if (!strncmp(argv[i], "--lookahead-max=", 16))
+            options.lookahead_max_ms = atoi(argv[i] + 16);
+        else if (!strncmp(argv[i], "--voices=", 9))
+            options.voices = atoi(argv[i] + 9);
+        else if (!strncmp(argv[i], "--voice-steal=", 14))
+            options.voice_steal = argv[i] + 14;
+        else if (!strncmp(argv[i], "--voice-priority=", 17))
+            options.voice_priority = argv[i] + 17;
+        else if (!strncmp(argv[i], "--thru=", 7))
+            options.thru = argv[i] + 7;
+        else if (!strncmp(argv[i], "--thru-map=", 11))
+            options.thru_map = argv[i] + 11;
+        else if (!strncmp(argv[i], "--thru-filter=", 14))
+            options.thru_filter = argv[i] + 14;
+        else if (!strncmp(argv[i], "--control=", 10))
+            options.control = argv[i] + 10;
+        else if (!strncmp(argv[i], "--stats-log=", 12)) {
+            options.stats = true;
+            options.stats_log = atoi(argv[i] + 12);
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    signed char thru_map[16];
+    if (options.zones < 1 || options.zones > 16 || options.voices < 0 || options.voices > 256 ||
+        rt_policy(options.rt_policy) < 0 ||
+        (strcmp(options.voice_steal, "oldest") && strcmp(options.voice_steal, "quietest") &&
+         strcmp(options.voice_steal, "priority") && strcmp(options.voice_steal, "drop")) ||
+        LIVE_THRU::parseMap(options.thru_map, thru_map) < 0 || LIVE_THRU::parseFilter(options.thru_filter) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.rt_selftest > 0) {
+        RT_LATENCY lat;
+        int err = rt_selftest(rt_policy(options.rt_policy), options.rt_priority > 0 ? options.rt_priority : 50,
+                              options.rt_selftest, &lat);
+        if (err < 0)
+            fprintf(stderr, "real-time self-test failed: %s\n", strerror(-err));
+        else
+            fprintf(stderr, "real-time self-test: %ld wakeups, avg %.1f us, worst %.1f us\n",
+                    lat.loops, lat.avg_us, lat.max_us);
+    }
+    // one window per zone, all on the same sequencer client
+    std::vector<MIDI_PLAYER *> zones;
+    for (int i = 0; i < options.zones; ++i) {
+        zones.push_back(new MIDI_PLAYER(0, i));
+        zones.back()->show();
+    }
+    int ret = a.exec();
+    if (options.stats_json) {
+        FILE *f = fopen(options.stats_json, "w");
+        if (!f) {
+            fprintf(stderr, "cannot write %s: %s\n", options.stats_json, strerror(errno));
+        } else {
+            fprintf(f, "{\"zones\": [");
+            for (int i = 0; i < options.zones; ++i) {
+                fprintf(f, i ? ",\n  " : "\n  ");
+                if (zones[i]->statistics())
+                    stats_json(f, zones[i]->statistics());
+                else
+                    fprintf(f, "null");
+            }
+            fprintf(f, "\n]}\n");
+            fclose(f);
+        }
+    }
+    for (int i = options.zones - 1; i >= 0; --i)
+        delete zones[i];
+    return ret;
 }
@@ -0,0 +1,68 @@
+// meta_text.cpp -- part of MIDI_PLAYER
+// string arena and tick index for the text meta events of a song
+// contains:
+//      kindOf()    -- meta type byte to META_TEXT::Kind
+//      clear()
+//      add()       -- append one string, called while parsing
+//      finish()    -- sort the indexes by tick
+//      text()
+//      find()      -- O(log n) "current" entry at a tick
+//      next()      -- O(log n) following entry
+//      tick_comp() -- sort helper function
+
+#include "meta_text.h"
+#include <algorithm>
+
+int META_TEXT::kindOf(unsigned char type) {
+    switch (type) {
+    case 0x01: return TEXT;
+    case 0x05: return LYRIC;
+    case 0x06: return MARKER;
+    case 0x07: return CUE;
+    default:   return -1;
+    }
+}
+
+void META_TEXT::clear() {
+    arena.clear();
+    for (int k = 0; k < KINDS; ++k)
+        index[k].clear();
+}
+
+void META_TEXT::add(int kind, unsigned int tick, const unsigned char *data, unsigned int len) {
+    entry e;
+    e.tick = tick;
+    e.offset = arena.size();
+    e.length = len;
+    arena.insert(arena.end(), data, data + len);
+    index[kind].push_back(e);
+}
+
+void META_TEXT::finish() {
+    // tracks arrive one after the other; stable keeps a track's order at
+    // equal ticks, which matters for lyric syllables
+    for (int k = 0; k < KINDS; ++k)
+        std::stable_sort(index[k].begin(), index[k].end(), tick_comp);
+}
+
+QString META_TEXT::text(int kind, int i) const {
+    const entry &e = index[kind][i];
+    // SMF text has no declared encoding, Latin-1 never fails
+    return e.length ? QString::fromLatin1(&arena[e.offset], e.length) : QString();
+}
+
+int META_TEXT::find(int kind, unsigned int tick) const {
+    entry key;
+    key.tick = tick;
+    std::vector<entry>::const_iterator it = std::upper_bound(index[kind].begin(), index[kind].end(), key, tick_comp);
+    return (it - index[kind].begin()) - 1;
+}
+
+int META_TEXT::next(int kind, unsigned int tick) const {
+    int i = find(kind, tick) + 1;
+    return i < count(kind) ? i : -1;
+}
+
+bool META_TEXT::tick_comp(const entry &e1, const entry &e2) {
+    return (e1.tick < e2.tick);
+}
@@ -0,0 +1,46 @@
+#ifndef META_TEXT_H
+#define META_TEXT_H
+
+#include <QString>
+#include <vector>
+
+// The text meta events of a song: text (FF 01), lyric (FF 05), marker
+// (FF 06) and cue point (FF 07).  The strings sit back to back in one
+// arena; each kind has its own tick-sorted index, so "the current lyric
+// at tick t" is a binary search and a display can follow playback every
+// frame.  Implemented in meta_text.cpp.
+class META_TEXT {
+public:
+    enum Kind { TEXT, LYRIC, MARKER, CUE, KINDS };
+
+    struct entry {
+        unsigned int tick;
+        unsigned int offset;    // start of the string in the arena
+        unsigned int length;
+    };
+
+    // meta event type byte to kind, -1 for the ones not kept
+    static int kindOf(unsigned char type);
+
+    void clear();
+    void add(int kind, unsigned int tick, const unsigned char *data, unsigned int len);
+    void finish();      // sort the indexes, once all tracks are in
+
+    int count(int kind) const { return index[kind].size(); }
+    const entry &at(int kind, int i) const { return index[kind][i]; }
+    QString text(int kind, int i) const;
+    // the raw bytes of an entry, at(kind, i).length of them
+    const char *data(int kind, int i) const { return arena.data() + index[kind][i].offset; }
+    // last entry of a kind at or before tick, -1 if there is none yet
+    int find(int kind, unsigned int tick) const;
+    // first entry of a kind after tick, -1 at the end
+    int next(int kind, unsigned int tick) const;
+
+private:
+    static bool tick_comp(const entry &e1, const entry &e2);
+
+    std::vector<char> arena;
+    std::vector<entry> index[KINDS];
+};
+
+#endif // META_TEXT_H
@@ -0,0 +1,113 @@
+// midi_decoder.cpp -- part of MIDI_PLAYER
+// the status byte table used by decode_track(), built at compile time,
+// and the high-bit scan behind decode_track_scan()
+// contains:
+//      status_table[]
+//      scan_high_bits() -- AVX2 / SSE2 / scalar high-bit mask of a track
+//      scan_mask_words(), scan_best_isa(), scan_isa_name()
+
+#include "midi_decoder.h"
+#include <string.h>
+
+#define STATUS_ROW(x) \
+    status_info(x + 0x0), status_info(x + 0x1), status_info(x + 0x2), status_info(x + 0x3), \
+    status_info(x + 0x4), status_info(x + 0x5), status_info(x + 0x6), status_info(x + 0x7), \
+    status_info(x + 0x8), status_info(x + 0x9), status_info(x + 0xa), status_info(x + 0xb), \
+    status_info(x + 0xc), status_info(x + 0xd), status_info(x + 0xe), status_info(x + 0xf)
+
+const STATUS_INFO status_table[256] = {
+    STATUS_ROW(0x00), STATUS_ROW(0x10), STATUS_ROW(0x20), STATUS_ROW(0x30),
+    STATUS_ROW(0x40), STATUS_ROW(0x50), STATUS_ROW(0x60), STATUS_ROW(0x70),
+    STATUS_ROW(0x80), STATUS_ROW(0x90), STATUS_ROW(0xa0), STATUS_ROW(0xb0),
+    STATUS_ROW(0xc0), STATUS_ROW(0xd0), STATUS_ROW(0xe0), STATUS_ROW(0xf0)
+};
+
+static_assert(status_info(0x9f).alsa_type == SND_SEQ_EVENT_NOTEON, "note on row");
+static_assert(status_info(0xc3).data_len == 1, "program change has one data byte");
+static_assert(status_info(0xf7).kind == MSG_SYSEX && !status_info(0xf7).running, "sysex keeps running status");
+static_assert(status_info(0xf1).kind == MSG_INVALID, "system common is not allowed in a file");
+
+size_t scan_mask_words(size_t len) {
+    // one spare word of set bits stops zero_run() at the end
+    return len / 64 + 2;
+}
+
+static void scan_tail(const unsigned char *p, size_t from, size_t len, unsigned long long *mask) {
+    for (size_t i = from; i < len; ++i)
+        if (p[i] & 0x80)
+            mask[i >> 6] |= 1ULL << (i & 63);
+    // everything past the end counts as a status byte
+    for (size_t i = len; i < (len & ~63UL) + 64; ++i)
+        mask[i >> 6] |= 1ULL << (i & 63);
+    mask[len / 64 + 1] = ~0ULL;
+}
+
+static void scan_scalar(const unsigned char *p, size_t len, unsigned long long *mask) {
+    // gather the top bit of 8 bytes at once with a multiply
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long x;
+        memcpy(&x, p + i, 8);
+        x = (x >> 7) & 0x0101010101010101ULL;
+        mask[i >> 6] |= ((x * 0x0102040810204080ULL) >> 56) << (i & 63);
+    }
+    scan_tail(p, i, len, mask);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+
+static void scan_sse2(const unsigned char *p, size_t len, unsigned long long *mask) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        mask[i >> 6] |= static_cast<unsigned long long>(_mm_movemask_epi8(v) & 0xffff) << (i & 63);
+    }
+    scan_tail(p, i, len, mask);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const unsigned char *p, size_t len, unsigned long long *mask) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        mask[i >> 6] |= static_cast<unsigned long long>(static_cast<unsigned int>(_mm256_movemask_epi8(v))) << (i & 63);
+    }
+    scan_tail(p, i, len, mask);
+}
+
+int scan_best_isa() {
+    return __builtin_cpu_supports("avx2") ? SCAN_AVX2 : SCAN_SSE2;
+}
+#else
+int scan_best_isa() {
+    return SCAN_SCALAR;
+}
+#endif
+
+void scan_high_bits(const unsigned char *p, size_t len, unsigned long long *mask, int isa) {
+    memset(mask, 0, scan_mask_words(len) * sizeof(*mask));
+    if (isa == SCAN_BEST)
+        isa = scan_best_isa();
+    switch (isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SCAN_AVX2:
+        scan_avx2(p, len, mask);
+        break;
+    case SCAN_SSE2:
+        scan_sse2(p, len, mask);
+        break;
+#endif
+    default:
+        scan_scalar(p, len, mask);
+        break;
+    }
+}   // end scan_high_bits
+
+const char *scan_isa_name(int isa) {
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    if (isa == SCAN_BEST)
+        isa = scan_best_isa();
+    return names[isa];
+}
@@ -0,0 +1,237 @@
+#ifndef MIDI_DECODER_H
+#define MIDI_DECODER_H
+
+// Table-driven decoder for the body of one MTrk chunk.
+// Every status byte is looked up once in status_table; the entry says
+// what kind of message it starts, how many data bytes follow and which
+// ALSA event it becomes.  Channel messages are decoded by a template
+// specialized on their data length, so the common case is a table
+// lookup and two byte loads.  decode_track_scan() adds a vectorized
+// pre-pass so runs of running-status events are taken in bulk.
+//
+// The SINK receives:
+//      void channel(unsigned tick, unsigned char type, unsigned char ch, unsigned char d1, unsigned char d2)
+//      bool sysex(unsigned tick, unsigned char cmd, const unsigned char *data, unsigned int len)
+//      bool meta(unsigned tick, unsigned char type, const unsigned char *data, unsigned int len)
+// sysex() and meta() return false to reject the track.
+
+#include <alsa/asoundlib.h>
+
+enum MIDI_MSG_KIND {
+    MSG_DATA,       // 0x00-0x7f, only valid as running status
+    MSG_CHANNEL1,   // channel message with one data byte
+    MSG_CHANNEL2,   // channel message with two data bytes
+    MSG_SYSEX,      // 0xf0, 0xf7
+    MSG_META,       // 0xff
+    MSG_INVALID     // other system messages, not allowed in a file
+};
+
+struct STATUS_INFO {
+    unsigned char kind;         // MIDI_MSG_KIND
+    unsigned char data_len;     // data bytes of a channel message
+    unsigned char alsa_type;    // SND_SEQ_EVENT_xxx of a channel message
+    unsigned char running;      // 1 if it becomes the running status
+};
+
+constexpr STATUS_INFO channel_info(unsigned char kind, unsigned char len, unsigned char type) {
+    return STATUS_INFO{ kind, len, type, 1 };
+}
+
+constexpr STATUS_INFO status_info(unsigned int s) {
+    return s < 0x80 ? STATUS_INFO{ MSG_DATA, 0, 0, 0 } :
+           s < 0x90 ? channel_info(MSG_CHANNEL2, 2, SND_SEQ_EVENT_NOTEOFF) :
+           s < 0xa0 ? channel_info(MSG_CHANNEL2, 2, SND_SEQ_EVENT_NOTEON) :
+           s < 0xb0 ? channel_info(MSG_CHANNEL2, 2, SND_SEQ_EVENT_KEYPRESS) :
+           s < 0xc0 ? channel_info(MSG_CHANNEL2, 2, SND_SEQ_EVENT_CONTROLLER) :
+           s < 0xd0 ? channel_info(MSG_CHANNEL1, 1, SND_SEQ_EVENT_PGMCHANGE) :
+           s < 0xe0 ? channel_info(MSG_CHANNEL1, 1, SND_SEQ_EVENT_CHANPRESS) :
+           s < 0xf0 ? channel_info(MSG_CHANNEL2, 2, SND_SEQ_EVENT_PITCHBEND) :
+           (s == 0xf0 || s == 0xf7) ? STATUS_INFO{ MSG_SYSEX, 0, SND_SEQ_EVENT_SYSEX, 0 } :
+           s == 0xff ? STATUS_INFO{ MSG_META, 0, 0, 0 } :
+           STATUS_INFO{ MSG_INVALID, 0, 0, 0 };
+}
+
+extern const STATUS_INFO status_table[256];
+
+// variable length quantity, at most 4 bytes; 0 on error
+inline const unsigned char *read_vlq(const unsigned char *p, const unsigned char *end, unsigned int *value) {
+    if (p < end && !(*p & 0x80)) {
+        *value = *p;    // most deltas fit one byte
+        return p + 1;
+    }
+    unsigned int v = 0;
+    for (int i = 0; i < 4 && p < end; ++i) {
+        unsigned char c = *p++;
+        v = (v << 7) | (c & 0x7f);
+        if (!(c & 0x80)) {
+            *value = v;
+            return p;
+        }
+    }
+    return 0;
+}
+
+template <int LEN> struct CHANNEL_DECODER;
+
+template <> struct CHANNEL_DECODER<1> {
+    template <class SINK>
+    static const unsigned char *decode(const unsigned char *p, unsigned int tick, unsigned char cmd,
+                                       unsigned char type, SINK &sink) {
+        sink.channel(tick, type, cmd & 0x0f, p[0] & 0x7f, 0);
+        return p + 1;
+    }
+};
+
+template <> struct CHANNEL_DECODER<2> {
+    template <class SINK>
+    static const unsigned char *decode(const unsigned char *p, unsigned int tick, unsigned char cmd,
+                                       unsigned char type, SINK &sink) {
+        sink.channel(tick, type, cmd & 0x0f, p[0] & 0x7f, p[1] & 0x7f);
+        return p + 2;
+    }
+};
+
+// Decode one event at p, advancing p, tick and the running status.
+// Returns 1 to go on, 0 after end-of-track, -1 on bad data (*error_at set).
+template <class SINK>
+__attribute__((always_inline)) inline int decode_event(const unsigned char *&p, const unsigned char *end, unsigned int &tick,
+                        unsigned char &last_cmd, SINK &sink, const unsigned char **error_at) {
+    unsigned int delta, len;
+    const unsigned char *at = p;
+    p = read_vlq(p, end, &delta);
+    if (!p || p >= end) {
+        *error_at = at;
+        return -1;
+    }
+    tick += delta;
+    unsigned char cmd = *p;
+    if (cmd & 0x80)
+        ++p;
+    else
+        cmd = last_cmd;     // running status
+    const STATUS_INFO &info = status_table[cmd];
+    if (p + info.data_len > end) {
+        *error_at = p;
+        return -1;
+    }
+    if (info.running)
+        last_cmd = cmd;
+    switch (info.kind) {
+    case MSG_CHANNEL2:
+        p = CHANNEL_DECODER<2>::decode(p, tick, cmd, info.alsa_type, sink);
+        return 1;
+    case MSG_CHANNEL1:
+        p = CHANNEL_DECODER<1>::decode(p, tick, cmd, info.alsa_type, sink);
+        return 1;
+    case MSG_SYSEX:
+        at = p;
+        p = read_vlq(p, end, &len);
+        if (!p || len > static_cast<unsigned int>(end - p) || !sink.sysex(tick, cmd, p, len)) {
+            *error_at = at;
+            return -1;
+        }
+        p += len;
+        return 1;
+    case MSG_META: {
+        if (p >= end) {
+            *error_at = p;
+            return -1;
+        }
+        unsigned char type = *p++;
+        at = p;
+        p = read_vlq(p, end, &len);
+        if (!p || len > static_cast<unsigned int>(end - p) || !sink.meta(tick, type, p, len)) {
+            *error_at = at;
+            return -1;
+        }
+        p += len;
+        return type == 0x2f ? 0 : 1;   // end of track
+    }
+    default:    // no running status yet, or a system message
+        *error_at = p;
+        return -1;
+    }   // end SWITCH kind
+}   // end decode_event
+
+// Decode [p, end).  Returns the position just after the end-of-track
+// meta event, or 0 with *error_at set to the offending byte.
+template <class SINK>
+const unsigned char *decode_track(const unsigned char *p, const unsigned char *end, SINK &sink,
+                                  const unsigned char **error_at) {
+    unsigned int tick = 0;
+    unsigned char last_cmd = 0;
+    while (p < end) {
+        int r = decode_event(p, end, tick, last_cmd, sink, error_at);
+        if (r <= 0)
+            return r ? 0 : p;
+    }   // end WHILE
+    *error_at = p;
+    return 0;   // track ended without an end-of-track event
+}   // end decode_track
+
+// Pre-pass: bit i of the mask is the high bit of byte i, so VLQ
+// terminators and status bytes are the clear and set bits.  Filled
+// with AVX2 or SSE2 when the CPU has them, else 8 bytes at a time;
+// bits past the end read as set.
+enum SCAN_ISA { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2, SCAN_BEST };
+size_t scan_mask_words(size_t len);
+void scan_high_bits(const unsigned char *p, size_t len, unsigned long long *mask, int isa=SCAN_BEST);
+int scan_best_isa();
+const char *scan_isa_name(int isa=SCAN_BEST);
+
+// number of clear bits starting at pos
+inline size_t zero_run(const unsigned long long *mask, size_t pos) {
+    size_t n = 0;
+    for (;;) {
+        size_t at = pos + n;
+        unsigned long long w = mask[at >> 6] >> (at & 63);
+        if (w)
+            return n + __builtin_ctzll(w);
+        n += 64 - (at & 63);
+    }
+}
+
+// a run of running-status channel messages whose deltas fit one byte
+template <int LEN> struct CHANNEL_RUN {
+    template <class SINK>
+    static const unsigned char *decode(const unsigned char *p, size_t count, unsigned int &tick,
+                                       unsigned char cmd, unsigned char type, SINK &sink) {
+        for (size_t i = 0; i < count; ++i, p += LEN + 1) {
+            tick += p[0];
+            sink.channel(tick, type, cmd & 0x0f, p[1], LEN == 2 ? p[2] : 0);
+        }
+        return p;
+    }
+};
+
+// Same result as decode_track(), using the mask to take whole runs of
+// note-dense running status at once.  Between runs it falls back to
+// decode_event().
+template <class SINK>
+const unsigned char *decode_track_scan(const unsigned char *begin, const unsigned char *end,
+                                       const unsigned long long *mask, SINK &sink,
+                                       const unsigned char **error_at) {
+    const unsigned char *p = begin;
+    unsigned int tick = 0;
+    unsigned char last_cmd = 0;
+    while (p < end) {
+        if (last_cmd) {
+            // every byte in the run is < 0x80, so it is delta, data, delta, data...
+            size_t run = zero_run(mask, p - begin);
+            const STATUS_INFO &info = status_table[last_cmd];
+            if (info.data_len == 2)
+                p = CHANNEL_RUN<2>::decode(p, run / 3, tick, last_cmd, info.alsa_type, sink);
+            else
+                p = CHANNEL_RUN<1>::decode(p, run / 2, tick, last_cmd, info.alsa_type, sink);
+            if (p >= end)
+                break;
+        }
+        int r = decode_event(p, end, tick, last_cmd, sink, error_at);
+        if (r <= 0)
+            return r ? 0 : p;
+    }   // end WHILE
+    *error_at = p;
+    return 0;
+}   // end decode_track_scan
+
+#endif // MIDI_DECODER_H
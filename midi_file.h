@@ -0,0 +1,89 @@
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+#include <QString>
+#include <vector>
+#include "meta_text.h"
+#include "note_index.h"
+#include "song_analysis.h"
+#include "tempo_map.h"
+
+// One parsed Standard MIDI File: the events of all tracks merged in
+// tick order, the sysex payloads and the song data the transport needs.
+// It knows nothing of windows or the sequencer, so files can be loaded
+// on a worker thread or without a display.  Implemented in file_parser.cpp.
+class MIDI_FILE {
+    friend struct TRACK_SINK;
+
+public:
+    struct event {
+        struct event *next;		// linked list
+        unsigned char type;		// SND_SEQ_EVENT_xxx
+        unsigned char port;		// port index, generally not used
+        unsigned int tick;
+        union {
+            unsigned char d[3];	// channel and data bytes
+            int tempo;
+            struct {
+                unsigned int offset;	// start of the payload in sysex_arena
+                unsigned int length;	// length of sysex data
+            } sysex;
+        } data;
+    };  // end struct event definition
+
+    // time (FF 58) and key (FF 59) signatures, which the player doesn't need
+    struct signature {
+        unsigned int tick;
+        unsigned char type;
+        unsigned char data[4];
+    };
+
+    MIDI_FILE();
+
+    // false with errorString() set; analyze=false skips SONG_ANALYSIS
+    bool load(const char *file_name, bool analyze = true);
+    const QString &errorString() const { return error; }
+    unsigned int lastTick() const { return events.empty() ? 0 : events.back().tick; }
+    double tickToSeconds(unsigned int tick) const;
+    unsigned int secondsToTick(double seconds) const;
+
+    std::vector<struct event> events;
+    std::vector<unsigned char> sysex_arena;	// all sysex payloads of the song, back to back
+    std::vector<signature> signatures;	// tick order
+    unsigned int init_tempo;	// us per quarter at tick 0
+    double PPQ, BPM;
+    double song_length_seconds;
+    bool minor_key;
+    int sf;     // sharps/flats
+    META_TEXT texts;    // lyrics, markers, cue points and text
+    NOTE_INDEX notes;   // every note as a start/end interval
+    TEMPO_MAP tempo_map;    // tick <-> seconds, made by load()
+    SONG_ANALYSIS analysis;     // polyphony and bandwidth, made by load()
+    // what the last load() cost, a few clock reads per track
+    long long parse_ns, map_ns, tracks_ns, sort_ns, index_ns;
+    std::vector<long long> track_ns;
+    int file_bytes;
+
+private:
+    inline int read_id(void);
+    inline int read_byte(void);
+    inline void skip(int);
+    inline bool at_eof(void);
+    static bool tick_comp(const struct event& e1, const struct event& e2);
+    int read_int(int);
+    int read_32_le(void);
+    int read_smf(const char *);
+    int read_riff(const char *);
+    int read_track(int, const char *);
+
+    // parse state, only valid inside load()
+    const unsigned char *file_data;
+    int file_size;
+    int file_offset;
+    int prev_tick;
+    int smpte_timing;
+    std::vector<unsigned long long> scan_mask;  // high-bit mask of the current track
+    QString error;
+};
+
+#endif // MIDI_FILE_H
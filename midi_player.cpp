@@ -12,76 +12,249 @@
  *  send_data
  *  send_SysEx
  *  init_seq
- *  close_seq
  *  connect_port
  *  disconnect_port
- *  tickDisplay
+ *  reset_tempo
+ *  setupTimer
+ *  tickDisplay     -- SLOT
+ *  songEnded       -- SLOT
+ *  seqInput        -- SLOT
+ *  fileLoaded      -- SLOT
+ *  songChanged
+ *  showStats       -- SLOT
+ *  statsTick       -- SLOT
+ *  loopSetA        -- SLOT
+ *  loopSetB        -- SLOT
+ *  loopByTicks     -- SLOT
+ *  loopByTime      -- SLOT
+ *  loopByMarker    -- SLOT
+ *  loopClear       -- SLOT
+ *  songPosition
+ *  setLoop
+ *  displayPosition
+ *  seekTo
+ *  markerName
+ *  fillMarkers
+ *  markerJump      -- SLOT
+ *  markerNext      -- SLOT
+ *  markerPrevious  -- SLOT
+ *  showLyrics      -- SLOT
+ *  lyricsTick      -- SLOT
+ *  showAnalysis    -- SLOT
+ *  showRoll        -- SLOT
+ *  rollTick        -- SLOT
+ *  rollSeek        -- SLOT
+ *  recordStart     -- SLOT
+ *  recordStop      -- SLOT
+ *  thruStart       -- SLOT
+ *  thruStop        -- SLOT
+ *  thruReport      -- SLOT
+ *  showTransforms  -- SLOT
+ *  transformEdited -- SLOT
+ *  transformReset  -- SLOT
+ *  transformShow
+ *  controlSync     -- SLOT
+ *  transportPlay, transportHalt, transportStop, transportPause,
+ *  transportResume, transportSeek -- the queue and player, no widgets
+ *  startPlayer, stopPlayer -- on the player pool
+ *  notesOff
+ *  control_command, controlCommand, controlLoad,
+ *  controlTransform -- control socket thread
+ *  record_parse
  *  getRawDev
  *  getPorts
 */
 
 #include "midi_player.h"
 #include "ui_midi_player.h"
+#include "options.h"
 #include <alsa/asoundlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <signal.h>
-#include <sys/wait.h>
 #include <vector>
 #include <algorithm>
 #include <QtDebug>
 #include <QTimer>
+#include <QSocketNotifier>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QtConcurrentRun>
 #include <iostream>
 
-#define MAKE_ID(c1, c2, c3, c4) ((c1) | ((c2) << 8) | ((c3) << 16) | ((c4) << 24))
-
-// STATIC vars
-snd_seq_t *MIDI_PLAYER::seq=0;
-snd_seq_addr_t *MIDI_PLAYER::ports=0;
-double MIDI_PLAYER::song_length_seconds=0;
-
-// FILE global vars
-snd_seq_queue_status_t *status;
-char playfile[PATH_MAX];
-pid_t pid=0;
-char port_name[16];
-char MIDI_dev[16];
-
 // INLINE functions
 void MIDI_PLAYER::check_snd(const char *operation, int err)
 {
     if (err < 0)
         QMessageBox::critical(this, "MIDI Player", QString("Cannot %1\n%2") .arg(operation) .arg(snd_strerror(err)));
 }
-int MIDI_PLAYER::read_id(void) {
-    return read_32_le();
+
+// m:ss for menus and tooltips
+static QString mmss(double seconds) {
+    int s = static_cast<int>(seconds);
+    return QString("%1:%2") .arg(s/60) .arg(s%60, 2, 10, QChar('0'));
 }
 
 // constructor
-MIDI_PLAYER::MIDI_PLAYER(QWidget *parent) :
+MIDI_PLAYER::MIDI_PLAYER(QWidget *parent, int index) :
     QMainWindow(parent),
-    ui(new Ui::MIDI_PLAYER)
+    ui(new Ui::MIDI_PLAYER),
+    session(SEQ_SESSION::instance()),
+    zone_index(index),
+    zone(0),
+    seq(0),
+    queue(-1),
+    port_serial(0),
+    song(new MIDI_FILE),
+    loading(0),
+    player_busy(false),
+    player_stop(0),
+    stats(0),
+    stats_timer(0),
+    stats_panel(0),
+    stats_view(0),
+    stats_ticks(0),
+    loop_a(0),
+    loop_b(0),
+    lyrics_panel(0),
+    lyric_kind(META_TEXT::LYRIC),
+    lyric_shown(-2),
+    analysis_panel(0),
+    analysis_view(0),
+    roll_panel(0),
+    roll(0),
+    recorder(0),
+    thru_notes(thru_notes_create()),
+    thru(0),
+    transforms(transforms_create()),
+    transform_panel(0),
+    transport(STOPPED),
+    command_at(0),
+    control(0),
+    song_changed(false),
+    port_changed(false),
+    control_volume(-1),
+    transforms_changed(false)
 {
     setStatusBar(0);
     ui->setupUi(this);
     ui->progressBar->setEnabled(false);
+    // zone windows are used side by side
+    setWindowModality(Qt::NonModal);
     timer = new QTimer(this);
+    connect(timer, SIGNAL(timeout()), this, SLOT(tickDisplay()));
+    // recursive: the slots call each other, e.g. the volume sysex pauses
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&transport_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&player_lock, NULL);
+    pthread_cond_init(&player_idle, NULL);
+    loader = new QFutureWatcher<bool>(this);
+    connect(loader, SIGNAL(finished()), this, SLOT(fileLoaded()));
+    memset(playfile,0,sizeof(playfile));
     memset(MIDI_dev,0,sizeof(MIDI_dev));
     memset(port_name,0,sizeof(port_name));
+    // statistics cost nothing unless asked for; the control socket
+    // reports its command-to-note latency through them
+    if (options.stats || options.control) {
+        stats = stats_create();
+        if (!stats)
+            fprintf(stderr, "midi_player: no statistics for zone %d: %s\n", zone_index + 1, strerror(errno));
+    }
+    if (stats) {
+        stats_timer = new QTimer(this);
+        connect(stats_timer, SIGNAL(timeout()), this, SLOT(statsTick()));
+        stats_timer->start(1000);
+    }
+    QMenu *view_menu = ui->menuBar->addMenu("&View");
+    view_menu->addAction("&Statistics...", this, SLOT(showStats()))->setEnabled(stats != 0);
+    view_menu->addAction("&Lyrics and cues...", this, SLOT(showLyrics()));
+    view_menu->addAction("&Analysis...", this, SLOT(showAnalysis()));
+    view_menu->addAction("&Piano roll...", this, SLOT(showRoll()));
+    lyrics_timer = new QTimer(this);
+    connect(lyrics_timer, SIGNAL(timeout()), this, SLOT(lyricsTick()));
+    roll_timer = new QTimer(this);
+    connect(roll_timer, SIGNAL(timeout()), this, SLOT(rollTick()));
+    // filled in by fileLoaded() with one entry per marker
+    marker_menu = ui->menuBar->addMenu("&Markers");
+    marker_menu->setEnabled(false);
+    QMenu *loop_menu = ui->menuBar->addMenu("&Loop");
+    loop_menu->addAction("Set &A here", this, SLOT(loopSetA()));
+    loop_menu->addAction("Set &B here", this, SLOT(loopSetB()));
+    loop_menu->addAction("By &ticks...", this, SLOT(loopByTicks()));
+    loop_menu->addAction("By t&ime...", this, SLOT(loopByTime()));
+    loop_menu->addAction("By &marker...", this, SLOT(loopByMarker()));
+    loop_menu->addAction("&Clear", this, SLOT(loopClear()));
+    QMenu *record_menu = ui->menuBar->addMenu("&Record");
+    record_start = record_menu->addAction("&Start recording...", this, SLOT(recordStart()));
+    record_stop = record_menu->addAction("S&top recording", this, SLOT(recordStop()));
+    record_stop->setEnabled(false);
+    QMenu *live_menu = ui->menuBar->addMenu("L&ive");
+    thru_start = live_menu->addAction("&Thru from...", this, SLOT(thruStart()));
+    thru_stop = live_menu->addAction("Thru &off", this, SLOT(thruStop()));
+    live_menu->addAction("&Latency...", this, SLOT(thruReport()));
+    thru_stop->setEnabled(false);
+    QMenu *transform_menu = ui->menuBar->addMenu("&Transform");
+    transform_menu->addAction("&Tempo, transpose, channels...", this, SLOT(showTransforms()));
+    transform_menu->addAction("&Reset", this, SLOT(transformReset()));
 
-    init_seq();
-    queue = snd_seq_alloc_named_queue(seq, "midi_player");
-    check_snd("create queue", queue);
+    init_seq();     // the session stays open until the process exits
+    setupTimer();
     getPorts();     // empty parm means fill in the PortBox list
+    port_serial = session->portSerial();
     snd_seq_queue_status_malloc(&status);
-    close_seq();
+    snd_seq_queue_status_malloc(&transport_status);
+    // hot-plugged devices arrive as announce events on the session client;
+    // there is one notifier for the client, every zone window listens to it
+    static QSocketNotifier *announce = 0;
+    int fd = session->pollFd();
+    if (!announce && fd >= 0)
+        announce = new QSocketNotifier(fd, QSocketNotifier::Read, qApp);
+    if (announce)
+        connect(announce, SIGNAL(activated(int)), this, SLOT(seqInput()));
+    // --thru is for the first window, the others use the Live menu
+    if (options.thru && zone_index == 0 && zone && thru_notes) {
+        thru = new LIVE_THRU(zone, thru_notes);
+        if (thru->start(options.thru)) {
+            thru_start->setEnabled(false);
+            thru_stop->setEnabled(true);
+        } else
+            QMessageBox::critical(this, "MIDI Player", thru->errorString());
+    }
+    // --control also belongs to the first window
+    if (options.control && zone_index == 0 && zone) {
+        control = new CONTROL_SERVER(control_command, this);
+        if (!control->start(options.control))
+            QMessageBox::critical(this, "MIDI Player", control->errorString());
+    }
 }   // end constructor
 
 MIDI_PLAYER::~MIDI_PLAYER()
 {
+    delete control;     // no commands while the window goes away
     ui->Play_button->setChecked(false);
-    if (seq && queue) snd_seq_free_queue(seq, queue);
-    close_seq();
+    pthread_mutex_lock(&transport_lock);
+    stopPlayer();       // paused from the socket, say
+    pthread_mutex_unlock(&transport_lock);
+    loader->waitForFinished();
+    delete recorder;    // stops and closes the file
+    delete thru;        // the player is gone for good
+    delete loading;
+    delete song;
+    stats_destroy(stats);
+    thru_notes_destroy(thru_notes);
+    transforms_destroy(transforms);
+    for (size_t i = 0; i < retired.size(); ++i)
+        delete retired[i];
+    snd_seq_queue_status_free(status);
+    snd_seq_queue_status_free(transport_status);
+    pthread_mutex_destroy(&transport_lock);
+    pthread_mutex_destroy(&player_lock);
+    pthread_cond_destroy(&player_idle);
     delete ui;
 }   // end destructor
 
@@ -92,31 +265,68 @@ void MIDI_PLAYER::on_Open_button_clicked()
     ui->Play_button->setEnabled(false);
     ui->Pause_button->setEnabled(false);
     ui->MidiFile_display->clear();
-    disconnect_port();
-    close_seq();
+    if (zone)
+        zone->resetQueue();
 
     QString fn = QFileDialog::getOpenFileName(this,"Open MIDI File","/Data/music/midi","Midi files (*.mid, *.MID);;Any (*.*)");
     if (fn.isEmpty())
         return;
     ui->MidiFile_display->setText(fn);
     ui->MIDI_length_display->setText("00:00");
-    init_seq();
-    queue = snd_seq_alloc_named_queue(seq, "midi_player");
-    check_snd("create queue", queue);
     connect_port();
     strcpy(playfile, fn.toAscii().data());
-    all_events.clear();
-    if (!parseFile(playfile)) {
-        QMessageBox::critical(this, "MIDI Player", QString("Invalid file"));
-        return;
-    }   // parseFile
-    qDebug() << "last tick: " << all_events.back().tick;
-    ui->progressBar->setRange(0,all_events.back().tick);
-    ui->progressBar->setTickInterval(song_length_seconds<240? all_events.back().tick/song_length_seconds*10 : all_events.back().tick/song_length_seconds*30);
+    // parse on the thread pool, the other zones keep their windows live
+    ui->Open_button->setEnabled(false);
+    loading = new MIDI_FILE;
+    loader->setFuture(QtConcurrent::run(loading, &MIDI_FILE::load, static_cast<const char *>(playfile), true));
+}   // end on_Open_button_clicked
+
+void MIDI_PLAYER::fileLoaded()
+{
+    ui->Open_button->setEnabled(true);
+    if (!loader->result()) {
+        QMessageBox::critical(this, "MIDI Player", loading->errorString());
+        delete loading;
+        loading = 0;
+        return;
+    }
+    pthread_mutex_lock(&transport_lock);
+    if (transport != STOPPED) {
+        // started from the socket while this one was parsing
+        transportStop();
+        notesOff();
+    }
+    delete song;
+    song = loading;
+    loading = 0;
+    check_snd("set queue tempo", reset_tempo());
+    loop_a = loop_b = 0;
+    pthread_mutex_unlock(&transport_lock);
+    songChanged();
+}   // end fileLoaded
+
+void MIDI_PLAYER::songChanged()
+{
+    // everything the window shows of the song
+    record_parse();
+    ui->progressBar->setToolTip("");
+    fillMarkers();
+    // .kar files carry their lyrics as text events
+    lyric_kind = song->texts.count(META_TEXT::LYRIC) ? META_TEXT::LYRIC : META_TEXT::TEXT;
+    lyric_shown = -2;
+    lyricsTick();
+    if (roll)
+        roll->setSong(song);
+    if (analysis_view)
+        analysis_view->setPlainText(analysis_text(song->analysis));
+    double song_length_seconds = song->song_length_seconds;
+    qDebug() << "last tick: " << song->lastTick();
+    ui->progressBar->setRange(0,song->lastTick());
+    ui->progressBar->setTickInterval(song_length_seconds<240? song->lastTick()/song_length_seconds*10 : song->lastTick()/song_length_seconds*30);
     ui->progressBar->setTickPosition(QSlider::TicksAbove);
     ui->Play_button->setEnabled(true);
     ui->MIDI_length_display->setText(QString::number(static_cast<int>(song_length_seconds/60)).rightJustified(2,'0') + ":" + QString::number(static_cast<int>(song_length_seconds)%60).rightJustified(2,'0'));
-}   // end on_Open_button_clicked
+}   // end songChanged
 
 void MIDI_PLAYER::on_Play_button_toggled(bool checked)
 {
@@ -125,30 +335,19 @@ void MIDI_PLAYER::on_Play_button_toggled(bool checked)
         ui->Open_button->setEnabled(false);
         ui->Play_button->setText("Stop");
         ui->progressBar->setEnabled(true);
-        init_seq();
         connect_port();
-        all_events.clear();
-        if (!parseFile(playfile)) {
-            QMessageBox::critical(this, "MIDI Player", QString("Invalid file"));
-            return;
-        }   // parseFile
-        // queue won't actually start until it is drained
-        int err = snd_seq_start_queue(seq, queue, NULL);
+        pthread_mutex_lock(&transport_lock);
+        int err = transportPlay(0);
+        pthread_mutex_unlock(&transport_lock);
         check_snd("start queue", err);
-        startPlayer(0);
-        connect(timer, SIGNAL(timeout()), this, SLOT(tickDisplay()));
         timer->start(200);
     }
     else {
-        if (timer->isActive()) {
-            disconnect(timer, SIGNAL(timeout()), this, SLOT(tickDisplay()));
-            timer->stop();
-        }
-        snd_seq_stop_queue(seq,queue,NULL);
-        snd_seq_drain_output(seq);
-        stopPlayer();
+        timer->stop();
+        pthread_mutex_lock(&transport_lock);
+        transportStop();
+        pthread_mutex_unlock(&transport_lock);
         on_Panic_button_clicked();
-        disconnect_port();
         ui->progressBar->blockSignals(true);
         ui->progressBar->setValue(0);
         ui->progressBar->blockSignals(false);
@@ -170,26 +369,20 @@ void MIDI_PLAYER::on_Pause_button_toggled(bool checked)
 {
     unsigned int current_tick;
     if (checked) {
-        stopPlayer();
-        if (timer->isActive()) {
-            timer->stop();
-        }
-        snd_seq_get_queue_status(seq, queue, status);
-        current_tick = snd_seq_queue_status_get_tick_time(status);
-        snd_seq_stop_queue(seq,queue,NULL);
-        snd_seq_drain_output(seq);
+        timer->stop();
+        pthread_mutex_lock(&transport_lock);
+        current_tick = transportPause();
+        pthread_mutex_unlock(&transport_lock);
         ui->Pause_button->setText("Resume");
         on_Panic_button_clicked();
         qDebug() << "Paused queue" << queue << "at tick" << current_tick ;
     }
     else {
-        snd_seq_continue_queue(seq, queue, NULL);
-        snd_seq_drain_output(seq);
-        snd_seq_get_queue_status(seq, queue, status);
-        current_tick = snd_seq_queue_status_get_tick_time(status);
+        pthread_mutex_lock(&transport_lock);
+        current_tick = transportResume();
+        pthread_mutex_unlock(&transport_lock);
         timer->start();
         ui->Pause_button->setText("Pause");
-        startPlayer(current_tick);
         qDebug() << "Playing resumed for queue" << queue << "at tick" << current_tick;
     }
 }   // end on_Pause_button_toggled
@@ -197,18 +390,10 @@ void MIDI_PLAYER::on_Pause_button_toggled(bool checked)
 void MIDI_PLAYER::on_Panic_button_clicked()
 {
   char buf[6];
-  if (seq) {
-    connect_port();
-    for (int x=0;x<16;x++) {
-        buf[0] = 0xb0+x;
-        buf[1] = 0x7B;
-        buf[2] = 00;
-        send_data(buf,3);
-        buf[0] = 0xb0+x;
-        buf[1] = 0x79;
-        buf[2] = 00;
-        send_data(buf,3);
-    }
+  if (seq && zone && zone->hasDest()) {
+    pthread_mutex_lock(&transport_lock);
+    notesOff();
+    pthread_mutex_unlock(&transport_lock);
   }
   else {
       getRawDev(ui->PortBox->currentText());
@@ -238,10 +423,10 @@ void MIDI_PLAYER::on_Panic_button_clicked()
 void MIDI_PLAYER::on_PortBox_currentIndexChanged(QString buf)
 {
     qDebug() << "Index changed";
-    init_seq();
-    disconnect_port();
+    pthread_mutex_lock(&transport_lock);
     getPorts(buf);
-    connect_port();
+    connect_port();     // resubscribes only if the address changed
+    pthread_mutex_unlock(&transport_lock);
 }	// end on_PortBox_currentIndexChanged
 
 void MIDI_PLAYER::on_progressBar_sliderPressed()
@@ -249,52 +434,21 @@ void MIDI_PLAYER::on_progressBar_sliderPressed()
     if (!seq || !queue || ui->Pause_button->isChecked())
         return;
     // stop the timer and queue
-    if (timer->isActive()) timer->stop();
-    snd_seq_stop_queue(seq,queue,NULL);
-    snd_seq_drain_output(seq);
-    stopPlayer();
+    timer->stop();
+    pthread_mutex_lock(&transport_lock);
+    transportHalt();
+    pthread_mutex_unlock(&transport_lock);
     on_Panic_button_clicked();
 }   // end on_progressBar_sliderPressed
 
 void MIDI_PLAYER::on_progressBar_sliderReleased()
 {
-    snd_seq_event_t ev;
-    snd_seq_ev_clear(&ev);
-    snd_seq_ev_set_direct(&ev);
-    snd_seq_get_queue_status(seq, queue, status);
-    unsigned int current_tick = snd_seq_queue_status_get_tick_time(status);
-    const snd_seq_real_time_t *current_time = snd_seq_queue_status_get_real_time(status);
-    qDebug() << "Resetting queue from tick" << current_tick << "at" << current_time->tv_sec;
-    // reset queue position
-    snd_seq_ev_is_tick(&ev);
-    snd_seq_ev_set_queue_pos_tick(&ev, queue, 0);
-    snd_seq_event_output(seq, &ev);
-    snd_seq_drain_output(seq);
-    // scan the event queue for the closest tick >= 'x'
-    for (std::vector<event>::iterator Event=all_events.begin(); Event!=all_events.end(); ++Event)  {
-        if (static_cast<int>(Event->tick) >= ui->progressBar->sliderPosition()) {
-            ev.time.tick = Event->tick;
-            break;
-        }
-    }
-    ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
-    ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
-    snd_seq_ev_set_queue_pos_tick(&ev, queue, ev.time.tick);
-    snd_seq_event_output(seq, &ev);
-    snd_seq_drain_output(seq);
-    snd_seq_real_time_t *new_time = new snd_seq_real_time_t;
-    double x = static_cast<double>(ev.time.tick)/all_events.back().tick;
-    new_time->tv_sec = (x*song_length_seconds);
-    new_time->tv_nsec = 0;
-    snd_seq_ev_set_queue_pos_real(&ev, queue, new_time);
-    // continue the timer
-    if (ui->Pause_button->isChecked()) return;
-    snd_seq_continue_queue(seq, queue, NULL);
-    snd_seq_drain_output(seq);
-    current_time = snd_seq_queue_status_get_real_time(status);
-    qDebug() << "to tick" << ev.time.tick << "at" << new_time->tv_sec;
-    startPlayer(ev.time.tick);
-    timer->start();
+    pthread_mutex_lock(&transport_lock);
+    unsigned int tick = transportSeek(ui->progressBar->sliderPosition());
+    pthread_mutex_unlock(&transport_lock);
+    qDebug() << "to tick" << tick;
+    if (!ui->Pause_button->isChecked())
+        timer->start();
 }   // end on_progressBar_sliderReleased
 
 //  FUNCTIONS
@@ -302,7 +456,8 @@ void MIDI_PLAYER::send_data(char * buf,int data_size) {
     snd_seq_event_t ev;
     snd_seq_ev_clear(&ev);
     ev.type = SND_SEQ_EVENT_CONTROLLER;
-    ev.dest = ports[0];
+    ev.source.port = zone->port();
+    ev.dest = *zone->dest();
     ev.data.control.channel = buf[0];
     if (data_size>1)
       ev.data.control.param = buf[1];
@@ -310,222 +465,744 @@ void MIDI_PLAYER::send_data(char * buf,int data_size) {
       ev.data.control.value = buf[2];
     snd_seq_ev_set_fixed(&ev);
     snd_seq_ev_set_direct(&ev);
+    zone->lockOutput();
     snd_seq_event_output_direct(seq, &ev);
-    snd_seq_drain_output(seq);
+    drain();
+    zone->unlockOutput();
 }   // end send_data
 void MIDI_PLAYER::send_SysEx(char * buf,int data_size) {
-    on_Pause_button_toggled(true);
+    // a stopped or paused song stays that way
+    bool playing = transport == PLAYING;
+    if (playing)
+        on_Pause_button_toggled(true);
     snd_seq_event_t ev;
     snd_seq_ev_clear(&ev);
     ev.type = SND_SEQ_EVENT_SYSEX;
-    ev.dest = ports[0];
+    ev.source.port = zone->port();
+    ev.dest = *zone->dest();
     snd_seq_ev_set_variable(&ev, data_size, buf);
     snd_seq_ev_set_direct(&ev);
+    zone->lockOutput();
     snd_seq_event_output_direct(seq, &ev);
-    snd_seq_drain_output(seq);
-    on_Pause_button_toggled(false);
+    drain();
+    zone->unlockOutput();
+    if (playing)
+        on_Pause_button_toggled(false);
 }   // end send_SysEx
 
 void MIDI_PLAYER::init_seq() {
-    if (!seq) {
-        int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+    // cheap after the first call, the session is process-wide;
+    // zone 0 comes with it, later windows add their own zone
+    if (!session->isOpen()) {
+        int err = session->open("midi_player");
         check_snd("open sequencer", err);
-        err = snd_seq_set_client_name(seq, "midi_player");
-        check_snd("set client name", err);
-        int client = snd_seq_client_id(seq);    // client # is 128 by default
-        check_snd("get client id", client);
-        qDebug() << "Seq and client initialized";
     }
-}
-
-void MIDI_PLAYER::close_seq() {
-    if (seq) {
-        snd_seq_stop_queue(seq,queue,NULL);
-        snd_seq_drop_output(seq);
-        snd_seq_drain_output(seq);
-        snd_seq_close(seq);
-        seq = 0;
-        qDebug() << "Seq closed";
+    zone = session->zone(zone_index);
+    if (session->isOpen() && !zone) {
+        QString name = QString("midi_player zone %1") .arg(zone_index + 1);
+        int err = session->addZone(name.toAscii().data());
+        check_snd("create zone", err);
+        zone = session->zone(zone_index);
     }
-}
+    // the window sends and controls its queue through the zone's client
+    seq = zone ? zone->handle() : 0;
+    queue = zone ? zone->queue() : -1;
+}   // end init_seq
 
 void MIDI_PLAYER::connect_port() {
-    if (seq && strlen(port_name)) {
-        //  create_source_port
-        snd_seq_port_info_t *pinfo;
-        snd_seq_port_info_alloca(&pinfo);
-        // the first created port is 0 anyway, but let's make sure ...
-        snd_seq_port_info_set_port(pinfo, 0);
-        snd_seq_port_info_set_port_specified(pinfo, 1);
-        snd_seq_port_info_set_name(pinfo, "midi_player");
-        snd_seq_port_info_set_capability(pinfo, 0);
-        snd_seq_port_info_set_type(pinfo,
-               SND_SEQ_PORT_TYPE_MIDI_GENERIC |
-               SND_SEQ_PORT_TYPE_APPLICATION);
-        int err = snd_seq_create_port(seq, pinfo);
-        check_snd("create port", err);
-	
-        ports = (snd_seq_addr_t *)realloc(ports, sizeof(snd_seq_addr_t));
-        err = snd_seq_parse_address(seq, &ports[0], port_name);
-        if (err < 0) {
-            QMessageBox::critical(this, "MIDI Player", QString("Invalid port%1\n%2") .arg(port_name) .arg(snd_strerror(err)));
-            return;
-        }
-        err = snd_seq_connect_to(seq, 0, ports[0].client, ports[0].port);
-        if (err < 0 && err!= -16)
-            QMessageBox::critical(this, "MIDI Player", QString("%4 Cannot connect to port %1:%2 - %3") .arg(ports[0].client) .arg(ports[0].port) .arg(strerror(errno)) .arg(err));
-        qDebug() << "Connected port" << port_name;
+    if (zone && strlen(port_name)) {
+        int err = zone->connectDest(port_name);
+        if (err < 0)
+            QMessageBox::critical(this, "MIDI Player", QString("Cannot connect to port %1\n%2") .arg(port_name) .arg(snd_strerror(err)));
     }
 }   // end connect_port
 
 void MIDI_PLAYER::disconnect_port() {
-    if (seq && strlen(port_name)) {
-        int err;
-        ports = (snd_seq_addr_t *)realloc(ports, sizeof(snd_seq_addr_t));
-        err = snd_seq_parse_address(seq, &ports[0], port_name);
-        if (err < 0) {
-            QMessageBox::critical(this, "MIDI Player", QString("Invalid port%1\n%2") .arg(port_name) .arg(snd_strerror(err)));
-            return;
-        }
-        err = snd_seq_disconnect_to(seq, 0, ports[0].client, ports[0].port);
+    if (zone) {
+        zone->disconnectDest();
         qDebug() << "Disconnected current port" << port_name;
-    }   // end if seq
+    }
 }   // end disconnect_port
 
+int MIDI_PLAYER::reset_tempo() {
+    // restore the tempo the song starts with, tempo events move it while playing
+    snd_seq_queue_tempo_t *queue_tempo;
+    snd_seq_queue_tempo_alloca(&queue_tempo);
+    snd_seq_queue_tempo_set_tempo(queue_tempo, song->init_tempo);
+    snd_seq_queue_tempo_set_ppq(queue_tempo, static_cast<int>(song->PPQ));
+    return snd_seq_set_queue_tempo(seq, queue, queue_tempo);
+}   // end reset_tempo
+
+void MIDI_PLAYER::setupTimer() {
+    // attach the chosen timer to the queues and report how good it is;
+    // later zones inherit the timer from the session
+    if (!seq) return;
+    QString title = options.zones > 1 ? QString("MIDI Player zone %1") .arg(zone_index + 1) : QString("MIDI Player");
+    if (zone_index > 0) {
+        setWindowTitle(QString("%1 (%2)") .arg(title) .arg(session->timerName()));
+        ui->Play_button->setToolTip(QString("%1 timer, resolution %2 ns") .arg(session->timerName()) .arg(session->timerResolution()));
+        return;
+    }
+    int err = session->selectTimer(options.timer, options.timer_freq);
+    if (err < 0) {
+        QMessageBox::critical(this, "MIDI Player", QString("Cannot use %1 queue timer\n%2") .arg(options.timer) .arg(snd_strerror(err)));
+        session->selectTimer("system");
+    }
+    QString info = QString("%1 timer, resolution %2 ns") .arg(session->timerName()) .arg(session->timerResolution());
+    if (options.calibrate) {
+        double drift, jitter;
+        err = session->calibrateTimer(&drift, &jitter);
+        check_snd("calibrate queue timer", err);
+        if (err >= 0)
+            info += QString(", drift %1 ppm, jitter %2 us") .arg(drift, 0, 'f', 1) .arg(jitter, 0, 'f', 0);
+    }
+    std::cerr << "Queue: " << info.toAscii().data() << std::endl;
+    setWindowTitle(QString("%1 (%2)") .arg(title) .arg(session->timerName()));
+    ui->Play_button->setToolTip(info);
+}   // end setupTimer
+
 void MIDI_PLAYER::getPorts(QString buf) {
     // fill in the combobox with all available ports
     // or set port_name to the port passed in buf
-    snd_seq_client_info_t *cinfo;
-    snd_seq_port_info_t *pinfo;
-    snd_seq_client_info_alloca(&cinfo);
-    snd_seq_port_info_alloca(&pinfo);
-    snd_seq_client_info_set_client(cinfo, -1);
+    const DEVICE_REGISTRY &devices = session->devices();
     if (buf.isEmpty()) {
         ui->PortBox->blockSignals(true);
         ui->PortBox->clear();
+        for (int i = 0; i < devices.portNames().count(); ++i)
+            ui->PortBox->insertItem(9999, devices.portNames().at(i));
         ui->PortBox->blockSignals(false);
+        return;
     }
-    while (snd_seq_query_next_client(seq, cinfo) >= 0) {
-        int client = snd_seq_client_info_get_client(cinfo);
-        snd_seq_port_info_set_client(pinfo, client);
-        snd_seq_port_info_set_port(pinfo, -1);
-        while (snd_seq_query_next_port(seq, pinfo) >= 0) {
-            /* we need both WRITE and SUBS_WRITE */
-            if ((snd_seq_port_info_get_capability(pinfo)
-                 & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
-                != (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
-                continue;
-            if (buf.isEmpty()) {
-                ui->PortBox->blockSignals(true);
-                ui->PortBox->insertItem(9999, snd_seq_port_info_get_name(pinfo));
-                ui->PortBox->blockSignals(false);
-                qDebug() << "port:" << snd_seq_port_info_get_name(pinfo);
-            }
-            else if (buf.toAscii().data() == QString(snd_seq_port_info_get_name(pinfo))) {
-                QString holdit = QString::number(snd_seq_port_info_get_client(pinfo)) + ":" + QString::number(snd_seq_port_info_get_port(pinfo));
-                strcpy(port_name, holdit.toAscii().data());
-                qDebug() << "Selected port name " << port_name;
-            }
-        }
+    snd_seq_addr_t addr;
+    if (devices.findPort(buf, &addr)) {
+        QString holdit = QString::number(addr.client) + ":" + QString::number(addr.port);
+        strcpy(port_name, holdit.toAscii().data());
+        qDebug() << "Selected port name " << port_name;
     }
 }   // end getPorts
 
 void MIDI_PLAYER::getRawDev(QString buf) {
-  if (buf.isEmpty()) return;
-  signed int card_num=-1;
-  signed int dev_num=-1;
-  signed int subdev_num=-1;
-  int err,i;
-  char	str[64];
-  snd_rawmidi_info_t  *rawMidiInfo;
-  snd_ctl_t *cardHandle;
-  err = snd_card_next(&card_num);
-  if (err < 0) {
-     memset(MIDI_dev,0,sizeof(MIDI_dev));
-    // no MIDI cards found in the system
-    snd_card_next(&card_num);
-    return;
-  }
-  while (card_num >= 0) {
-    sprintf(str, "hw:%i", card_num);
-    if ((err = snd_ctl_open(&cardHandle, str, 0)) < 0) break;
-    dev_num = -1;
-    err = snd_ctl_rawmidi_next_device(cardHandle, &dev_num);
-    if (err < 0) {
-      // card exists, but no midi device was found
-      snd_card_next(&card_num);
-      continue;
-    }
-    while (dev_num >= 0) {
-      snd_rawmidi_info_alloca(&rawMidiInfo);
-      memset(rawMidiInfo, 0, snd_rawmidi_info_sizeof());
-      // Tell ALSA which device (number) we want info about
-      snd_rawmidi_info_set_device(rawMidiInfo, dev_num);
-      // Get info on the MIDI outs of this device
-      snd_rawmidi_info_set_stream(rawMidiInfo, SND_RAWMIDI_STREAM_OUTPUT);
-      i = -1;
-      subdev_num = 1;
-      // More subdevices?
-      while (++i < subdev_num) {
-          // Tell ALSA to fill in our snd_rawmidi_info_t with info on this subdevice
-          snd_rawmidi_info_set_subdevice(rawMidiInfo, i);
-          if ((err = snd_ctl_rawmidi_info(cardHandle, rawMidiInfo)) < 0) continue;
-          // Print out how many subdevices (once only)
-          if (!i) {
-              subdev_num = snd_rawmidi_info_get_subdevices_count(rawMidiInfo);
-          }
-          // got a valid card, dev and subdev
-          if (buf == (QString)snd_rawmidi_info_get_subdevice_name(rawMidiInfo)) {
-              QString holdit = "hw:" + QString::number(card_num) + "," + QString::number(dev_num) + "," + QString::number(i);
-              strcpy(MIDI_dev, holdit.toAscii().data());
-          }
-      }	// end WHILE subdev_num
-      snd_ctl_rawmidi_next_device(cardHandle, &dev_num);
-    }	// end WHILE dev_num
-    snd_ctl_close(cardHandle);
-    err = snd_card_next(&card_num);
-  }	// end WHILE card_num
+    // registry lookup, no card scan on the panic path
+    memset(MIDI_dev,0,sizeof(MIDI_dev));
+    if (buf.isEmpty()) return;
+    QString dev = session->devices().findRawDev(buf);
+    if (!dev.isEmpty())
+        strncpy(MIDI_dev, dev.toAscii().data(), sizeof(MIDI_dev)-1);
 }	// end getRawDev()
 
+void MIDI_PLAYER::seqInput() {
+    // announce events: refresh the PortBox, keeping the selection if it still exists;
+    // the first zone window to get here reads them, the others see the new serial
+    session->readInput();
+    if (port_serial == session->portSerial())
+        return;
+    port_serial = session->portSerial();
+    QString current = ui->PortBox->currentText();
+    getPorts();
+    int i = ui->PortBox->findText(current);
+    if (i < 0) {
+        // selected device went away, follow whatever the box now shows
+        if (ui->PortBox->count())
+            on_PortBox_currentIndexChanged(ui->PortBox->currentText());
+        return;
+    }
+    ui->PortBox->blockSignals(true);
+    ui->PortBox->setCurrentIndex(i);
+    ui->PortBox->blockSignals(false);
+    // reconnects if the device came back, or follows the name to another
+    // port when the one it stood for went away; the latter is reported
+    if (!zone)
+        return;
+    snd_seq_addr_t was = *zone->dest();
+    bool had = zone->hasDest();
+    getPorts(current);
+    connect_port();
+    if (had && zone->hasDest() && (zone->dest()->client != was.client || zone->dest()->port != was.port)) {
+        fprintf(stderr, "midi_player: port %s moved from %d:%d to %s\n",
+                current.toAscii().data(), was.client, was.port, port_name);
+        if (stats)
+            stats->port_moves++;
+    }
+}   // end seqInput
+
+void MIDI_PLAYER::record_parse() {
+    // copy what the worker measured into the zone's block
+    if (!stats)
+        return;
+    stats->parse_ns = song->parse_ns;
+    stats->parse_map_ns = song->map_ns;
+    stats->parse_tracks_ns = song->tracks_ns;
+    stats->parse_sort_ns = song->sort_ns;
+    stats->parse_index_ns = song->index_ns;
+    stats->tracks = song->track_ns.size();
+    stats->parse_track_max_ns = 0;
+    stats->parse_track_max = 0;
+    for (int i = 0; i < stats->tracks; ++i) {
+        if (song->track_ns[i] > stats->parse_track_max_ns) {
+            stats->parse_track_max_ns = song->track_ns[i];
+            stats->parse_track_max = i;
+        }
+    }
+    stats->events_parsed = song->events.size();
+    stats->bytes_parsed = song->file_bytes;
+}   // end record_parse
+
+void MIDI_PLAYER::showStats() {
+    // non-modal panel, refreshed by statsTick() while it is open
+    if (!stats_panel) {
+        stats_panel = new QDialog(this);
+        stats_panel->setWindowTitle(windowTitle() + " statistics");
+        stats_view = new QPlainTextEdit(stats_panel);
+        stats_view->setReadOnly(true);
+        QVBoxLayout *layout = new QVBoxLayout(stats_panel);
+        layout->addWidget(stats_view);
+        stats_panel->resize(420, 260);
+    }
+    stats_view->setPlainText(stats_text(stats));
+    stats_panel->show();
+    stats_panel->raise();
+}   // end showStats
+
+void MIDI_PLAYER::statsTick() {
+    if (stats_panel && stats_panel->isVisible())
+        stats_view->setPlainText(stats_text(stats));
+    if (stats && options.stats_log > 0 && ++stats_ticks % options.stats_log == 0)
+        std::cerr << "zone " << zone_index + 1 << ": " << stats_line(stats).toAscii().data() << std::endl;
+}
+
 void MIDI_PLAYER::tickDisplay() {
     // do timestamp display
     snd_seq_get_queue_status(seq, queue, status);    
-    unsigned int current_tick = snd_seq_queue_status_get_tick_time(status);
+    unsigned int current_tick = songPosition(snd_seq_queue_status_get_tick_time(status));
     ui->progressBar->blockSignals(true);
     ui->progressBar->setValue(current_tick);
     ui->progressBar->blockSignals(false);
-    double new_seconds = static_cast<double>(current_tick)/all_events.back().tick;
-    new_seconds *= song_length_seconds;
+    double new_seconds = static_cast<double>(current_tick)/song->lastTick();
+    new_seconds *= song->song_length_seconds;
     ui->MIDI_time_display->setText(QString::number(static_cast<int>(new_seconds)/60).rightJustified(2,'0')+":"+QString::number(static_cast<int>(new_seconds)%60).rightJustified(2,'0'));
-    if (current_tick >= all_events.back().tick) {
-        sleep(1);
-        ui->Play_button->setChecked(false);
+    if (loop_b <= loop_a && current_tick >= song->lastTick()) {
+        // let the last notes ring; the other zones' windows keep going
+        timer->stop();
+        QTimer::singleShot(1000, this, SLOT(songEnded()));
     }
 }   // end tickDisplay
 
+void MIDI_PLAYER::songEnded() {
+    // unless the song was restarted or paused in the meantime
+    if (ui->Play_button->isChecked() && !ui->Pause_button->isChecked() && !timer->isActive())
+        ui->Play_button->setChecked(false);
+}
+
+unsigned int MIDI_PLAYER::displayPosition() {
+    if (!ui->Play_button->isChecked())
+        return ui->progressBar->sliderPosition();
+    snd_seq_get_queue_status(seq, queue, status);
+    return songPosition(snd_seq_queue_status_get_tick_time(status));
+}
+
+void MIDI_PLAYER::seekTo(unsigned int tick) {
+    // the same as dragging the slider there
+    bool playing = ui->Play_button->isChecked();
+    if (playing)
+        on_progressBar_sliderPressed();
+    ui->progressBar->setSliderPosition(tick);
+    if (playing)
+        on_progressBar_sliderReleased();
+    lyricsTick();
+}
+
+QString MIDI_PLAYER::markerName(int i) {
+    const META_TEXT &texts = song->texts;
+    return mmss(song->tickToSeconds(texts.at(META_TEXT::MARKER, i).tick)) + "  " + texts.text(META_TEXT::MARKER, i);
+}
+
+void MIDI_PLAYER::fillMarkers() {
+    marker_menu->clear();
+    int n = song->texts.count(META_TEXT::MARKER);
+    marker_menu->setEnabled(n > 0);
+    if (!n)
+        return;
+    marker_menu->addAction("&Previous", this, SLOT(markerPrevious()), QKeySequence(Qt::Key_PageUp));
+    marker_menu->addAction("&Next", this, SLOT(markerNext()), QKeySequence(Qt::Key_PageDown));
+    marker_menu->addSeparator();
+    for (int i = 0; i < n; ++i)
+        marker_menu->addAction(markerName(i), this, SLOT(markerJump()))->setData(i);
+}   // end fillMarkers
+
+void MIDI_PLAYER::markerJump() {
+    QAction *action = qobject_cast<QAction *>(sender());
+    if (action)
+        seekTo(song->texts.at(META_TEXT::MARKER, action->data().toInt()).tick);
+}
+
+void MIDI_PLAYER::markerNext() {
+    int i = song->texts.next(META_TEXT::MARKER, displayPosition());
+    if (i >= 0)
+        seekTo(song->texts.at(META_TEXT::MARKER, i).tick);
+}
+
+void MIDI_PLAYER::markerPrevious() {
+    // from just after a marker, go to its start rather than the one before
+    unsigned int pos = displayPosition();
+    int i = song->texts.find(META_TEXT::MARKER, pos);
+    if (i >= 0 && pos - song->texts.at(META_TEXT::MARKER, i).tick < song->PPQ)
+        --i;
+    seekTo(i >= 0 ? song->texts.at(META_TEXT::MARKER, i).tick : 0);
+}
+
+void MIDI_PLAYER::showLyrics() {
+    // follows playback much faster than tickDisplay(), syllables are short
+    if (!lyrics_panel) {
+        lyrics_panel = new QDialog(this);
+        lyrics_panel->setWindowTitle(windowTitle() + " lyrics");
+        lyric_label = new QLabel(lyrics_panel);
+        lyric_label->setTextFormat(Qt::RichText);
+        lyric_label->setWordWrap(true);
+        marker_label = new QLabel(lyrics_panel);
+        cue_label = new QLabel(lyrics_panel);
+        QVBoxLayout *layout = new QVBoxLayout(lyrics_panel);
+        layout->addWidget(lyric_label);
+        layout->addWidget(marker_label);
+        layout->addWidget(cue_label);
+        lyrics_panel->resize(480, 140);
+    }
+    lyric_shown = -2;
+    lyricsTick();
+    lyrics_panel->show();
+    lyrics_panel->raise();
+    lyrics_timer->start(40);
+}   // end showLyrics
+
+static bool line_start(const QString &syllable, const QString &before) {
+    // karaoke files break lines with a leading / or \ (.kar) or a CR/LF
+    // at the end of the previous syllable (lyric events)
+    return syllable.startsWith("/") || syllable.startsWith("\\") ||
+           before.endsWith("\r") || before.endsWith("\n");
+}
+
+static QString syllable_text(const QString &syllable) {
+    QString s = syllable;
+    s.remove('\r').remove('\n');
+    if (s.startsWith("/") || s.startsWith("\\"))
+        s = s.mid(1);
+    return Qt::escape(s);
+}
+
+void MIDI_PLAYER::lyricsTick() {
+    if (!lyrics_panel || !lyrics_panel->isVisible()) {
+        lyrics_timer->stop();
+        return;
+    }
+    const META_TEXT &texts = song->texts;
+    unsigned int pos = displayPosition();
+    int now = texts.find(lyric_kind, pos);
+    int n = texts.count(lyric_kind);
+    // only a new syllable changes the line
+    if (now != lyric_shown) {
+        lyric_shown = now;
+        // the line holding the current syllable, at most a screenful either way
+        int first = std::max(now, 0);
+        while (first > 0 && now - first < 64 &&
+               !line_start(texts.text(lyric_kind, first), texts.text(lyric_kind, first-1)))
+            --first;
+        QString sung, rest;
+        for (int i = first; i < n && i - first < 128; ++i) {
+            QString syllable = texts.text(lyric_kind, i);
+            if (i > first && line_start(syllable, texts.text(lyric_kind, i-1)))
+                break;
+            if (lyric_kind == META_TEXT::TEXT && syllable.startsWith("@"))
+                continue;   // .kar header: title, language, info
+            (i <= now ? sung : rest) += syllable_text(syllable);
+        }
+        lyric_label->setText("<big><font color=\"red\">" + sung + "</font>" + rest + "</big>");
+    }
+    int m = texts.find(META_TEXT::MARKER, pos);
+    marker_label->setText(m >= 0 ? "Marker: " + texts.text(META_TEXT::MARKER, m) : QString());
+    int c = texts.find(META_TEXT::CUE, pos);
+    cue_label->setText(c >= 0 ? "Cue: " + texts.text(META_TEXT::CUE, c) : QString());
+}   // end lyricsTick
+
+void MIDI_PLAYER::showAnalysis() {
+    // made by MIDI_FILE::load() on the worker, nothing to compute here
+    if (!analysis_panel) {
+        analysis_panel = new QDialog(this);
+        analysis_panel->setWindowTitle(windowTitle() + " analysis");
+        analysis_view = new QPlainTextEdit(analysis_panel);
+        analysis_view->setReadOnly(true);
+        QVBoxLayout *layout = new QVBoxLayout(analysis_panel);
+        layout->addWidget(analysis_view);
+        analysis_panel->resize(480, 360);
+    }
+    analysis_view->setPlainText(analysis_text(song->analysis));
+    analysis_panel->show();
+    analysis_panel->raise();
+}   // end showAnalysis
+
+void MIDI_PLAYER::showRoll() {
+    if (!roll_panel) {
+        roll_panel = new QDialog(this);
+        roll_panel->setWindowTitle(windowTitle() + " piano roll");
+        roll = new PIANO_ROLL(roll_panel);
+        roll->setSong(song);
+        connect(roll, SIGNAL(seekRequested(int)), this, SLOT(rollSeek(int)));
+        QVBoxLayout *layout = new QVBoxLayout(roll_panel);
+        layout->addWidget(roll);
+        roll_panel->resize(640, 360);
+    }
+    rollTick();
+    roll_panel->show();
+    roll_panel->raise();
+    roll_timer->start(40);
+}   // end showRoll
+
+void MIDI_PLAYER::rollTick() {
+    if (!roll_panel->isVisible()) {
+        roll_timer->stop();
+        return;
+    }
+    roll->setPosition(displayPosition());
+}
+
+void MIDI_PLAYER::rollSeek(int tick) {
+    seekTo(tick);
+    roll->setPosition(tick);
+}
+
+void MIDI_PLAYER::recordStart() {
+    QStringList names = MIDI_RECORDER::sources(seq);
+    bool ok;
+    // editable, an address like 20:0 or a client name works as well
+    QString source = QInputDialog::getItem(this, "Record", "Record from:", names, 0, true, &ok);
+    if (!ok || source.isEmpty())
+        return;
+    source = source.section(' ', 0, 0);
+    QString fn = QFileDialog::getSaveFileName(this, "Record to MIDI File", "/Data/music/midi", "Midi files (*.mid)");
+    if (fn.isEmpty())
+        return;
+    if (!recorder)
+        recorder = new MIDI_RECORDER;
+    if (!recorder->start(fn.toLocal8Bit().constData(), source.toLocal8Bit().constData())) {
+        QMessageBox::critical(this, "MIDI Player", recorder->errorString());
+        return;
+    }
+    record_start->setEnabled(false);
+    record_stop->setEnabled(true);
+}   // end recordStart
+
+void MIDI_PLAYER::recordStop() {
+    recorder->stop();
+    record_start->setEnabled(true);
+    record_stop->setEnabled(false);
+    QString text = QString("%1 events, %2 bytes written") .arg(recorder->events()) .arg(recorder->bytes());
+    if (recorder->overflows())
+        text += QString("\n%1 events lost to overflow") .arg(recorder->overflows());
+    QMessageBox::information(this, "MIDI Player", text);
+}   // end recordStop
+
+void MIDI_PLAYER::thruStart() {
+    if (!zone || !thru_notes)
+        return;
+    QStringList names = MIDI_RECORDER::sources(seq);
+    bool ok;
+    QString source = QInputDialog::getItem(this, "Live thru", "Play along from:", names, 0, true, &ok);
+    if (!ok || source.isEmpty())
+        return;
+    source = source.section(' ', 0, 0);
+    if (!thru)
+        thru = new LIVE_THRU(zone, thru_notes);
+    if (!thru->start(source.toLocal8Bit().constData())) {
+        QMessageBox::critical(this, "MIDI Player", thru->errorString());
+        return;
+    }
+    thru_start->setEnabled(false);
+    thru_stop->setEnabled(true);
+}   // end thruStart
+
+void MIDI_PLAYER::thruStop() {
+    thru->stop();
+    thru_start->setEnabled(true);
+    thru_stop->setEnabled(false);
+    thruReport();
+}
+
+void MIDI_PLAYER::thruReport() {
+    QMessageBox::information(this, "MIDI Player", thru ? thru->report() : QString("Live thru is off"));
+}
+
+void MIDI_PLAYER::showTransforms() {
+    // non-modal, every change goes to the player as it is made
+    if (!transforms)
+        return;
+    if (!transform_panel) {
+        transform_panel = new QDialog(this);
+        transform_panel->setWindowTitle(windowTitle() + " transforms");
+        QGridLayout *layout = new QGridLayout(transform_panel);
+        tempo_box = new QSpinBox(transform_panel);
+        tempo_box->setRange(TRANSFORMS::MIN_TEMPO, TRANSFORMS::MAX_TEMPO);
+        tempo_box->setSuffix(" %");
+        transpose_box = new QSpinBox(transform_panel);
+        transpose_box->setRange(-TRANSFORMS::MAX_TRANSPOSE, TRANSFORMS::MAX_TRANSPOSE);
+        layout->addWidget(new QLabel("Tempo", transform_panel), 0, 0);
+        layout->addWidget(tempo_box, 0, 1, 1, 2);
+        layout->addWidget(new QLabel("Transpose", transform_panel), 1, 0);
+        layout->addWidget(transpose_box, 1, 1, 1, 2);
+        layout->addWidget(new QLabel("Mute", transform_panel), 2, 1);
+        layout->addWidget(new QLabel("Solo", transform_panel), 2, 2);
+        for (int ch = 0; ch < 16; ++ch) {
+            QString name = QString("Channel %1").arg(ch + 1);
+            if (ch == TRANSFORMS::DRUMS)
+                name += " (drums)";
+            layout->addWidget(new QLabel(name, transform_panel), 3 + ch, 0);
+            mute_box[ch] = new QCheckBox(transform_panel);
+            solo_box[ch] = new QCheckBox(transform_panel);
+            layout->addWidget(mute_box[ch], 3 + ch, 1);
+            layout->addWidget(solo_box[ch], 3 + ch, 2);
+            connect(mute_box[ch], SIGNAL(toggled(bool)), this, SLOT(transformEdited()));
+            connect(solo_box[ch], SIGNAL(toggled(bool)), this, SLOT(transformEdited()));
+        }
+        QPushButton *reset = new QPushButton("Reset", transform_panel);
+        layout->addWidget(reset, 19, 0, 1, 3);
+        connect(tempo_box, SIGNAL(valueChanged(int)), this, SLOT(transformEdited()));
+        connect(transpose_box, SIGNAL(valueChanged(int)), this, SLOT(transformEdited()));
+        connect(reset, SIGNAL(clicked()), this, SLOT(transformReset()));
+    }
+    transformShow();
+    transform_panel->show();
+    transform_panel->raise();
+}   // end showTransforms
+
+void MIDI_PLAYER::transformShow() {
+    // the panel follows the block, whoever changed it
+    if (!transform_panel)
+        return;
+    pthread_mutex_lock(&transport_lock);
+    int tempo = transforms->tempo_percent, semitones = transforms->transpose;
+    unsigned int mute = transforms->mute, solo = transforms->solo;
+    pthread_mutex_unlock(&transport_lock);
+    tempo_box->blockSignals(true);
+    tempo_box->setValue(tempo);
+    tempo_box->blockSignals(false);
+    transpose_box->blockSignals(true);
+    transpose_box->setValue(semitones);
+    transpose_box->blockSignals(false);
+    for (int ch = 0; ch < 16; ++ch) {
+        mute_box[ch]->blockSignals(true);
+        mute_box[ch]->setChecked(mute >> ch & 1);
+        mute_box[ch]->blockSignals(false);
+        solo_box[ch]->blockSignals(true);
+        solo_box[ch]->setChecked(solo >> ch & 1);
+        solo_box[ch]->blockSignals(false);
+    }
+}   // end transformShow
+
+void MIDI_PLAYER::transformEdited() {
+    unsigned int mute = 0, solo = 0;
+    for (int ch = 0; ch < 16; ++ch) {
+        if (mute_box[ch]->isChecked())
+            mute |= 1u << ch;
+        if (solo_box[ch]->isChecked())
+            solo |= 1u << ch;
+    }
+    pthread_mutex_lock(&transport_lock);
+    transforms_set(transforms, tempo_box->value(), transpose_box->value(), mute, solo);
+    pthread_mutex_unlock(&transport_lock);
+}
+
+void MIDI_PLAYER::transformReset() {
+    pthread_mutex_lock(&transport_lock);
+    transforms_set(transforms, 100, 0, 0, 0);
+    pthread_mutex_unlock(&transport_lock);
+    transformShow();
+}
+
+void MIDI_PLAYER::loopSetA() {
+    unsigned int pos = ui->progressBar->sliderPosition();
+    // B stays if it is still after A, otherwise the loop waits for a new B
+    setLoop(pos, loop_b > pos ? loop_b : 0);
+}
+
+void MIDI_PLAYER::loopSetB() {
+    unsigned int pos = ui->progressBar->sliderPosition();
+    if (pos <= loop_a) {
+        QMessageBox::warning(this, "MIDI Player", "Set A first, B must come after it");
+        return;
+    }
+    setLoop(loop_a, pos);
+}
+
+void MIDI_PLAYER::loopByTicks() {
+    bool ok;
+    QString text = QInputDialog::getText(this, "A-B Loop", "Loop ticks (A-B):", QLineEdit::Normal,
+                                         QString("%1-%2") .arg(loop_a) .arg(loop_b), &ok);
+    if (!ok)
+        return;
+    QStringList ab = text.split('-');
+    unsigned int a = 0, b = 0;
+    bool ok_a = false, ok_b = false;
+    if (ab.size() == 2) {
+        a = ab[0].trimmed().toUInt(&ok_a);
+        b = ab[1].trimmed().toUInt(&ok_b);
+    }
+    if (!ok_a || !ok_b || b <= a || a >= song->lastTick()) {
+        QMessageBox::warning(this, "MIDI Player", QString("Invalid loop \"%1\"") .arg(text));
+        return;
+    }
+    setLoop(a, b);
+}   // end loopByTicks
+
+static bool parse_time(const QString &text, double *seconds) {
+    // m:ss or plain seconds, fractions allowed
+    QStringList ms = text.trimmed().split(':');
+    if (ms.size() > 2)
+        return false;
+    bool ok;
+    double s = ms.last().toDouble(&ok);
+    if (ok && ms.size() == 2)
+        s += 60 * ms.first().toInt(&ok);
+    *seconds = s;
+    return ok && s >= 0;
+}
+
+void MIDI_PLAYER::loopByTime() {
+    bool ok;
+    QString text = QInputDialog::getText(this, "A-B Loop", "Loop time (m:ss-m:ss):", QLineEdit::Normal, "", &ok);
+    if (!ok)
+        return;
+    QStringList ab = text.split('-');
+    double a, b;
+    if (ab.size() != 2 || !parse_time(ab[0], &a) || !parse_time(ab[1], &b) || b <= a) {
+        QMessageBox::warning(this, "MIDI Player", QString("Invalid loop \"%1\"") .arg(text));
+        return;
+    }
+    setLoop(song->secondsToTick(a), song->secondsToTick(b));
+}   // end loopByTime
+
+void MIDI_PLAYER::loopByMarker() {
+    const META_TEXT &texts = song->texts;
+    int n = texts.count(META_TEXT::MARKER);
+    if (!n) {
+        QMessageBox::information(this, "MIDI Player", "This song has no markers");
+        return;
+    }
+    QStringList names;
+    for (int i = 0; i < n; ++i)
+        names << markerName(i);
+    names << "End of song";
+    bool ok;
+    QString a = QInputDialog::getItem(this, "A-B Loop", "Loop from marker:", names.mid(0, n), 0, false, &ok);
+    if (!ok)
+        return;
+    int ia = names.indexOf(a);
+    QString b = QInputDialog::getItem(this, "A-B Loop", "Loop up to marker:", names.mid(ia+1), 0, false, &ok);
+    if (!ok)
+        return;
+    int ib = names.indexOf(b);
+    unsigned int start = texts.at(META_TEXT::MARKER, ia).tick;
+    unsigned int end = ib < n ? texts.at(META_TEXT::MARKER, ib).tick : song->lastTick() + 1;
+    if (end <= start) {
+        QMessageBox::warning(this, "MIDI Player", "The markers are at the same tick");
+        return;
+    }
+    setLoop(start, end);
+}   // end loopByMarker
+
+void MIDI_PLAYER::loopClear() {
+    setLoop(0, 0);
+}
+
+unsigned int MIDI_PLAYER::songPosition(unsigned int queue_tick) {
+    // the queue never rewinds for a loop, past B it is in a later pass
+    if (loop_b <= loop_a || queue_tick < loop_b)
+        return queue_tick;
+    return loop_a + (queue_tick - loop_b) % (loop_b - loop_a);
+}
+
+void MIDI_PLAYER::setLoop(unsigned int a, unsigned int b) {
+    // a running player has the old loop scheduled ahead; restart it from
+    // where the song is now, the same way a seek does
+    bool playing = ui->Play_button->isChecked();
+    unsigned int pos = ui->progressBar->sliderPosition();
+    if (playing) {
+        snd_seq_get_queue_status(seq, queue, status);
+        pos = songPosition(snd_seq_queue_status_get_tick_time(status));
+        on_progressBar_sliderPressed();
+    }
+    loop_a = a;
+    loop_b = b;
+    if (loop_b > loop_a) {
+        if (pos >= loop_b)
+            pos = loop_a;
+        ui->progressBar->setToolTip(QString("Loop %1 - %2 (ticks %3-%4)")
+                                    .arg(mmss(song->tickToSeconds(a))) .arg(mmss(song->tickToSeconds(b)))
+                                    .arg(a) .arg(b));
+    }
+    else
+        ui->progressBar->setToolTip("");
+    if (playing) {
+        ui->progressBar->setSliderPosition(pos);
+        on_progressBar_sliderReleased();
+    }
+}   // end setLoop
+
+// play_midi() of one zone, on the player pool
+class PLAYER_JOB : public QRunnable {
+public:
+    PLAYER_JOB(MIDI_PLAYER *p, unsigned int tick) : player(p), start(tick) {}
+    void run() { player->runPlayer(start); }
+private:
+    MIDI_PLAYER *player;
+    unsigned int start;
+};
+
+static QThreadPool *player_pool() {
+    // one thread for every zone that plays, kept between songs so a
+    // start costs no thread creation; the parser uses the global pool
+    static QThreadPool *pool = 0;
+    if (!pool) {
+        pool = new QThreadPool(qApp);
+        pool->setMaxThreadCount(std::max(options.zones, 1));
+        pool->setExpiryTimeout(-1);
+    }
+    return pool;
+}
+
 void MIDI_PLAYER::startPlayer(int startTick) {
-    if (pid>0) return;
-        pid=fork();
-    if (!pid) {
-        play_midi(startTick);
-        exit(EXIT_SUCCESS);
-    }   // end pid fork
+    pthread_mutex_lock(&player_lock);
+    bool busy = player_busy;
+    player_busy = true;
+    pthread_mutex_unlock(&player_lock);
+    if (busy)
+        return;
+    // the player times its first note from a control command
+    if (stats)
+        stats->control_cmd_at = command_at;
+    __atomic_store_n(&player_stop, 0, __ATOMIC_RELEASE);
+    player_pool()->start(new PLAYER_JOB(this, startTick));
 }
 
 void MIDI_PLAYER::stopPlayer() {
-    if (pid) {
-        kill(pid,SIGKILL);
-        waitpid(pid,NULL,0);
-    }
-    pid = 0;
-    snd_seq_drop_output(seq);
-    snd_seq_drain_output(seq);
+    // play_midi() looks at player_stop between events and while it waits
+    __atomic_store_n(&player_stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&player_lock);
+    while (player_busy)
+        pthread_cond_wait(&player_idle, &player_lock);
+    pthread_mutex_unlock(&player_lock);
+    // only this zone's events, the other zones keep playing
+    if (zone)
+        zone->dropOutput();
+    // the file holds no notes now, and the note-offs the thru put back
+    // for it must not play when the queue runs again
+    if (thru)
+        thru->dropScheduled();
+    else
+        thru_notes_reset(thru_notes);
 }
 
 void MIDI_PLAYER::on_MIDI_Volume_valueChanged(int val) {
     char buf[8];
-    if (seq) {
-      connect_port();
+    if (seq && zone && zone->hasDest()) {
+      // under the lock so the control thread's sysex can't interleave
+      pthread_mutex_lock(&transport_lock);
       buf[0] = 0xF0;
       buf[1] = 0x7F;
       buf[2] = 0x7F;
@@ -535,5 +1212,423 @@ void MIDI_PLAYER::on_MIDI_Volume_valueChanged(int val) {
       buf[6] = val;
       buf[7] = 0xF7;
       send_SysEx(buf, 8);
+      pthread_mutex_unlock(&transport_lock);
   }
 }
+
+//  TRANSPORT: the queue and the player, no widgets and no message
+//  boxes, so the control thread can use them too; callers hold transport_lock
+int MIDI_PLAYER::transportPlay(unsigned int tick) {
+    // the song is already parsed, only the queue tempo needs resetting.
+    // The start and position go out before the player does, so its
+    // first events meet a running queue at the right tick
+    zone->lockOutput();
+    int err = reset_tempo();
+    int started = snd_seq_start_queue(seq, queue, NULL);
+    if (tick) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_direct(&ev);
+        snd_seq_ev_set_queue_pos_tick(&ev, queue, tick);
+        snd_seq_event_output(seq, &ev);
+    }
+    drain();
+    zone->unlockOutput();
+    startPlayer(tick);
+    transport = PLAYING;
+    return err < 0 ? err : started;
+}   // end transportPlay
+
+void MIDI_PLAYER::transportHalt() {
+    // queue and player stopped, the position kept for what comes next
+    zone->lockOutput();
+    snd_seq_stop_queue(seq,queue,NULL);
+    drain();
+    zone->unlockOutput();
+    stopPlayer();
+}
+
+void MIDI_PLAYER::transportStop() {
+    transportHalt();
+    transport = STOPPED;
+}
+
+unsigned int MIDI_PLAYER::transportPause() {
+    long long t0 = stats ? stats_now() : 0;
+    stopPlayer();
+    snd_seq_get_queue_status(seq, queue, transport_status);
+    unsigned int current_tick = snd_seq_queue_status_get_tick_time(transport_status);
+    zone->lockOutput();
+    snd_seq_stop_queue(seq,queue,NULL);
+    drain();
+    zone->unlockOutput();
+    transport = PAUSED;
+    if (stats) {
+        long long t = stats_now() - t0;
+        ++stats->pauses;
+        stats->pause_ns += t;
+        stats->pause_max_ns = std::max(stats->pause_max_ns, t);
+    }
+    return current_tick;
+}   // end transportPause
+
+unsigned int MIDI_PLAYER::transportResume() {
+    zone->lockOutput();
+    snd_seq_continue_queue(seq, queue, NULL);
+    drain();
+    zone->unlockOutput();
+    snd_seq_get_queue_status(seq, queue, transport_status);
+    unsigned int current_tick = snd_seq_queue_status_get_tick_time(transport_status);
+    startPlayer(current_tick);
+    transport = PLAYING;
+    return current_tick;
+}   // end transportResume
+
+unsigned int MIDI_PLAYER::transportSeek(unsigned int tick) {
+    // after transportHalt() or while paused: the queue goes to the first
+    // event at or after tick, and a playing song goes on from there
+    if (transport == STOPPED)
+        return 0;
+    long long t0 = stats ? stats_now() : 0;
+    std::vector<event>::iterator next = std::lower_bound(song->events.begin(), song->events.end(), tick,
+        [](const event &e, unsigned int t) { return e.tick < t; });
+    unsigned int pos = next != song->events.end() ? next->tick : song->lastTick();
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_direct(&ev);
+    ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
+    ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+    snd_seq_ev_set_queue_pos_tick(&ev, queue, pos);
+    zone->lockOutput();
+    snd_seq_event_output(seq, &ev);
+    drain();
+    if (transport == PAUSED) {
+        zone->unlockOutput();
+        return pos;
+    }
+    snd_seq_continue_queue(seq, queue, NULL);
+    drain();
+    zone->unlockOutput();
+    startPlayer(pos);
+    if (stats) {
+        // reposition, restart and start of the new player
+        long long t = stats_now() - t0;
+        ++stats->seeks;
+        stats->seek_ns += t;
+        stats->seek_max_ns = std::max(stats->seek_max_ns, t);
+    }
+    return pos;
+}   // end transportSeek
+
+void MIDI_PLAYER::notesOff() {
+    // all notes off and reset controllers on every channel
+    char buf[3];
+    for (int x=0;x<16;x++) {
+        buf[0] = 0xb0+x;
+        buf[1] = 0x7B;
+        buf[2] = 00;
+        send_data(buf,3);
+        buf[0] = 0xb0+x;
+        buf[1] = 0x79;
+        buf[2] = 00;
+        send_data(buf,3);
+    }
+}   // end notesOff
+
+//  CONTROL SOCKET: runs on the server's thread, see control_socket.h
+//      load PATH                   parse and make it the song, stopped
+//      play [POS]                  from the start or POS, or resume
+//      stop, pause, resume
+//      seek POS                    POS is ticks, m:ss.f or seconds with an s
+//      port CLIENT:PORT            client may be a name
+//      volume 0-127                master volume sysex
+//      tempo PCT                   25-400 percent of the song's tempo
+//      transpose N                 semitones, -24 to 24, channel 10 stays
+//      mute LIST, solo LIST        channels as "1,2,10", or none
+//      pos                         state, tick and time
+//      stats                       counters and command-to-note latency
+void MIDI_PLAYER::control_command(void *self, char *command, long long received, char *reply, int size) {
+    static_cast<MIDI_PLAYER *>(self)->controlCommand(command, received, reply, size);
+}
+
+static bool parse_position(const MIDI_FILE *song, const char *text, unsigned int *tick) {
+    QString pos = QString(text).trimmed();
+    if (pos.contains(":") || pos.endsWith("s")) {
+        double seconds;
+        if (pos.endsWith("s"))
+            pos = pos.left(pos.length() - 1);
+        if (!parse_time(pos, &seconds))
+            return false;
+        *tick = song->secondsToTick(seconds);
+        return true;
+    }
+    bool ok;
+    *tick = pos.toUInt(&ok);
+    return ok;
+}
+
+void MIDI_PLAYER::controlCommand(char *command, long long received, char *reply, int size) {
+    static const char *state_name[] = { "stopped", "playing", "paused" };
+    char *arg = command + strcspn(command, " \t");
+    if (*arg)
+        *arg++ = 0;
+    arg += strspn(arg, " \t");
+    if (!strcmp(command, "load")) {
+        controlLoad(arg, reply, size);
+        return;
+    }
+    pthread_mutex_lock(&transport_lock);
+    command_at = received;
+    if (stats)
+        ++stats->control_commands;
+    bool moved = true;      // the window has something to catch up on
+    unsigned int tick = 0;
+    if (!strcmp(command, "play")) {
+        if (song->events.empty())
+            snprintf(reply, size, "ERR no song loaded");
+        else if (*arg && !parse_position(song, arg, &tick))
+            snprintf(reply, size, "ERR bad position %s", arg);
+        else if (transport == STOPPED) {
+            int err = strlen(port_name) ? zone->connectDest(port_name) : 0;
+            if (err >= 0)
+                err = transportPlay(tick);
+            if (err < 0)
+                snprintf(reply, size, "ERR %s", snd_strerror(err));
+            else
+                snprintf(reply, size, "OK playing from %u", tick);
+        } else if (*arg) {
+            if (transport == PLAYING) {
+                transportHalt();
+                notesOff();
+            }
+            tick = transportSeek(tick);
+            if (transport == PAUSED)
+                tick = transportResume();
+            snprintf(reply, size, "OK playing from %u", tick);
+        } else if (transport == PAUSED)
+            snprintf(reply, size, "OK playing from %u", transportResume());
+        else {
+            snprintf(reply, size, "OK playing");
+            moved = false;
+        }
+    } else if (!strcmp(command, "stop")) {
+        if (transport != STOPPED) {
+            transportStop();
+            notesOff();
+        }
+        snprintf(reply, size, "OK stopped");
+    } else if (!strcmp(command, "pause")) {
+        if (transport == PLAYING) {
+            tick = songPosition(transportPause());
+            notesOff();
+            snprintf(reply, size, "OK paused at %u", tick);
+        } else
+            snprintf(reply, size, "ERR %s", state_name[transport]);
+    } else if (!strcmp(command, "resume")) {
+        if (transport == PAUSED)
+            snprintf(reply, size, "OK playing from %u", transportResume());
+        else
+            snprintf(reply, size, "ERR %s", state_name[transport]);
+    } else if (!strcmp(command, "seek")) {
+        if (!parse_position(song, arg, &tick))
+            snprintf(reply, size, "ERR bad position %s", arg);
+        else if (transport == STOPPED)
+            snprintf(reply, size, "ERR stopped, use play %s", arg);
+        else {
+            if (transport == PLAYING) {
+                transportHalt();
+                notesOff();
+            }
+            snprintf(reply, size, "OK %s from %u", state_name[transport], transportSeek(tick));
+        }
+    } else if (!strcmp(command, "port")) {
+        snd_seq_addr_t addr;
+        int err = snd_seq_parse_address(seq, &addr, arg);
+        if (err >= 0) {
+            snprintf(port_name, sizeof(port_name), "%d:%d", addr.client, addr.port);
+            err = zone->connectDest(port_name);
+        }
+        if (err < 0)
+            snprintf(reply, size, "ERR port %s: %s", arg, snd_strerror(err));
+        else {
+            snprintf(reply, size, "OK port %s", port_name);
+            port_changed = true;
+        }
+    } else if (!strcmp(command, "volume")) {
+        char *end;
+        long val = strtol(arg, &end, 10);
+        if (!*arg || *end || val < 0 || val > 127)
+            snprintf(reply, size, "ERR volume is 0-127");
+        else if (!zone->hasDest())
+            snprintf(reply, size, "ERR no port");
+        else {
+            // straight out, the player keeps going
+            unsigned char buf[8] = { 0xF0, 0x7F, 0x7F, 0x04, 0x01, 0x00, static_cast<unsigned char>(val), 0xF7 };
+            snd_seq_event_t ev;
+            snd_seq_ev_clear(&ev);
+            ev.type = SND_SEQ_EVENT_SYSEX;
+            ev.source.port = zone->port();
+            ev.dest = *zone->dest();
+            snd_seq_ev_set_variable(&ev, sizeof(buf), buf);
+            snd_seq_ev_set_direct(&ev);
+            zone->lockOutput();
+            int err = snd_seq_event_output_direct(seq, &ev);
+            zone->unlockOutput();
+            if (err < 0)
+                snprintf(reply, size, "ERR %s", snd_strerror(err));
+            else {
+                snprintf(reply, size, "OK volume %ld", val);
+                control_volume = val;
+            }
+        }
+    } else if (!strcmp(command, "tempo") || !strcmp(command, "transpose") ||
+               !strcmp(command, "mute") || !strcmp(command, "solo")) {
+        controlTransform(command, arg, reply, size);
+    } else if (!strcmp(command, "pos")) {
+        if (transport != STOPPED) {
+            snd_seq_get_queue_status(seq, queue, transport_status);
+            tick = songPosition(snd_seq_queue_status_get_tick_time(transport_status));
+        }
+        snprintf(reply, size, "OK %s %u %u %.3f %.3f", state_name[transport], tick, song->lastTick(),
+                 song->tickToSeconds(tick), song->song_length_seconds);
+        moved = false;
+    } else if (!strcmp(command, "stats")) {
+        snprintf(reply, size, "OK %s", stats_line(stats).toLocal8Bit().data());
+        moved = false;
+    } else {
+        snprintf(reply, size, "ERR unknown command %s", command);
+        moved = false;
+    }
+    command_at = 0;
+    pthread_mutex_unlock(&transport_lock);
+    if (moved)
+        QMetaObject::invokeMethod(this, "controlSync", Qt::QueuedConnection);
+}   // end controlCommand
+
+void MIDI_PLAYER::controlLoad(const char *path, char *reply, int size) {
+    // parsed here, outside the lock; the window keeps the old song until
+    // controlSync() has moved its views off it
+    MIDI_FILE *loaded = new MIDI_FILE;
+    if (!loaded->load(path)) {
+        snprintf(reply, size, "ERR %s", loaded->errorString().toLocal8Bit().data());
+        delete loaded;
+        return;
+    }
+    pthread_mutex_lock(&transport_lock);
+    if (stats)
+        ++stats->control_commands;
+    if (transport != STOPPED) {
+        transportStop();
+        notesOff();
+    }
+    retired.push_back(song);
+    song = loaded;
+    strncpy(playfile, path, sizeof(playfile) - 1);
+    reset_tempo();
+    loop_a = loop_b = 0;
+    song_changed = true;
+    pthread_mutex_unlock(&transport_lock);
+    snprintf(reply, size, "OK loaded %d events, %u ticks, %.3f s", static_cast<int>(loaded->events.size()),
+             loaded->lastTick(), loaded->song_length_seconds);
+    QMetaObject::invokeMethod(this, "controlSync", Qt::QueuedConnection);
+}   // end controlLoad
+
+void MIDI_PLAYER::controlTransform(const char *command, const char *arg, char *reply, int size) {
+    // the player picks the change up by itself; the caller holds transport_lock
+    if (!transforms) {
+        snprintf(reply, size, "ERR no transforms");
+        return;
+    }
+    int tempo = transforms->tempo_percent, semitones = transforms->transpose;
+    unsigned int mute = transforms->mute, solo = transforms->solo;
+    char *end;
+    long val = strtol(arg, &end, 10);
+    bool number = *arg && (!*end || (!strcmp(end, "%") && !strcmp(command, "tempo")));
+    if (!strcmp(command, "tempo")) {
+        if (!number || val < TRANSFORMS::MIN_TEMPO || val > TRANSFORMS::MAX_TEMPO) {
+            snprintf(reply, size, "ERR tempo is %d-%d percent", TRANSFORMS::MIN_TEMPO, TRANSFORMS::MAX_TEMPO);
+            return;
+        }
+        tempo = val;
+    } else if (!strcmp(command, "transpose")) {
+        if (!number || val < -TRANSFORMS::MAX_TRANSPOSE || val > TRANSFORMS::MAX_TRANSPOSE) {
+            snprintf(reply, size, "ERR transpose is -%d to %d", TRANSFORMS::MAX_TRANSPOSE, TRANSFORMS::MAX_TRANSPOSE);
+            return;
+        }
+        semitones = val;
+    } else if (!parse_channels(arg, !strcmp(command, "mute") ? &mute : &solo)) {
+        snprintf(reply, size, "ERR bad channel list %s", arg);
+        return;
+    }
+    transforms_set(transforms, tempo, semitones, mute, solo);
+    transforms_changed = true;
+    char muted[48], soloed[48];
+    format_channels(mute, muted, sizeof(muted));
+    format_channels(solo, soloed, sizeof(soloed));
+    snprintf(reply, size, "OK tempo %d%% transpose %d mute %s solo %s",
+             transforms->tempo_percent, transforms->transpose, muted, soloed);
+}   // end controlTransform
+
+void MIDI_PLAYER::controlSync() {
+    // the widgets follow what the control socket did, without running
+    // their slots again
+    pthread_mutex_lock(&transport_lock);
+    int state = transport;
+    bool changed = song_changed, port = port_changed;
+    int volume = control_volume;
+    bool transformed = transforms_changed;
+    std::vector<MIDI_FILE *> old;
+    old.swap(retired);
+    song_changed = port_changed = transforms_changed = false;
+    control_volume = -1;
+    pthread_mutex_unlock(&transport_lock);
+    if (changed) {
+        ui->MidiFile_display->setText(playfile);
+        songChanged();
+    }
+    for (size_t i = 0; i < old.size(); ++i)
+        delete old[i];
+    ui->Play_button->blockSignals(true);
+    ui->Play_button->setChecked(state != STOPPED);
+    ui->Play_button->blockSignals(false);
+    ui->Play_button->setText(state != STOPPED ? "Stop" : "Play");
+    ui->Pause_button->blockSignals(true);
+    ui->Pause_button->setChecked(state == PAUSED);
+    ui->Pause_button->blockSignals(false);
+    ui->Pause_button->setText(state == PAUSED ? "Resume" : "Pause");
+    ui->Pause_button->setEnabled(state != STOPPED);
+    ui->Open_button->setEnabled(state == STOPPED);
+    ui->progressBar->setEnabled(state != STOPPED);
+    if (state == PLAYING && !timer->isActive())
+        timer->start(200);
+    else if (state != PLAYING)
+        timer->stop();
+    if (state == STOPPED) {
+        ui->progressBar->blockSignals(true);
+        ui->progressBar->setValue(0);
+        ui->progressBar->blockSignals(false);
+        ui->MIDI_time_display->setText("00:00");
+    }
+    if (transformed)
+        transformShow();
+    if (volume >= 0) {
+        ui->MIDI_Volume->blockSignals(true);
+        ui->MIDI_Volume->setValue(volume);
+        ui->MIDI_Volume->blockSignals(false);
+    }
+    if (port) {
+        // the PortBox entry with that address, if the registry has one
+        snd_seq_addr_t want, addr;
+        if (snd_seq_parse_address(seq, &want, port_name) >= 0) {
+            for (int i = 0; i < ui->PortBox->count(); ++i) {
+                if (session->devices().findPort(ui->PortBox->itemText(i), &addr) &&
+                    addr.client == want.client && addr.port == want.port) {
+                    ui->PortBox->blockSignals(true);
+                    ui->PortBox->setCurrentIndex(i);
+                    ui->PortBox->blockSignals(false);
+                    break;
+                }
+            }
+        }
+    }
+}   // end controlSync
@@ -4,8 +4,18 @@
 #include <QtGui>
 #include <QMainWindow>
 #include <QTimer>
+#include <QFutureWatcher>
 #include <alsa/asoundlib.h>
 #include <vector>
+#include "seq_session.h"
+#include "midi_file.h"
+#include "player_stats.h"
+#include "piano_roll.h"
+#include "recorder.h"
+#include "live_thru.h"
+#include "control_socket.h"
+#include "transform.h"
+#include <pthread.h>
 
 namespace Ui {
     class MIDI_PLAYER;
@@ -13,70 +23,131 @@ namespace Ui {
 
 class MIDI_PLAYER : public QMainWindow {
     friend class TIMER_THREAD;
+    friend class PLAYER_JOB;
 
     Q_OBJECT
 
 public:
-    MIDI_PLAYER(QWidget *parent = 0);
+    MIDI_PLAYER(QWidget *parent = 0, int index = 0);
     ~MIDI_PLAYER();
 
+    const PLAYER_STATS *statistics() const { return stats; }
+
 protected:
 
 private:
     Ui::MIDI_PLAYER *ui;
 
-    struct event {
-        struct event *next;		// linked list
-        unsigned char type;		// SND_SEQ_EVENT_xxx
-        unsigned char port;		// port index, generally not used
-        unsigned int tick;
-        union {
-            unsigned char d[3];	// channel and data bytes
-            int tempo;
-            unsigned int length;	// length of sysex data
-        } data;
-        std::vector<char> sysex;
-    };  // end struct event definition
+    typedef MIDI_FILE::event event;
 
     struct track {
-        struct event *first_event;	// list of all events in this track
+        event *first_event;	// list of all events in this track
         int end_tick;			// length of this track
-        struct event *current_event;	// used while loading and playing
+        event *current_event;	// used while loading and playing
     };  // end struct track definition
 
-    static snd_seq_t *seq;
-    static snd_seq_addr_t *ports;
+    SEQ_SESSION *session;
+    int zone_index;
+    SEQ_ZONE *zone;     // this window's queue, port and destination
+    snd_seq_t *seq;     // all owned by the session, cached here
     int queue;
-    static double song_length_seconds;
-    static bool minor_key;
-    static int sf;  // sharps/flats
-    static double BPM,PPQ;
+    unsigned int port_serial;   // registry state the PortBox shows
 
-    std::vector<struct event> all_events;
+    MIDI_FILE *song;    // what Play plays
+    MIDI_FILE *loading; // being parsed on the thread pool, 0 if idle
+    QFutureWatcher<bool> *loader;
     QTimer *timer;
+    snd_seq_queue_status_t *status;
+    char playfile[PATH_MAX];
+    // play_midi() runs on a thread of the player pool, shared by all zones
+    pthread_mutex_t player_lock;
+    pthread_cond_t player_idle;
+    bool player_busy;   // a pool thread is playing for this zone
+    int player_stop;    // set by stopPlayer(), play_midi() returns soon after
+    char port_name[16];
+    char MIDI_dev[16];
+    PLAYER_STATS *stats;        // 0 unless --stats
+    QTimer *stats_timer;
+    QDialog *stats_panel;
+    QPlainTextEdit *stats_view;
+    int stats_ticks;
+    unsigned int loop_a, loop_b;    // A/B loop in song ticks, off unless b > a
+    QMenu *marker_menu;
+    QDialog *lyrics_panel;
+    QLabel *lyric_label, *marker_label, *cue_label;
+    QTimer *lyrics_timer;
+    int lyric_kind;     // META_TEXT::LYRIC, or TEXT for .kar files
+    int lyric_shown;    // syllable the lyric line was drawn for
+    QDialog *analysis_panel;
+    QPlainTextEdit *analysis_view;
+    QDialog *roll_panel;
+    PIANO_ROLL *roll;
+    QTimer *roll_timer;
+    MIDI_RECORDER *recorder;   // 0 until the first recording
+    QAction *record_start, *record_stop;
+    THRU_NOTES *thru_notes;     // notes held by the file and the live input
+    LIVE_THRU *thru;            // 0 until the first Live > Thru
+    QAction *thru_start, *thru_stop;
+    TRANSFORMS *transforms;     // tempo, transpose, mute and solo the player applies
+    QDialog *transform_panel;
+    QSpinBox *tempo_box, *transpose_box;
+    QCheckBox *mute_box[16], *solo_box[16];
+    // the transport is driven by the slots and by the control socket's
+    // thread; both take transport_lock around the transport*() functions
+    enum { STOPPED, PLAYING, PAUSED };
+    pthread_mutex_t transport_lock;
+    int transport;
+    snd_seq_queue_status_t *transport_status;
+    long long command_at;       // arrival of the control command being applied, 0 for the GUI
+    CONTROL_SERVER *control;    // first window with --control only
+    std::vector<MIDI_FILE *> retired;   // replaced by "load", freed by controlSync()
+    bool song_changed;          // by "load", since the last controlSync()
+    bool port_changed;
+    int control_volume;         // set by "volume", -1 once shown
+    bool transforms_changed;    // by "tempo", "transpose", "mute" or "solo"
+
     inline void check_snd(const char *, int);
-    inline int read_id(void);
-    inline int read_byte(void);
-    inline void skip(int);
-    static bool tick_comp(const struct event& e1, const struct event& e2);
-    int read_int(int);
-    int read_var(void);
-    int read_32_le(void);
-    int read_smf(char *);
-    int read_riff(char *);
-    int read_track(int, char *);
     void play_midi(unsigned int);
+    inline int output_event(snd_seq_event_t *);
+    int drain();
+    void sample_pool();
+    void record_parse();
+    unsigned int sysex_ticks(unsigned int, int);
+    void enter_realtime();
+    void leave_realtime();
     void send_data(char *, int);
     void init_seq();
-    void close_seq();
     void connect_port();
     void disconnect_port();
-    int parseFile(char *);
+    int reset_tempo();
+    void setupTimer();
     void getPorts(QString buf="");
     void getRawDev(QString buf="");
     void startPlayer(int startTick=0);
     void stopPlayer();
+    void runPlayer(unsigned int);
+    bool stopping() const { return __atomic_load_n(&player_stop, __ATOMIC_ACQUIRE); }
     void send_SysEx(char *, int);
+    unsigned int songPosition(unsigned int);
+    void setLoop(unsigned int, unsigned int);
+    unsigned int displayPosition();
+    void seekTo(unsigned int);
+    QString markerName(int);
+    void fillMarkers();
+    void chase_state(unsigned int, std::vector<event> &);
+    int transportPlay(unsigned int);
+    void transportHalt();
+    void transportStop();
+    unsigned int transportPause();
+    unsigned int transportResume();
+    unsigned int transportSeek(unsigned int);
+    void notesOff();
+    void songChanged();
+    static void control_command(void *, char *, long long, char *, int);
+    void controlCommand(char *, long long, char *, int);
+    void controlLoad(const char *, char *, int);
+    void controlTransform(const char *, const char *, char *, int);
+    void transformShow();
 
 private slots:
     void on_progressBar_sliderReleased();
@@ -88,6 +159,35 @@ private slots:
     void on_Open_button_clicked();
     void on_MIDI_Volume_valueChanged(int);
     void tickDisplay();
+    void songEnded();
+    void seqInput();
+    void fileLoaded();
+    void showStats();
+    void statsTick();
+    void loopSetA();
+    void loopSetB();
+    void loopByTicks();
+    void loopByTime();
+    void loopByMarker();
+    void loopClear();
+    void markerJump();
+    void markerNext();
+    void markerPrevious();
+    void showLyrics();
+    void lyricsTick();
+    void showAnalysis();
+    void showRoll();
+    void rollTick();
+    void rollSeek(int);
+    void recordStart();
+    void recordStop();
+    void thruStart();
+    void thruStop();
+    void thruReport();
+    void showTransforms();
+    void transformEdited();
+    void transformReset();
+    void controlSync();
 };
 
 #endif // MIDI_PLAYER_H
@@ -0,0 +1,200 @@
+// note_index.cpp -- part of MIDI_PLAYER
+// note intervals of a song and the per-channel trees that answer range queries
+// contains:
+//      clear()
+//      noteOn()        -- opens a note, called while parsing
+//      noteOff()       -- closes the oldest open note of that key
+//      endTrack()
+//      finish()        -- sorts and builds the trees
+//      build()         -- one centered interval tree node, recursive
+//      overlapping()   -- O(log n + k) range query
+//      stab()          -- notes started before t0 and still sounding at t0
+//      sounding()      -- stab() over all channels
+//      density()       -- notes per slice for an overview
+
+#include "note_index.h"
+#include <algorithm>
+
+namespace {
+// sort helpers over indexes into the note vector
+struct by_start_comp {
+    const std::vector<NOTE_INDEX::note> &n;
+    by_start_comp(const std::vector<NOTE_INDEX::note> &v) : n(v) {}
+    bool operator()(int a, int b) const { return n[a].start < n[b].start; }
+};
+struct by_end_comp {
+    const std::vector<NOTE_INDEX::note> &n;
+    by_end_comp(const std::vector<NOTE_INDEX::note> &v) : n(v) {}
+    bool operator()(int a, int b) const { return n[a].end > n[b].end; }
+};
+}
+
+void NOTE_INDEX::clear() {
+    notes.clear();
+    for (int ch = 0; ch < 16; ++ch) {
+        channels[ch] = tree();
+        channels[ch].root = -1;
+        for (int key = 0; key < 128; ++key)
+            pending[ch][key].clear();
+    }
+    low_key = 127;
+    high_key = 0;
+}
+
+void NOTE_INDEX::noteOn(int track, unsigned int tick, int channel, int key, int velocity) {
+    note n;
+    n.start = n.end = tick;
+    n.channel = channel & 0x0f;
+    n.key = key & 0x7f;
+    n.velocity = velocity;
+    n.track = track;
+    pending[n.channel][n.key].push_back(notes.size());
+    notes.push_back(n);
+}
+
+void NOTE_INDEX::noteOff(unsigned int tick, int channel, int key) {
+    // a retriggered key is paired first in, first out
+    std::vector<int> &open = pending[channel & 0x0f][key & 0x7f];
+    if (open.empty())
+        return;     // stray note-off
+    notes[open.front()].end = tick;
+    open.erase(open.begin());
+}
+
+void NOTE_INDEX::endTrack(unsigned int tick) {
+    for (int ch = 0; ch < 16; ++ch) {
+        for (int key = 0; key < 128; ++key) {
+            std::vector<int> &open = pending[ch][key];
+            for (size_t i = 0; i < open.size(); ++i)
+                notes[open[i]].end = tick;
+            open.clear();
+        }
+    }
+}   // end endTrack
+
+void NOTE_INDEX::finish() {
+    std::vector<int> ids[16];
+    for (int i = 0; i < count(); ++i) {
+        note &n = notes[i];
+        // a note that ends where it starts is still drawn and found
+        if (n.end <= n.start)
+            n.end = n.start + 1;
+        ids[n.channel].push_back(i);
+        low_key = std::min(low_key, static_cast<int>(n.key));
+        high_key = std::max(high_key, static_cast<int>(n.key));
+    }
+    for (int ch = 0; ch < 16; ++ch) {
+        tree &t = channels[ch];
+        t.starts = ids[ch];
+        std::stable_sort(t.starts.begin(), t.starts.end(), by_start_comp(notes));
+        t.nodes.reserve(ids[ch].size());
+        t.by_start.reserve(ids[ch].size());
+        t.by_end.reserve(ids[ch].size());
+        std::vector<int> sorted = t.starts;
+        t.root = build(t, sorted);
+    }
+}   // end finish
+
+int NOTE_INDEX::build(tree &t, std::vector<int> &ids) {
+    // ids are sorted by start; the center is the start of the median note,
+    // so that note stays here and each side gets at most half
+    if (ids.empty())
+        return -1;
+    unsigned int center = notes[ids[ids.size() / 2]].start;
+    std::vector<int> left, right, here;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const note &n = notes[ids[i]];
+        if (n.end <= center)
+            left.push_back(ids[i]);
+        else if (n.start > center)
+            right.push_back(ids[i]);
+        else
+            here.push_back(ids[i]);
+    }
+    std::vector<int>().swap(ids);   // the recursion holds enough copies
+    node nd;
+    nd.center = center;
+    nd.first = t.by_start.size();
+    nd.count = here.size();
+    t.by_start.insert(t.by_start.end(), here.begin(), here.end());
+    std::stable_sort(here.begin(), here.end(), by_end_comp(notes));
+    t.by_end.insert(t.by_end.end(), here.begin(), here.end());
+    int self = t.nodes.size();
+    t.nodes.push_back(nd);
+    int l = build(t, left);
+    int r = build(t, right);
+    t.nodes[self].left = l;
+    t.nodes[self].right = r;
+    return self;
+}   // end build
+
+void NOTE_INDEX::stab(const tree &t, unsigned int t0, std::vector<int> &out) const {
+    // notes with start < t0 < end; the ones starting at t0 or later are
+    // found by overlapping() from the start order
+    int i = t.root;
+    while (i >= 0) {
+        const node &nd = t.nodes[i];
+        if (t0 < nd.center) {
+            // all of them end after the center, take those started before t0
+            for (int j = nd.first; j < nd.first + nd.count && notes[t.by_start[j]].start < t0; ++j)
+                out.push_back(t.by_start[j]);
+            i = nd.left;
+        } else {
+            // all of them start at or before the center, take those still on
+            for (int j = nd.first; j < nd.first + nd.count && notes[t.by_end[j]].end > t0; ++j)
+                if (notes[t.by_end[j]].start < t0)
+                    out.push_back(t.by_end[j]);
+            i = nd.right;
+        }
+    }
+}   // end stab
+
+void NOTE_INDEX::overlapping(unsigned int t0, unsigned int t1, std::vector<int> &out, unsigned int channel_mask) const {
+    if (t1 <= t0)
+        return;
+    for (int ch = 0; ch < 16; ++ch) {
+        if (!(channel_mask & (1u << ch)))
+            continue;
+        const tree &t = channels[ch];
+        if (t.root < 0)
+            continue;
+        stab(t, t0, out);
+        // started inside the range
+        std::vector<int>::const_iterator it = t.starts.begin(), end = t.starts.end();
+        int lo = 0, hi = t.starts.size();
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (notes[t.starts[mid]].start < t0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (it += lo; it != end && notes[*it].start < t1; ++it)
+            out.push_back(*it);
+    }
+}   // end overlapping
+
+void NOTE_INDEX::sounding(unsigned int tick, std::vector<int> &out) const {
+    for (int ch = 0; ch < 16; ++ch)
+        if (channels[ch].root >= 0)
+            stab(channels[ch], tick, out);
+}
+
+void NOTE_INDEX::density(unsigned int length, int bins, std::vector<int> &out) const {
+    // +1 where a note starts sounding, -1 after its last slice, then a running sum
+    if (!length || bins <= 0) {
+        out.assign(std::max(bins, 0), 0);
+        return;
+    }
+    out.assign(bins + 1, 0);
+    double scale = static_cast<double>(bins) / length;
+    for (int i = 0; i < count(); ++i) {
+        int a = std::min(bins - 1, static_cast<int>(notes[i].start * scale));
+        int b = std::min(bins - 1, static_cast<int>((notes[i].end - 1) * scale));
+        ++out[a];
+        --out[b + 1];
+    }
+    for (int i = 1; i <= bins; ++i)
+        out[i] += out[i - 1];
+    out.resize(bins);
+}   // end density
@@ -0,0 +1,62 @@
+#ifndef NOTE_INDEX_H
+#define NOTE_INDEX_H
+
+#include <vector>
+
+// Every note of a song as one interval [start, end) in ticks, paired from
+// its note-on and note-off (or note-on with velocity 0) while the tracks
+// are decoded.  Each channel has a static centered interval tree, so
+// "the notes overlapping [t0, t1)" costs O(log n + k) however long the
+// song is; a piano roll can ask for its viewport every frame.
+// Implemented in note_index.cpp.
+class NOTE_INDEX {
+public:
+    struct note {
+        unsigned int start, end;    // ticks, end exclusive
+        unsigned char channel, key, velocity;
+        unsigned short track;
+    };
+
+    // building, called by the parser for one track at a time
+    void clear();
+    void noteOn(int track, unsigned int tick, int channel, int key, int velocity);
+    void noteOff(unsigned int tick, int channel, int key);
+    void endTrack(unsigned int tick);   // closes notes still held
+    void finish();                      // builds the trees
+
+    int count() const { return notes.size(); }
+    const note &at(int i) const { return notes[i]; }
+    int lowKey() const { return low_key; }
+    int highKey() const { return high_key; }
+    // appends to 'out' the index of every note of the channels in
+    // channel_mask (bit n for channel n) that sounds somewhere in [t0, t1)
+    void overlapping(unsigned int t0, unsigned int t1, std::vector<int> &out, unsigned int channel_mask = 0xffff) const;
+    // the notes started before tick and still sounding at it
+    void sounding(unsigned int tick, std::vector<int> &out) const;
+    // number of notes sounding in each of 'bins' equal slices of [0, length)
+    void density(unsigned int length, int bins, std::vector<int> &out) const;
+
+private:
+    struct node {
+        unsigned int center;
+        int left, right;    // child nodes, -1 for none
+        int first, count;   // by_start[first..] and by_end[first..] hold its notes
+    };
+    struct tree {
+        std::vector<int> starts;    // all notes of the channel sorted by start
+        std::vector<node> nodes;
+        std::vector<int> by_start;  // each node's notes, start ascending
+        std::vector<int> by_end;    // the same notes, end descending
+        int root;
+    };
+
+    int build(tree &t, std::vector<int> &ids);
+    void stab(const tree &t, unsigned int t0, std::vector<int> &out) const;
+
+    std::vector<note> notes;
+    tree channels[16];
+    std::vector<int> pending[16][128];  // open note-ons of the current track, oldest first
+    int low_key, high_key;
+};
+
+#endif // NOTE_INDEX_H
@@ -0,0 +1,31 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+// command line settings, filled in by main() before any window exists
+struct PLAYER_OPTIONS {
+    const char *timer;      // queue timer source: auto, hrtimer, system, pcm
+    int timer_freq;         // preferred queue timer frequency in Hz, 0 = ALSA default
+    bool calibrate;         // measure the queue timer at startup
+    int rt_priority;        // real-time priority of the player, 0 = normal scheduling
+    const char *rt_policy;  // fifo or rr
+    double rt_selftest;     // seconds of wakeup latency test at startup, 0 = none
+    int sysex_chunk;        // largest sysex packet sent at once, 0 = whole message
+    int sysex_rate;         // sysex bytes per second the device accepts, 0 = no pacing
+    int zones;              // player windows, each with its own queue and destination
+    bool stats;             // keep hot path counters and timers
+    const char *stats_json; // write the counters here at exit, 0 = don't
+    int stats_log;          // seconds between log lines on stderr, 0 = none
+    int lookahead_ms;       // shortest scheduling lead of the player, 0 = fill the pool
+    int lookahead_max_ms;   // how far it may widen under load
+    int voices;             // notes the destination can hold, 0 = no limit
+    const char *voice_steal;    // oldest, quietest, priority or drop
+    const char *voice_priority; // channels most important first, "10,1,2"
+    const char *thru;       // live input merged into the first zone, 0 = none
+    const char *thru_map;   // channel remap of the live input, "1:10,*:2"
+    const char *thru_filter;    // event kinds the live input drops
+    const char *control;    // Unix socket for transport commands, 0 = none
+};
+
+extern PLAYER_OPTIONS options;
+
+#endif // OPTIONS_H
@@ -0,0 +1,351 @@
+// parse_bench.cpp -- part of MIDI_PLAYER
+// "--bench-parse FILE..." : time the table-driven track decoder and its
+// vectorized scan variant against the switch-per-status decoder they
+// replaced, on the same MTrk data.  All feed a sink that checksums
+// every event, so a mismatch between them is reported as well.
+// "--verify-decoder [TRACKS]" : differential check of decode_track_scan()
+// and every scan_high_bits() variant against the scalar decoder, on a
+// generated corpus including damaged tracks.
+// contains:
+//      BENCH_SINK         -- counts and checksums decoded events
+//      RECORD_SINK        -- keeps every decoded event for comparison
+//      switch_decode()    -- the previous read_track() logic on a buffer
+//      find_tracks()      -- locate the MTrk chunks of an SMF/RIFF image
+//      bench_parse()      -- entry point, prints one line per file
+//      make_track()       -- random track for the corpus
+//      verify_decoder()   -- entry point, prints a summary
+
+#include "midi_decoder.h"
+#include "parse_bench.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+struct BENCH_SINK {
+    unsigned long events;
+    unsigned long sum;
+
+    BENCH_SINK() : events(0), sum(0) {}
+    void add(unsigned int tick, unsigned int a, unsigned int b) {
+        ++events;
+        sum = sum * 31 + tick * 7 + a * 3 + b;
+    }
+    void channel(unsigned int tick, unsigned char type, unsigned char ch, unsigned char d1, unsigned char d2) {
+        add(tick, type << 8 | ch, d1 << 8 | d2);
+    }
+    bool sysex(unsigned int tick, unsigned char cmd, const unsigned char *, unsigned int len) {
+        add(tick, cmd, len);
+        return true;
+    }
+    bool meta(unsigned int tick, unsigned char type, const unsigned char *, unsigned int len) {
+        add(tick, 0xff00 | type, len);
+        return true;
+    }
+};
+
+// the decoder as it was: a byte reader, a lazily filled type table
+// and two switches per status byte
+static bool switch_decode(const unsigned char *p, const unsigned char *end, BENCH_SINK &sink) {
+    unsigned int tick = 0;
+    unsigned char last_cmd = 0;
+    while (p < end) {
+        unsigned char cmd;
+        int len, c;
+        int delta_ticks = 0;
+        for (int i = 0; ; ++i) {
+            if (i == 4 || p >= end) return false;
+            c = *p++;
+            delta_ticks = (delta_ticks << 7) | (c & 0x7f);
+            if (!(c & 0x80)) break;
+        }
+        tick += delta_ticks;
+        if (p >= end) return false;
+        c = *p++;
+        if (c & 0x80) {
+            cmd = c;
+            if (cmd < 0xf0)
+                last_cmd = cmd;
+        } else {
+            --p;
+            cmd = last_cmd;
+            if (!cmd) return false;
+        }
+        unsigned int x = cmd >> 4;
+        static unsigned char cmd_type[0x10];
+        switch (x) {
+        case 0x8: cmd_type[x] = SND_SEQ_EVENT_NOTEOFF; break;
+        case 0x9: cmd_type[x] = SND_SEQ_EVENT_NOTEON; break;
+        case 0xA: cmd_type[x] = SND_SEQ_EVENT_KEYPRESS; break;
+        case 0xB: cmd_type[x] = SND_SEQ_EVENT_CONTROLLER; break;
+        case 0xC: cmd_type[x] = SND_SEQ_EVENT_PGMCHANGE; break;
+        case 0xD: cmd_type[x] = SND_SEQ_EVENT_CHANPRESS; break;
+        case 0xE: cmd_type[x] = SND_SEQ_EVENT_PITCHBEND; break;
+        }
+        switch (x) {
+        case 0x8:
+        case 0x9:
+        case 0xa:
+        case 0xb:
+        case 0xe:
+            if (end - p < 2) return false;
+            sink.channel(tick, cmd_type[x], cmd & 0x0f, p[0] & 0x7f, p[1] & 0x7f);
+            p += 2;
+            break;
+        case 0xc:
+        case 0xd:
+            if (end - p < 1) return false;
+            sink.channel(tick, cmd_type[x], cmd & 0x0f, p[0] & 0x7f, 0);
+            p += 1;
+            break;
+        case 0xf:
+            if (cmd == 0xf0 || cmd == 0xf7 || cmd == 0xff) {
+                unsigned char type = 0;
+                if (cmd == 0xff) {
+                    if (p >= end) return false;
+                    type = *p++;
+                }
+                len = 0;
+                for (int i = 0; ; ++i) {
+                    if (i == 4 || p >= end) return false;
+                    c = *p++;
+                    len = (len << 7) | (c & 0x7f);
+                    if (!(c & 0x80)) break;
+                }
+                if (len > end - p) return false;
+                if (cmd == 0xff)
+                    sink.meta(tick, type, p, len);
+                else
+                    sink.sysex(tick, cmd, p, len);
+                p += len;
+                if (cmd == 0xff && type == 0x2f)
+                    return true;
+                break;
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+    return false;
+}   // end switch_decode
+
+static unsigned int be32(const unsigned char *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool find_tracks(const std::vector<unsigned char> &file,
+                        std::vector<std::pair<const unsigned char *, const unsigned char *> > &tracks) {
+    const unsigned char *p = &file[0];
+    const unsigned char *end = p + file.size();
+    if (file.size() > 20 && !memcmp(p, "RIFF", 4)) {
+        // RMID: find the "data" chunk and parse what is inside
+        p += 12;
+        while (end - p >= 8 && memcmp(p, "data", 4))
+            p += 8 + ((p[4] | (p[5] << 8) | (p[6] << 16) | (p[7] << 24)) + 1) / 2 * 2;
+        if (end - p < 8)
+            return false;
+        p += 8;
+    }
+    if (end - p < 14 || memcmp(p, "MThd", 4))
+        return false;
+    p += 8 + be32(p + 4);
+    while (end - p >= 8) {
+        unsigned int len = be32(p + 4);
+        const unsigned char *body = p + 8;
+        if (len > static_cast<unsigned int>(end - body))
+            len = end - body;
+        if (!memcmp(p, "MTrk", 4))
+            tracks.push_back(std::make_pair(body, body + len));
+        p = body + len;
+    }
+    return !tracks.empty();
+}   // end find_tracks
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int bench_parse(int count, char **files) {
+    int rc = 0;
+    for (int f = 0; f < count; ++f) {
+        FILE *fp = fopen(files[f], "rb");
+        if (!fp) {
+            fprintf(stderr, "%s: %s\n", files[f], strerror(errno));
+            rc = 1;
+            continue;
+        }
+        std::vector<unsigned char> data;
+        unsigned char buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            data.insert(data.end(), buf, buf + n);
+        fclose(fp);
+        std::vector<std::pair<const unsigned char *, const unsigned char *> > tracks;
+        std::vector<unsigned long long> mask;
+        if (data.empty() || !find_tracks(data, tracks)) {
+            fprintf(stderr, "%s: not a Standard MIDI File\n", files[f]);
+            rc = 1;
+            continue;
+        }
+        double secs[3];
+        BENCH_SINK result[3];
+        for (int which = 0; which < 3; ++which) {
+            // repeat for at least half a second to get stable numbers
+            int rounds = 0;
+            double start = now_seconds();
+            do {
+                BENCH_SINK sink;
+                for (size_t t = 0; t < tracks.size(); ++t) {
+                    const unsigned char *error_at;
+                    if (which == 0) {
+                        switch_decode(tracks[t].first, tracks[t].second, sink);
+                    } else if (which == 1) {
+                        decode_track(tracks[t].first, tracks[t].second, sink, &error_at);
+                    } else {
+                        // the mask is part of the cost
+                        size_t len = tracks[t].second - tracks[t].first;
+                        mask.resize(scan_mask_words(len));
+                        scan_high_bits(tracks[t].first, len, &mask[0]);
+                        decode_track_scan(tracks[t].first, tracks[t].second, &mask[0], sink, &error_at);
+                    }
+                }
+                result[which] = sink;
+                ++rounds;
+            } while (now_seconds() - start < 0.5);
+            secs[which] = (now_seconds() - start) / rounds;
+        }
+        bool same = result[0].events == result[1].events && result[0].sum == result[1].sum &&
+                    result[1].events == result[2].events && result[1].sum == result[2].sum;
+        printf("%s: %lu events, %zu bytes; switch %.1f Mev/s, table %.1f Mev/s (x%.2f), %s scan %.1f Mev/s (x%.2f)%s\n",
+               files[f], result[1].events, data.size(),
+               result[0].events / secs[0] / 1e6, result[1].events / secs[1] / 1e6, secs[0] / secs[1],
+               scan_isa_name(), result[2].events / secs[2] / 1e6, secs[0] / secs[2],
+               same ? "" : " MISMATCH");
+        if (!same)
+            rc = 1;
+    }
+    return rc;
+}   // end bench_parse
+
+struct RECORD_SINK {
+    std::vector<unsigned long long> events;
+
+    void add(unsigned int tick, unsigned int a, unsigned int b) {
+        events.push_back((static_cast<unsigned long long>(tick) << 32) ^ (a << 16) ^ b);
+    }
+    void channel(unsigned int tick, unsigned char type, unsigned char ch, unsigned char d1, unsigned char d2) {
+        add(tick, type << 8 | ch, d1 << 8 | d2);
+    }
+    bool sysex(unsigned int tick, unsigned char cmd, const unsigned char *data, unsigned int len) {
+        add(tick, cmd, len);
+        for (unsigned int i = 0; i < len; ++i)
+            add(0, 0, data[i]);
+        return true;
+    }
+    bool meta(unsigned int tick, unsigned char type, const unsigned char *, unsigned int len) {
+        add(tick, 0xff00 | type, len);
+        return true;
+    }
+};
+
+static unsigned int next_random(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void put_vlq(std::vector<unsigned char> &out, unsigned int v) {
+    unsigned char b[4];
+    int n = 0;
+    do {
+        b[n++] = v & 0x7f;
+        v >>= 7;
+    } while (v && n < 4);
+    while (n > 1)
+        out.push_back(b[--n] | 0x80);
+    out.push_back(b[0]);
+}
+
+static void make_track(std::vector<unsigned char> &out, unsigned int *seed, int events) {
+    // note-dense running status most of the time, with the odd long
+    // delta, status change, sysex, continuation packet and meta event
+    static const unsigned int deltas[] = { 0, 0, 1, 3, 60, 127, 128, 480, 20000, 3000000 };
+    unsigned char last = 0;
+    for (int i = 0; i < events; ++i) {
+        unsigned int r = next_random(seed);
+        put_vlq(out, deltas[r % 10]);
+        unsigned int kind = (r >> 4) % 100;
+        if (kind < 3) {
+            out.push_back(kind == 0 ? 0xf7 : 0xf0);
+            unsigned int len = next_random(seed) % 40;
+            put_vlq(out, len);
+            for (unsigned int j = 0; j < len; ++j)
+                out.push_back(next_random(seed) & 0x7f);
+        } else if (kind < 5) {
+            out.push_back(0xff);
+            out.push_back(next_random(seed) % 0x7f == 0x2f ? 0x01 : next_random(seed) % 0x7f);
+            unsigned int len = next_random(seed) % 10;
+            put_vlq(out, len);
+            for (unsigned int j = 0; j < len; ++j)
+                out.push_back(next_random(seed));
+        } else {
+            unsigned char cmd = last;
+            if (!last || kind < 20)
+                cmd = 0x80 | ((next_random(seed) % 7) << 4) | (next_random(seed) & 0x0f);
+            if (cmd != last || kind < 25)
+                out.push_back(cmd);
+            last = cmd;
+            out.push_back(next_random(seed) & 0x7f);
+            if (status_table[cmd].data_len == 2)
+                out.push_back(next_random(seed) & 0x7f);
+        }
+    }
+    out.push_back(0);
+    out.push_back(0xff);
+    out.push_back(0x2f);
+    out.push_back(0);
+}   // end make_track
+
+int verify_decoder(int tracks) {
+    unsigned int seed = 1;
+    int failures = 0, damaged = 0;
+    unsigned long events = 0;
+    for (int t = 0; t < tracks; ++t) {
+        std::vector<unsigned char> track;
+        make_track(track, &seed, 1 + next_random(&seed) % 2000);
+        if (t % 4 == 3) {
+            // damage: cut it short or overwrite a byte
+            ++damaged;
+            unsigned int at = next_random(&seed) % track.size();
+            if (t % 8 == 3)
+                track.resize(at + 1);
+            else
+                track[at] = next_random(&seed);
+        }
+        const unsigned char *begin = &track[0];
+        const unsigned char *end = begin + track.size();
+        std::vector<unsigned long long> masks[3];
+        for (int isa = SCAN_SCALAR; isa <= scan_best_isa(); ++isa) {
+            masks[isa].resize(scan_mask_words(track.size()));
+            scan_high_bits(begin, track.size(), &masks[isa][0], isa);
+            if (masks[isa] != masks[SCAN_SCALAR]) {
+                printf("track %d: %s mask differs from scalar\n", t, scan_isa_name(isa));
+                ++failures;
+            }
+        }
+        RECORD_SINK plain, scanned;
+        const unsigned char *error_plain = 0, *error_scan = 0;
+        const unsigned char *done_plain = decode_track(begin, end, plain, &error_plain);
+        const unsigned char *done_scan = decode_track_scan(begin, end, &masks[scan_best_isa()][0], scanned, &error_scan);
+        if (done_plain != done_scan || (!done_plain && error_plain != error_scan) || plain.events != scanned.events) {
+            printf("track %d: scan decoder differs (%zu vs %zu events)\n", t, plain.events.size(), scanned.events.size());
+            ++failures;
+        }
+        events += plain.events.size();
+    }
+    printf("%d tracks (%d damaged), %lu records, best scan %s: %s\n",
+           tracks, damaged, events, scan_isa_name(), failures ? "FAILED" : "identical");
+    return failures ? 1 : 0;
+}   // end verify_decoder
@@ -0,0 +1,9 @@
+#ifndef PARSE_BENCH_H
+#define PARSE_BENCH_H
+
+// --bench-parse: decoder throughput on real files, returns the exit code
+int bench_parse(int count, char **files);
+// --verify-decoder: scan decoder against the scalar one, returns the exit code
+int verify_decoder(int tracks);
+
+#endif // PARSE_BENCH_H
@@ -0,0 +1,98 @@
+// piano_roll.cpp -- part of MIDI_PLAYER
+// piano roll viewport and density overview drawn from the note index
+// contains:
+//      PIANO_ROLL()    -- constructor
+//      setSong()
+//      setPosition()
+//      paintEvent()
+//      mousePressEvent()   -- seek from the overview
+//      wheelEvent()        -- zoom
+
+#include "piano_roll.h"
+#include <QPainter>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <algorithm>
+
+static const int STRIP = 24;    // height of the overview
+
+PIANO_ROLL::PIANO_ROLL(QWidget *parent) :
+    QWidget(parent), song(0), position(0), span(0), peak(1)
+{
+    setMinimumSize(320, 160);
+}
+
+void PIANO_ROLL::setSong(const MIDI_FILE *s) {
+    song = s;
+    position = 0;
+    span = song ? static_cast<unsigned int>(song->PPQ * 16) : 0;  // four bars of 4/4
+    density.clear();
+    update();
+}
+
+void PIANO_ROLL::setPosition(unsigned int tick) {
+    if (tick == position)
+        return;
+    position = tick;
+    update();
+}
+
+void PIANO_ROLL::paintEvent(QPaintEvent *) {
+    QPainter p(this);
+    int w = width(), h = height();
+    p.fillRect(0, 0, w, h, QColor(24, 24, 24));
+    if (!song || !song->notes.count() || w <= 0)
+        return;
+    const NOTE_INDEX &notes = song->notes;
+    double length = song->lastTick() + 1;
+
+    // overview, rebuilt only when the width changes
+    if (static_cast<int>(density.size()) != w) {
+        notes.density(song->lastTick() + 1, w, density);
+        peak = std::max(1, *std::max_element(density.begin(), density.end()));
+    }
+    for (int x = 0; x < w; ++x) {
+        int bar = density[x] * (STRIP - 2) / peak;
+        if (bar)
+            p.fillRect(x, STRIP - bar, 1, bar, QColor(90, 140, 200));
+    }
+
+    // viewport: a quarter of it already played
+    long long t0 = static_cast<long long>(position) - span / 4;
+    long long t1 = t0 + span;
+    p.setPen(QColor(220, 220, 220));
+    p.drawRect(static_cast<int>(std::max(t0, 0LL) / length * w), 0,
+               std::max(1, static_cast<int>(span / length * w)), STRIP - 1);
+
+    int low = notes.lowKey(), high = notes.highKey();
+    double row = static_cast<double>(h - STRIP) / (high - low + 1);
+    double scale = static_cast<double>(w) / span;
+    visible.clear();
+    notes.overlapping(std::max(t0, 0LL), std::max(t1, 0LL), visible);
+    for (size_t i = 0; i < visible.size(); ++i) {
+        const NOTE_INDEX::note &n = notes.at(visible[i]);
+        int x0 = static_cast<int>(std::max(-1.0, (n.start - t0) * scale));
+        int x1 = static_cast<int>(std::min(w + 1.0, (n.end - t0) * scale));
+        int y = STRIP + static_cast<int>((high - n.key) * row);
+        p.fillRect(x0, y, std::max(1, x1 - x0), std::max(1, static_cast<int>(row)),
+                   QColor::fromHsv(n.channel * 22, 200, 100 + n.velocity));
+    }
+    int x = static_cast<int>((position - t0) * scale);
+    p.setPen(QColor(255, 64, 64));
+    p.drawLine(x, STRIP, x, h);
+}   // end paintEvent
+
+void PIANO_ROLL::mousePressEvent(QMouseEvent *event) {
+    if (!song || event->y() >= STRIP || width() <= 0)
+        return;
+    emit seekRequested(static_cast<int>(static_cast<double>(event->x()) / width() * song->lastTick()));
+}
+
+void PIANO_ROLL::wheelEvent(QWheelEvent *event) {
+    if (!song)
+        return;
+    double zoom = event->delta() > 0 ? 0.8 : 1.25;
+    span = std::max(static_cast<unsigned int>(song->PPQ),
+                    std::min(song->lastTick() + 1, static_cast<unsigned int>(span * zoom)));
+    update();
+}
@@ -0,0 +1,38 @@
+#ifndef PIANO_ROLL_H
+#define PIANO_ROLL_H
+
+#include <QWidget>
+#include <vector>
+#include "midi_file.h"
+
+// Piano roll around the play position, with a note density overview of
+// the whole song above it.  Only the notes in the viewport are fetched
+// from the note index, so a repaint costs the same for any song length.
+// A click in the overview asks for a seek, the wheel zooms.
+class PIANO_ROLL : public QWidget {
+    Q_OBJECT
+
+public:
+    PIANO_ROLL(QWidget *parent = 0);
+
+    void setSong(const MIDI_FILE *);
+    void setPosition(unsigned int tick);
+
+signals:
+    void seekRequested(int tick);
+
+protected:
+    void paintEvent(QPaintEvent *);
+    void mousePressEvent(QMouseEvent *);
+    void wheelEvent(QWheelEvent *);
+
+private:
+    const MIDI_FILE *song;
+    unsigned int position;
+    unsigned int span;          // ticks across the viewport
+    std::vector<int> density;   // one column per pixel of the overview
+    int peak;
+    std::vector<int> visible;   // query result, kept to avoid reallocating
+};
+
+#endif // PIANO_ROLL_H
@@ -1,14 +1,30 @@
 // player.cpp   -- part of MIDI_PLAYER
 // play memory image midi data to the alsa seq port
-// requires access to "seq","queue", "ports" static vars
+// requires access to "seq", the zone queue and its destination
 // contains:
 //      check_snd()
+//      player_error() -- check_snd() for the pool thread, to stderr
+//      output_event() -- INLINE, snd_seq_event_output() with statistics
+//      drain()       -- snd_seq_drain_output(), counted
+//      sample_pool()
+//      enter_realtime(), leave_realtime()
+//      runPlayer()   -- a job of the player pool
+//      sysex_ticks()
+//      chase_state() -- controller/program/tempo state at a tick
 //      play_midi()
 
 #include "midi_player.h"
 #include "ui_midi_player.h"
+#include "options.h"
+#include "realtime.h"
+#include "lookahead.h"
+#include "voice_limiter.h"
+#include "live_thru.h"
+#include "transform.h"
+#include "seq_session.h"
 #include <alsa/asoundlib.h>
 #include <vector>
+#include <algorithm>
 #include <QTimer>
 
 // INLINE function
@@ -18,101 +34,573 @@ void MIDI_PLAYER::check_snd(const char *operation, int err) {
         QMessageBox::critical(this, "MIDI Player", QString("Cannot %1\n%2") .arg(operation) .arg(snd_strerror(err)));
 }
 
+static void player_error(const char *operation, int err) {
+    // no message boxes off the GUI thread
+    if (err < 0)
+        fprintf(stderr, "midi_player: cannot %s: %s\n", operation, snd_strerror(err));
+}
+
+int MIDI_PLAYER::output_event(snd_seq_event_t *ev) {
+    // without --stats this is the bare call; the zone's output buffer is
+    // shared with its window and live thru, never with another zone
+    if (!stats) {
+        zone->lockOutput();
+        int err = snd_seq_event_output(seq, ev);
+        zone->unlockOutput();
+        return err;
+    }
+    long long t0 = stats_now();
+    zone->lockOutput();
+    int err = snd_seq_event_output(seq, ev);
+    zone->unlockOutput();
+    long long t = stats_now() - t0;
+    stats->output_block_ns += t;
+    if (t > stats->output_block_max_ns)
+        stats->output_block_max_ns = t;
+    if ((++stats->events_out & 63) == 0)
+        sample_pool();
+    return err;
+}
+
+int MIDI_PLAYER::drain() {
+    // from the window, the control socket and the player alike
+    zone->lockOutput();
+    int err = snd_seq_drain_output(seq);
+    zone->unlockOutput();
+    if (stats)
+        __atomic_add_fetch(&stats->drains, 1, __ATOMIC_RELAXED);
+    return err;
+}
+
+void MIDI_PLAYER::sample_pool() {
+    // client output pool in use, one ioctl
+    snd_seq_client_pool_t *pool;
+    snd_seq_client_pool_alloca(&pool);
+    if (snd_seq_get_client_pool(seq, pool) < 0)
+        return;
+    stats->pool_size = snd_seq_client_pool_get_output_pool(pool);
+    stats->pool_used = stats->pool_size - snd_seq_client_pool_get_output_free(pool);
+    if (stats->pool_used > stats->pool_used_max)
+        stats->pool_used_max = stats->pool_used;
+}
+
+void MIDI_PLAYER::enter_realtime() {
+    // runs on the pool thread before the hot loop starts: raise the
+    // scheduling class, then fault in and lock everything the loop touches
+    int err = rt_enter(rt_policy(options.rt_policy), options.rt_priority);
+    if (err < 0)
+        fprintf(stderr, "midi_player: cannot use real-time priority %d: %s\n", options.rt_priority, strerror(-err));
+    err = rt_lock(&song->events[0], song->events.size() * sizeof(event));
+    if (err >= 0 && !song->sysex_arena.empty())
+        err = rt_lock(&song->sysex_arena[0], song->sysex_arena.size());
+    if (err >= 0)
+        err = rt_prefault_stack(64 * 1024);
+    if (err < 0)
+        fprintf(stderr, "midi_player: cannot lock event memory: %s\n", strerror(-err));
+}   // end enter_realtime
+
+void MIDI_PLAYER::leave_realtime() {
+    // the thread goes back to the pool, the song may be replaced next
+    rt_leave();
+    rt_unlock(&song->events[0], song->events.size() * sizeof(event));
+    if (!song->sysex_arena.empty())
+        rt_unlock(&song->sysex_arena[0], song->sysex_arena.size());
+}
+
+void MIDI_PLAYER::runPlayer(unsigned int startTick) {
+    // song, zone and loop stay as they are until stopPlayer() has seen
+    // player_busy go false
+    bool rt = options.rt_priority > 0;
+    if (rt)
+        enter_realtime();
+    play_midi(startTick);
+    if (rt)
+        leave_realtime();
+    pthread_mutex_lock(&player_lock);
+    player_busy = false;
+    pthread_cond_broadcast(&player_idle);
+    pthread_mutex_unlock(&player_lock);
+}   // end runPlayer
+
+unsigned int MIDI_PLAYER::sysex_ticks(unsigned int bytes, int tempo) {
+    // queue ticks the wire needs for 'bytes' of sysex at the current tempo
+    if (options.sysex_rate <= 0)
+        return 0;
+    double seconds = static_cast<double>(bytes) / options.sysex_rate;
+    return static_cast<unsigned int>(seconds * 1000000 / tempo * song->PPQ + 0.999);
+}
+
+static bool tick_before(const MIDI_FILE::event &e, unsigned int tick) {
+    return e.tick < tick;
+}
+
+void MIDI_PLAYER::chase_state(unsigned int tick, std::vector<event> &out) {
+    // the last controller values, program, pressure and pitch bend of each
+    // channel, the tempo in effect and every sysex before 'tick', as events
+    // to replay.  They keep their original order, so a reset controller
+    // still wins and a patch dump still comes after the mode it needs.
+    int cc[16][128], program[16], pressure[16], bend[16];
+    int tempo = -1;
+    std::vector<int> keep;
+    memset(cc, -1, sizeof(cc));
+    memset(program, -1, sizeof(program));
+    memset(pressure, -1, sizeof(pressure));
+    memset(bend, -1, sizeof(bend));
+    std::vector<event>::iterator end = std::lower_bound(song->events.begin(), song->events.end(), tick, tick_before);
+    for (std::vector<event>::iterator Event=song->events.begin(); Event!=end; ++Event) {
+        int i = Event - song->events.begin();
+        int ch = Event->data.d[0] & 0x0f;
+        switch (Event->type) {
+        case SND_SEQ_EVENT_CONTROLLER:
+            cc[ch][Event->data.d[1] & 0x7f] = i;
+            break;
+        case SND_SEQ_EVENT_PGMCHANGE:
+            program[ch] = i;
+            break;
+        case SND_SEQ_EVENT_CHANPRESS:
+            pressure[ch] = i;
+            break;
+        case SND_SEQ_EVENT_PITCHBEND:
+            bend[ch] = i;
+            break;
+        case SND_SEQ_EVENT_TEMPO:
+            tempo = i;
+            break;
+        case SND_SEQ_EVENT_SYSEX:
+            keep.push_back(i);
+            break;
+        }
+    }
+    for (int ch = 0; ch < 16; ++ch) {
+        for (int c = 0; c < 128; ++c)
+            if (cc[ch][c] >= 0) keep.push_back(cc[ch][c]);
+        if (program[ch] >= 0) keep.push_back(program[ch]);
+        if (pressure[ch] >= 0) keep.push_back(pressure[ch]);
+        if (bend[ch] >= 0) keep.push_back(bend[ch]);
+    }
+    if (tempo >= 0)
+        keep.push_back(tempo);
+    std::sort(keep.begin(), keep.end());
+    out.clear();
+    for (size_t i = 0; i < keep.size(); ++i)
+        out.push_back(song->events[keep[i]]);
+}   // end chase_state
+
 void MIDI_PLAYER::play_midi(unsigned int startTick) {
+    // startTick is a queue position; with an A/B loop the queue runs on
+    // past the end of the loop and each pass maps to the song again
     int end_delay = 2;
     int err;
+    // in real-time mode the loop must not allocate or log, so errors are
+    // not reported until the song is out.  The only lock it takes is the
+    // zone's output lock, held for single writes and drains; only this
+    // zone's window and live thru ever wait for it
+    bool rt = options.rt_priority > 0;
+    int failed = 0;
+    // sysex pacing: successive messages wait for the wire, and channel
+    // and tempo events never land inside a message that was split into
+    // chunks; tempo is held too, so it cannot overtake the notes before it
+    int tempo = song->init_tempo;
+    unsigned int wire_free = 0;
+    unsigned int hold_until = 0;
+    const unsigned int chunk = options.sysex_chunk > 0 ? options.sysex_chunk : 0xffffffff;
+    // A/B loop: song ticks [loop_a, loop_b) repeat until the player is
+    // stopped.  The queue never stops or rewinds, each pass is scheduled
+    // loop_len ticks after the previous one; 'offset' maps song ticks to
+    // queue ticks
+    bool looping = loop_b > loop_a;
+    unsigned int loop_len = loop_b - loop_a;
+    unsigned int offset = 0;
+    if (looping && startTick >= loop_b)
+        offset = ((startTick - loop_b) / loop_len + 1) * loop_len;
+    unsigned int songTick = startTick - offset;
+    // controllers, programs and tempo as they are where we start and at
+    // the loop point; built before the loop, which must not allocate
+    std::vector<event> chase, loop_chase;
+    chase_state(songTick, chase);
+    if (looping)
+        chase_state(loop_a, loop_chase);
+    std::vector<event>::iterator loop_start = std::lower_bound(song->events.begin(), song->events.end(), loop_a, tick_before);
+    if (looping && (loop_start == song->events.end() || loop_start->tick >= loop_b))
+        looping = false;    // nothing to repeat, it would only spin
+    // notes still sounding at the end of a pass get their note-off there;
+    // by output channel and key
+    unsigned char sounding[16][128];
+    memset(sounding, 0, sizeof(sounding));
+    // tempo, transpose and mute/solo from the window.  A note keeps the
+    // key it started on until its note-off: by channel and key in the
+    // file, held[][] counts the note-ons still open, played[][] is the
+    // key they sound on
+    TRANSFORMER xf(transforms);
+    unsigned char held[16][128], played[16][128];
+    memset(held, 0, sizeof(held));
+    // tempo changes queued ahead of the queue position, to scale again
+    // when the tempo transform changes; song_tempo is the one before them
+    enum { TEMPO_AHEAD = 64 };
+    struct { unsigned int tick; int tempo; } ahead[TEMPO_AHEAD];
+    int n_ahead = 0;
+    int song_tempo = tempo;
+    snd_seq_queue_status_t *qpos;
+    snd_seq_queue_status_alloca(&qpos);
+    // the ones the queue has passed are in effect, not ahead
+    auto tempo_passed = [&]() {
+        snd_seq_get_queue_status(seq, queue, qpos);
+        unsigned int now = snd_seq_queue_status_get_tick_time(qpos);
+        int n = 0;
+        for (int i = 0; i < n_ahead; ++i) {
+            if (ahead[i].tick <= now)
+                song_tempo = ahead[i].tempo;
+            else
+                ahead[n++] = ahead[i];
+        }
+        n_ahead = n;
+        return now;
+    };
+    // started by a control command: time until the first note is queued
+    long long command_at = stats ? stats->control_cmd_at : 0;
+    // keeps what is scheduled a few hundred ms ahead of the queue
+    LOOKAHEAD feeder(zone, song->PPQ, xf.tempo(tempo), stats, &player_stop);
+    // --voices: notes over the limit steal a voice or are dropped
+    VOICE_LIMITER voices(stats);
     // set data in (snd_seq_event_t ev) and output the event
     // common settings for all events
     snd_seq_event_t ev;
     snd_seq_ev_clear(&ev);
     ev.queue = queue;
-    ev.source.port = 0;
+    ev.source.port = zone->port();
     ev.flags = SND_SEQ_TIME_STAMP_TICK;
-    // parse each event, already in sort order by 'tick' from parse_file
-    for (std::vector<event>::iterator Event=all_events.begin(); Event!=all_events.end(); ++Event)  {
-        // skip over everything except TEMPO, CONTROLLER, PROGRAM, ChannelPressure and SysEx changes until startTick is reached.
-        if (Event->tick<startTick &&
-            (Event->type!=SND_SEQ_EVENT_TEMPO ||
-             Event->type!=SND_SEQ_EVENT_CONTROLLER ||
-             Event->type!=SND_SEQ_EVENT_PGMCHANGE ||
-             Event->type!=SND_SEQ_EVENT_CHANPRESS ||
-             Event->type!=SND_SEQ_EVENT_SYSEX))
-	{
-            continue;
-	}
-        ev.time.tick = Event->tick;
-        ev.type = Event->type;
-//        ev.dest = ports[Event->port];
-        ev.dest = ports[0];
+
+    // one song event at queue tick 'at'
+    auto schedule = [&](const event &Event, unsigned int at) {
+        ev.time.tick = at;
+        ev.tag = 0;
+        if (at < hold_until && Event.type != SND_SEQ_EVENT_SYSEX)
+            ev.time.tick = hold_until;
+        ev.type = Event.type;
+//        ev.dest = ports[Event.port];
+        ev.dest = *zone->dest();
         switch (ev.type) {
         case SND_SEQ_EVENT_NOTEON:
         case SND_SEQ_EVENT_NOTEOFF:
-        case SND_SEQ_EVENT_KEYPRESS:
+        case SND_SEQ_EVENT_KEYPRESS: {
+            int ch = Event.data.d[0] & 0x0f, key = Event.data.d[1] & 0x7f;
+            if (ev.type == SND_SEQ_EVENT_NOTEON && Event.data.d[2]) {
+                if (!held[ch][key]) {
+                    // muted, or transposed off the keyboard: never sounds
+                    int out = xf.audible(ch) ? xf.key(ch, key) : -1;
+                    if (out < 0)
+                        return;
+                    played[ch][key] = out;
+                }
+                if (held[ch][key] < 255)
+                    ++held[ch][key];
+                key = played[ch][key];
+            } else {
+                // follows its note-on, which may have been muted or cut
+                if (!held[ch][key])
+                    return;
+                if (ev.type != SND_SEQ_EVENT_KEYPRESS)
+                    --held[ch][key];
+                key = played[ch][key];
+            }
             snd_seq_ev_set_fixed(&ev);
-            ev.data.note.channel = Event->data.d[0];
-            ev.data.note.note = Event->data.d[1];
-            ev.data.note.velocity = Event->data.d[2];
+            ev.data.note.channel = ch;
+            ev.data.note.note = key;
+            ev.data.note.velocity = Event.data.d[2];
+            if (ev.type == SND_SEQ_EVENT_NOTEON && Event.data.d[2]) {
+                int victim_ch, victim_key;
+                switch (voices.noteOn(ch, key, Event.data.d[2], &victim_ch, &victim_key)) {
+                case VOICE_LIMITER::SKIP:
+                    return;
+                case VOICE_LIMITER::STEAL: {
+                    // the victim goes quiet at the same tick, just before
+                    snd_seq_event_t off = ev;
+                    off.type = SND_SEQ_EVENT_NOTEOFF;
+                    off.data.note.channel = victim_ch;
+                    off.data.note.note = victim_key;
+                    off.data.note.velocity = 0;
+                    feeder.feed(off.time.tick);
+                    err = output_event(&off);
+                    if (err < 0) {
+                        if (rt)
+                            ++failed;
+                        else
+                            player_error("output event", err);
+                    }
+                    sounding[victim_ch][victim_key] = 0;
+                    break;
+                }
+                case VOICE_LIMITER::PLAY:
+                    break;
+                }
+                sounding[ch][key] = 1;
+                if (thru_notes) {
+                    __atomic_store_n(&thru_notes->file_off[ch][key], THRU_NOTES::NEVER, __ATOMIC_SEQ_CST);
+                    __atomic_store_n(&thru_notes->file_on[ch][key], ev.time.tick, __ATOMIC_SEQ_CST);
+                }
+            }
+            else if (ev.type != SND_SEQ_EVENT_KEYPRESS) {
+                // the note-off of a stolen or dropped note is not sent
+                if (!voices.noteOff(ch, key))
+                    return;
+                sounding[ch][key] = 0;
+                if (thru_notes) {
+                    // a key the live input holds keeps sounding, its release
+                    // sends this note-off.  Otherwise the note-off is tagged
+                    // so the thru can take it back if a live note starts
+                    __atomic_store_n(&thru_notes->file_off[ch][key], ev.time.tick, __ATOMIC_SEQ_CST);
+                    __atomic_store_n(&thru_notes->owed[ch][key], 1, __ATOMIC_SEQ_CST);
+                    if (__atomic_load_n(&thru_notes->live[ch][key], __ATOMIC_SEQ_CST))
+                        return;
+                    __atomic_store_n(&thru_notes->owed[ch][key], 0, __ATOMIC_SEQ_CST);
+                    ev.type = SND_SEQ_EVENT_NOTEOFF;
+                    ev.tag = NOTE_OFF_TAG | key;
+                }
+            }
             break;
+        }
         case SND_SEQ_EVENT_CONTROLLER:
             snd_seq_ev_set_fixed(&ev);
-            ev.data.control.channel = Event->data.d[0];
-            ev.data.control.param = Event->data.d[1];
-            ev.data.control.value = Event->data.d[2];
+            ev.data.control.channel = Event.data.d[0];
+            ev.data.control.param = Event.data.d[1];
+            ev.data.control.value = Event.data.d[2];
             break;
         case SND_SEQ_EVENT_PGMCHANGE:
         case SND_SEQ_EVENT_CHANPRESS:
             snd_seq_ev_set_fixed(&ev);
-            ev.data.control.channel = Event->data.d[0];
-            ev.data.control.value = Event->data.d[1];
+            ev.data.control.channel = Event.data.d[0];
+            ev.data.control.value = Event.data.d[1];
             break;
         case SND_SEQ_EVENT_PITCHBEND:
             snd_seq_ev_set_fixed(&ev);
-            ev.data.control.channel = Event->data.d[0];
+            ev.data.control.channel = Event.data.d[0];
             ev.data.control.value =
-                ((Event->data.d[1]) |
-                 ((Event->data.d[2]) << 7)) - 0x2000;
-            break;
-        case SND_SEQ_EVENT_SYSEX:
-            snd_seq_ev_set_variable(&ev, Event->data.length, &Event->sysex);
+                ((Event.data.d[1]) |
+                 ((Event.data.d[2]) << 7)) - 0x2000;
             break;
+        case SND_SEQ_EVENT_SYSEX: {
+            // the payload is sent straight from the arena, in chunks the
+            // device buffer can take, each one timed after the previous
+            unsigned int start = std::max(at, wire_free);
+            unsigned int length = Event.data.sysex.length;
+            unsigned char *payload = &song->sysex_arena[Event.data.sysex.offset];
+            for (unsigned int sent = 0; sent < length; sent += chunk) {
+                ev.time.tick = start + sysex_ticks(sent, xf.tempo(tempo));
+                snd_seq_ev_set_variable(&ev, std::min(chunk, length - sent), payload + sent);
+                feeder.feed(ev.time.tick);
+                err = output_event(&ev);
+                if (err < 0) {
+                    if (rt)
+                        ++failed;
+                    else
+                        player_error("output event", err);
+                }
+            }
+            if (length > chunk)
+                hold_until = ev.time.tick;
+            wire_free = start + sysex_ticks(length, xf.tempo(tempo));
+            return;
+        }
         case SND_SEQ_EVENT_TEMPO:
             snd_seq_ev_set_fixed(&ev);
             ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
             ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
             ev.data.queue.queue = queue;
-            ev.data.queue.param.value = Event->data.tempo;
+            ev.data.queue.param.value = xf.tempo(Event.data.tempo);
+            tempo = Event.data.tempo;
+            feeder.setTempo(xf.tempo(tempo));
+            if (n_ahead == TEMPO_AHEAD)
+                tempo_passed();
+            // more than fit are left as they are, a later tempo change
+            // in the song puts them right
+            if (n_ahead < TEMPO_AHEAD) {
+                ev.tag = TEMPO_TAG;
+                ahead[n_ahead].tick = ev.time.tick;
+                ahead[n_ahead++].tempo = tempo;
+            }
             break;
         default:
-            QMessageBox::critical(this, "MIDI Player", QString("Invalid event type %1") .arg(ev.type));
+            if (!rt)
+                fprintf(stderr, "midi_player: invalid event type %d\n", ev.type);
         }   // end SWITCH ev.type
-        // do the actual output of the event to the MIDI queue
-        // this blocks when the output pool has been filled
-        err = snd_seq_event_output(seq, &ev);
-        check_snd("output event", err);
-    }	// end for all_events iterator
+        // do the actual output of the event to the MIDI queue; the feeder
+        // waits first if it is too far ahead, so the pool rarely fills up
+        feeder.feed(ev.time.tick);
+        err = output_event(&ev);
+        if (err < 0) {
+            if (rt)
+                ++failed;
+            else
+                player_error("output event", err);
+        }
+        if (command_at && ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity) {
+            // into the queue now rather than with the next batch
+            drain();
+            long long t = stats_now() - command_at;
+            ++stats->control_first_notes;
+            stats->control_first_note_ns += t;
+            stats->control_first_note_max_ns = std::max(stats->control_first_note_max_ns, t);
+            command_at = 0;
+        }
+    };  // end schedule
+
+    // the window changed the transforms: cut the notes that no longer
+    // sound as they started, scale the queue tempo and what is queued
+    auto transform = [&]() {
+        int what = xf.update();
+        if (what & TRANSFORMER::NOTES) {
+            // after everything already queued, which may still start notes
+            unsigned int cut = feeder.lastFed();
+            event off;
+            off.type = SND_SEQ_EVENT_NOTEOFF;
+            off.data.d[2] = 0;
+            for (int ch = 0; ch < 16; ++ch) {
+                for (int key = 0; key < 128; ++key) {
+                    if (!held[ch][key] || (xf.audible(ch) && xf.key(ch, key) == played[ch][key]))
+                        continue;
+                    // one for each note-on, as the file would have sent
+                    off.data.d[0] = ch;
+                    off.data.d[1] = key;
+                    while (held[ch][key])
+                        schedule(off, cut);
+                }
+            }
+        }
+        if (what & TRANSFORMER::TEMPO) {
+            // queued events are stamped in ticks, so the new queue tempo
+            // moves them all; the tempo changes among them are replaced.
+            // Only what the kernel holds can be taken back, and no other
+            // thread may drain in between
+            zone->lockOutput();
+            drain();
+            unsigned int now = tempo_passed();
+            zone->withdrawTempo();
+            snd_seq_event_t t = ev;
+            snd_seq_ev_set_fixed(&t);
+            t.type = SND_SEQ_EVENT_TEMPO;
+            t.dest.client = SND_SEQ_CLIENT_SYSTEM;
+            t.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+            t.data.queue.queue = queue;
+            t.time.tick = now;  // in the past by now, so at once
+            t.tag = 0;
+            t.data.queue.param.value = xf.tempo(song_tempo);
+            err = output_event(&t);
+            t.tag = TEMPO_TAG;
+            for (int i = 0; err >= 0 && i < n_ahead; ++i) {
+                t.time.tick = ahead[i].tick;
+                t.data.queue.param.value = xf.tempo(ahead[i].tempo);
+                err = output_event(&t);
+            }
+            if (err >= 0)
+                err = drain();
+            zone->unlockOutput();
+            if (err < 0) {
+                if (rt)
+                    ++failed;
+                else
+                    player_error("output event", err);
+            }
+            feeder.setTempo(xf.tempo(tempo));
+        }
+    };  // end transform
+
+    // the queue runs at the song's first tempo, scaled; resuming, it is
+    // still at whatever the last player left it
+    event first_tempo;
+    first_tempo.type = SND_SEQ_EVENT_TEMPO;
+    first_tempo.data.tempo = song->init_tempo;
+    schedule(first_tempo, startTick);
+    for (std::vector<event>::iterator Event=chase.begin(); Event!=chase.end(); ++Event)
+        schedule(*Event, startTick);
+    // parse each event, already in sort order by 'tick' from parse_file
+    std::vector<event>::iterator Event = std::lower_bound(song->events.begin(), song->events.end(), songTick, tick_before);
+    for (;;) {
+        if (stopping())
+            break;
+        if (looping && (Event == song->events.end() || Event->tick >= loop_b)) {
+            // end of a pass: silence what still sounds, restore the state
+            // of the loop point and go on with the next pass at the same tick
+            unsigned int wrap = loop_b + offset;
+            voices.newPass();   // the note-offs still owed are past loop_b
+            event off;
+            off.type = SND_SEQ_EVENT_NOTEOFF;
+            off.data.d[2] = 0;
+            for (int ch = 0; ch < 16; ++ch) {
+                for (int note = 0; note < 128; ++note) {
+                    if (!held[ch][note])
+                        continue;
+                    if (sounding[ch][played[ch][note]]) {
+                        off.data.d[0] = ch;
+                        off.data.d[1] = note;
+                        schedule(off, wrap);
+                    }
+                    held[ch][note] = 0;     // the rest never come
+                }
+            }
+            offset += loop_len;
+            for (std::vector<event>::iterator c=loop_chase.begin(); c!=loop_chase.end(); ++c)
+                schedule(*c, wrap);
+            feeder.feed(wrap);  // an empty loop still waits for the queue
+            Event = loop_start;
+            continue;
+        }
+        if (Event == song->events.end())
+            break;
+        // transforms are applied before the next event, and as soon as
+        // they change while the feeder waits for the queue
+        unsigned int at = Event->tick + offset;
+        while (!stopping() && (xf.changed() || !feeder.reach(at, xf.serial(), xf.seen())))
+            transform();
+        if (stopping())
+            break;
+        schedule(*Event, at);
+        ++Event;
+    }	// end for all events
+    if (failed)
+        fprintf(stderr, "midi_player: %d events could not be queued\n", failed);
+    if (rt && feeder.sleeps())
+        fprintf(stderr, "midi_player: worst wakeup latency %.1f us over %llu waits\n",
+                feeder.worstWakeupNs() / 1e3, feeder.sleeps());
+    if (voices.active() && (voices.stolen() || voices.dropped()))
+        fprintf(stderr, "midi_player: %d voices, peak %d, %llu notes stolen, %llu dropped\n",
+                options.voices, voices.peak(), voices.stolen(), voices.dropped());
+    if (stopping())
+        return;     // stopPlayer() drops what is queued
 
     // schedule queue stop at end of song
     snd_seq_ev_set_fixed(&ev);
     ev.type = SND_SEQ_EVENT_STOP;
-    ev.time.tick = all_events.back().tick;
+    ev.time.tick = song->lastTick();
     ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
     ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
     ev.data.queue.queue = queue;
-    err = snd_seq_event_output(seq, &ev);
-    check_snd("output event", err);
+    err = output_event(&ev);
+    player_error("output event", err);
     // make sure that the sequencer sees all our events
-    err = snd_seq_drain_output(seq);
-    check_snd("drain output", err);
+    err = drain();
+    player_error("drain output", err);
+    if (stats)
+        sample_pool();
 
     // There are three possibilities for how to wait until all events have been played:
     // 1) send an event back to us (like pmidi does), and wait for it;
     // 2) wait for the EVENT_STOP notification for our queue which is sent
     //    by the system timer port (this would require a subscription);
     // 3) wait until the output pool is empty.
-    // The last is the simplest.
-    err = snd_seq_sync_output_queue(seq);
-    check_snd("sync output", err);
-    // give the last notes time to die away
-    if (end_delay > 0)
-        sleep(end_delay);
+    // We poll our own queue until the STOP event has stopped it, which
+    // needs neither input nor a subscription.
+    snd_seq_queue_status_t *qstatus;
+    snd_seq_queue_status_alloca(&qstatus);
+    long long t0 = stats ? stats_now() : 0;
+    do {
+        usleep(100000);
+        err = snd_seq_get_queue_status(seq, queue, qstatus);
+    } while (err >= 0 && (snd_seq_queue_status_get_status(qstatus) & 1) && !stopping());
+    player_error("get queue status", err);
+    if (stats)
+        stats->end_wait_ns += stats_now() - t0;
+    // give the last notes time to die away; the window stops the player
+    // about when the song ends, which must not wait for this
+    for (int i = 0; i < end_delay * 10 && !stopping(); ++i)
+        usleep(100000);
 }   // end play_midi
@@ -0,0 +1,103 @@
+// player_stats.cpp -- part of MIDI_PLAYER
+// hot path counters of one zone and the three ways to read them:
+// the statistics panel, the periodic log line and the JSON dump at exit.
+// contains:
+//      stats_create()  -- zeroed block the window and the player thread share
+//      stats_destroy()
+//      stats_text()    -- multi-line report for the panel
+//      stats_line()    -- one line for the periodic log
+//      stats_json()    -- one JSON object
+
+#include "player_stats.h"
+#include <stdlib.h>
+
+PLAYER_STATS *stats_create() {
+    // the player thread writes it lock-free, every counter starts at zero
+    return static_cast<PLAYER_STATS *>(calloc(1, sizeof(PLAYER_STATS)));
+}
+
+void stats_destroy(PLAYER_STATS *s) {
+    free(s);
+}
+
+static double ms(long long ns) {
+    return ns / 1e6;
+}
+
+static double avg_ms(long long ns, unsigned long long count) {
+    return count ? ns / 1e6 / count : 0;
+}
+
+QString stats_text(const PLAYER_STATS *s) {
+    if (!s)
+        return QString("Statistics are off, start with --stats");
+    QString text;
+    text += QString("Parse: %1 ms (map %2, tracks %3, sort %4, note index %5)\n")
+            .arg(ms(s->parse_ns), 0, 'f', 2) .arg(ms(s->parse_map_ns), 0, 'f', 2)
+            .arg(ms(s->parse_tracks_ns), 0, 'f', 2) .arg(ms(s->parse_sort_ns), 0, 'f', 2)
+            .arg(ms(s->parse_index_ns), 0, 'f', 2);
+    text += QString("  %1 tracks, slowest #%2 %3 ms\n")
+            .arg(s->tracks) .arg(s->parse_track_max + 1) .arg(ms(s->parse_track_max_ns), 0, 'f', 2);
+    text += QString("  %1 events from %2 bytes\n") .arg(s->events_parsed) .arg(s->bytes_parsed);
+    text += QString("Output: %1 events, %2 drains\n") .arg(s->events_out) .arg(s->drains);
+    text += QString("  blocked %1 ms, longest %2 ms\n")
+            .arg(ms(s->output_block_ns), 0, 'f', 2) .arg(ms(s->output_block_max_ns), 0, 'f', 2);
+    text += QString("  end of song wait %1 ms\n") .arg(ms(s->end_wait_ns), 0, 'f', 0);
+    text += QString("  pool %1 of %2 cells used, peak %3\n") .arg(s->pool_used) .arg(s->pool_size) .arg(s->pool_used_max);
+    text += QString("  lookahead %1 ms, target %2 ms, %3 waits, widened %4 times\n")
+            .arg(s->lookahead_ms, 0, 'f', 0) .arg(s->lookahead_target_ms, 0, 'f', 0)
+            .arg(s->lookahead_waits) .arg(s->lookahead_late);
+    text += QString("  wakeup late avg %1 us, worst %2 us\n")
+            .arg(s->lookahead_waits ? s->wakeup_late_ns / 1e3 / s->lookahead_waits : 0, 0, 'f', 1)
+            .arg(s->wakeup_late_max_ns / 1e3, 0, 'f', 1);
+    text += QString("  voices peak %1, %2 stolen, %3 dropped\n")
+            .arg(s->voices_peak) .arg(s->voices_stolen) .arg(s->voices_dropped);
+    text += QString("Seek: %1, avg %2 ms, worst %3 ms\n")
+            .arg(s->seeks) .arg(avg_ms(s->seek_ns, s->seeks), 0, 'f', 2) .arg(ms(s->seek_max_ns), 0, 'f', 2);
+    text += QString("Pause: %1, avg %2 ms, worst %3 ms\n")
+            .arg(s->pauses) .arg(avg_ms(s->pause_ns, s->pauses), 0, 'f', 2) .arg(ms(s->pause_max_ns), 0, 'f', 2);
+    text += QString("Port: moved %1 times\n") .arg(s->port_moves);
+    text += QString("Control: %1 commands, first note avg %2 ms, worst %3 ms over %4 starts")
+            .arg(s->control_commands) .arg(avg_ms(s->control_first_note_ns, s->control_first_notes), 0, 'f', 2)
+            .arg(ms(s->control_first_note_max_ns), 0, 'f', 2) .arg(s->control_first_notes);
+    return text;
+}   // end stats_text
+
+QString stats_line(const PLAYER_STATS *s) {
+    if (!s)
+        return QString("statistics are off");
+    return QString("out %1 ev, %2 drains, blocked %3 ms, pool %4/%5 (peak %6), lookahead %7/%8 ms, seek %9 ms, pause %10 ms, "
+                   "first note %11/%12 ms, wakeup %13 us")
+            .arg(s->events_out) .arg(s->drains) .arg(ms(s->output_block_ns), 0, 'f', 1)
+            .arg(s->pool_used) .arg(s->pool_size) .arg(s->pool_used_max)
+            .arg(s->lookahead_ms, 0, 'f', 0) .arg(s->lookahead_target_ms, 0, 'f', 0)
+            .arg(ms(s->seek_max_ns), 0, 'f', 1) .arg(ms(s->pause_max_ns), 0, 'f', 1)
+            .arg(avg_ms(s->control_first_note_ns, s->control_first_notes), 0, 'f', 1)
+            .arg(ms(s->control_first_note_max_ns), 0, 'f', 1)
+            .arg(s->wakeup_late_max_ns / 1e3, 0, 'f', 0);
+}
+
+void stats_json(FILE *f, const PLAYER_STATS *s) {
+    fprintf(f, "{\"parse_ns\": %lld, \"parse_map_ns\": %lld, \"parse_tracks_ns\": %lld, \"parse_sort_ns\": %lld, \"parse_index_ns\": %lld, "
+            "\"parse_track_max_ns\": %lld, \"parse_track_max\": %d, \"tracks\": %d, "
+            "\"events_parsed\": %llu, \"bytes_parsed\": %llu, ",
+            s->parse_ns, s->parse_map_ns, s->parse_tracks_ns, s->parse_sort_ns, s->parse_index_ns,
+            s->parse_track_max_ns, s->parse_track_max, s->tracks,
+            s->events_parsed, s->bytes_parsed);
+    fprintf(f, "\"events_out\": %llu, \"drains\": %llu, \"output_block_ns\": %lld, \"output_block_max_ns\": %lld, "
+            "\"end_wait_ns\": %lld, \"pool_size\": %d, \"pool_used\": %d, \"pool_used_max\": %d, "
+            "\"lookahead_ms\": %.1f, \"lookahead_target_ms\": %.1f, \"lookahead_waits\": %llu, \"lookahead_late\": %llu, "
+            "\"wakeup_late_ns\": %lld, \"wakeup_late_max_ns\": %lld, "
+            "\"voices_peak\": %d, \"voices_stolen\": %llu, \"voices_dropped\": %llu, ",
+            s->events_out, s->drains, s->output_block_ns, s->output_block_max_ns,
+            s->end_wait_ns, s->pool_size, s->pool_used, s->pool_used_max,
+            s->lookahead_ms, s->lookahead_target_ms, s->lookahead_waits, s->lookahead_late,
+            s->wakeup_late_ns, s->wakeup_late_max_ns,
+            s->voices_peak, s->voices_stolen, s->voices_dropped);
+    fprintf(f, "\"seeks\": %llu, \"seek_ns\": %lld, \"seek_max_ns\": %lld, "
+            "\"pauses\": %llu, \"pause_ns\": %lld, \"pause_max_ns\": %lld, \"port_moves\": %llu, ",
+            s->seeks, s->seek_ns, s->seek_max_ns, s->pauses, s->pause_ns, s->pause_max_ns, s->port_moves);
+    fprintf(f, "\"control_commands\": %llu, \"control_first_notes\": %llu, "
+            "\"control_first_note_ns\": %lld, \"control_first_note_max_ns\": %lld}",
+            s->control_commands, s->control_first_notes, s->control_first_note_ns, s->control_first_note_max_ns);
+}   // end stats_json
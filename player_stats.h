@@ -0,0 +1,73 @@
+#ifndef PLAYER_STATS_H
+#define PLAYER_STATS_H
+
+#include <stdio.h>
+#include <time.h>
+#include <QString>
+
+// Counters and timers of one zone.  The player thread updates the block
+// and the window reads it.
+// Every field has a single writer but drains, which every thread that
+// drains the zone's output counts atomically; readers may see a sample
+// that is one event old, which is fine for monitoring.
+// All times are nanoseconds of CLOCK_MONOTONIC.
+struct PLAYER_STATS {
+    // parsing, filled in by the window when a file has loaded
+    long long parse_ns;         // whole load()
+    long long parse_map_ns;     // open and mmap
+    long long parse_tracks_ns;  // decoding all MTrk chunks
+    long long parse_sort_ns;    // merging tracks by tick
+    long long parse_index_ns;   // building the note index
+    long long parse_track_max_ns;   // slowest single track
+    int parse_track_max;        // its index
+    int tracks;
+    unsigned long long events_parsed;
+    unsigned long long bytes_parsed;
+    // playback, written by the player thread
+    unsigned long long events_out;  // events handed to snd_seq_event_output
+    unsigned long long drains;      // snd_seq_drain_output calls, window and player
+    long long output_block_ns;      // time spent inside snd_seq_event_output
+    long long output_block_max_ns;  // longest single call
+    long long end_wait_ns;          // waiting for the queue to play out
+    int pool_size;                  // client output pool, in cells
+    int pool_used;                  // last sample
+    int pool_used_max;
+    double lookahead_ms;            // lead over the queue at the last check
+    double lookahead_target_ms;     // what the feeder aims for right now
+    unsigned long long lookahead_waits; // sleeps to let the queue catch up
+    unsigned long long lookahead_late;  // times the target was widened
+    long long wakeup_late_ns;       // those sleeps past their deadline, summed
+    long long wakeup_late_max_ns;   // the worst wakeup latency of the run
+    int voices_peak;                // most notes sounding under --voices
+    unsigned long long voices_stolen;   // cut short to make room
+    unsigned long long voices_dropped;  // never played
+    // transport, measured in the window
+    unsigned long long seeks;
+    long long seek_ns, seek_max_ns;
+    unsigned long long pauses;
+    long long pause_ns, pause_max_ns;
+    unsigned long long port_moves;  // hot-plug gave the port's name another address
+    // control socket: commands counted and stamped by whoever holds the
+    // transport lock, the first note timed by the player thread
+    unsigned long long control_commands;
+    long long control_cmd_at;       // arrival of the command that started the player, 0 if none
+    unsigned long long control_first_notes;
+    long long control_first_note_ns, control_first_note_max_ns;    // command to first note-on in the queue
+};
+
+// A zone only creates its block when statistics are on; with a null
+// pointer every hook is a single test.
+PLAYER_STATS *stats_create();
+void stats_destroy(PLAYER_STATS *);
+
+inline long long stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+QString stats_text(const PLAYER_STATS *);
+QString stats_line(const PLAYER_STATS *);
+void stats_json(FILE *, const PLAYER_STATS *);
+
+#endif // PLAYER_STATS_H
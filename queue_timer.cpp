@@ -0,0 +1,172 @@
+// queue_timer.cpp -- part of MIDI_PLAYER
+// choose the ALSA timer that drives the playback queue and measure it.
+// The default system timer follows the kernel tick and can be coarse;
+// hrtimer is preferred when the kernel provides it.
+// contains:
+//      findTimer()       -- look up an available timer by class/device
+//      readResolution()  -- open a timer just long enough to read its resolution
+//      SEQ_SESSION::selectTimer()    -- pick the source and attach it to every zone queue
+//      SEQ_SESSION::applyTimer()     -- attach the selected timer to one queue
+//      SEQ_SESSION::calibrateTimer() -- drift and jitter against CLOCK_MONOTONIC
+
+#include "seq_session.h"
+#include <time.h>
+#include <math.h>
+#include <QtDebug>
+
+static bool findTimer(int tclass, int device, SEQ_TIMER *found) {
+    // walk the timer list, device < 0 matches any device of the class
+    snd_timer_query_t *query;
+    snd_timer_id_t *id;
+    snd_timer_id_alloca(&id);
+    if (snd_timer_query_open(&query, "hw", 0) < 0)
+        return false;
+    bool ok = false;
+    snd_timer_id_set_class(id, SND_TIMER_CLASS_NONE);
+    while (snd_timer_query_next_device(query, id) >= 0) {
+        int c = snd_timer_id_get_class(id);
+        if (c < 0)
+            break;
+        if (c != tclass || (device >= 0 && snd_timer_id_get_device(id) != device))
+            continue;
+        found->tclass = c;
+        found->card = snd_timer_id_get_card(id);
+        found->device = snd_timer_id_get_device(id);
+        found->subdevice = snd_timer_id_get_subdevice(id) < 0 ? 0 : snd_timer_id_get_subdevice(id);
+        ok = true;
+        break;
+    }
+    snd_timer_query_close(query);
+    return ok;
+}   // end findTimer
+
+static long readResolution(const SEQ_TIMER &t) {
+    // nanoseconds per timer tick, 0 if the timer cannot be opened
+    char name[64];
+    snd_timer_t *handle;
+    snd_timer_info_t *info;
+    snd_timer_info_alloca(&info);
+    sprintf(name, "hw:CLASS=%i,SCLASS=%i,CARD=%i,DEV=%i,SUBDEV=%i",
+            t.tclass, SND_TIMER_SCLASS_NONE, t.card, t.device, t.subdevice);
+    if (snd_timer_open(&handle, name, SND_TIMER_OPEN_NONBLOCK) < 0)
+        return 0;
+    long res = 0;
+    if (snd_timer_info(handle, info) >= 0)
+        res = snd_timer_info_get_resolution(info);
+    snd_timer_close(handle);
+    return res;
+}
+
+int SEQ_SESSION::selectTimer(const char *source, int freq) {
+    // source is auto, hrtimer, system or pcm; auto prefers hrtimer
+    if (!seq)
+        return -EBADFD;
+    SEQ_TIMER t;
+    const char *name;
+    bool auto_pick = !strcmp(source, "auto");
+    if ((auto_pick || !strcmp(source, "hrtimer")) &&
+        findTimer(SND_TIMER_CLASS_GLOBAL, SND_TIMER_GLOBAL_HRTIMER, &t)) {
+        name = "hrtimer";
+    } else if (!strcmp(source, "pcm") && findTimer(SND_TIMER_CLASS_PCM, -1, &t)) {
+        name = "pcm";
+    } else if (auto_pick || !strcmp(source, "system")) {
+        t.tclass = SND_TIMER_CLASS_GLOBAL;
+        t.card = -1;
+        t.device = SND_TIMER_GLOBAL_SYSTEM;
+        t.subdevice = 0;
+        name = "system";
+    } else {
+        return -ENODEV;
+    }
+    timer = t;
+    timer_freq = freq;
+    for (size_t i = 0; i < zones.size(); ++i) {
+        int err = applyTimer(zones[i]);
+        if (err < 0)
+            return err;
+    }
+    timer_set = true;
+    strcpy(timer_name, name);
+    timer_res_ns = readResolution(t);
+    qDebug() << "Queue timer" << timer_name << "resolution" << timer_res_ns << "ns";
+    return 0;
+}   // end selectTimer
+
+int SEQ_SESSION::applyTimer(SEQ_ZONE *z) {
+    // the zone's client owns the queue, only it may change the timer
+    snd_seq_queue_timer_t *qtimer;
+    snd_timer_id_t *id;
+    snd_seq_queue_timer_alloca(&qtimer);
+    snd_timer_id_alloca(&id);
+    snd_timer_id_set_class(id, timer.tclass);
+    snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+    snd_timer_id_set_card(id, timer.card);
+    snd_timer_id_set_device(id, timer.device);
+    snd_timer_id_set_subdevice(id, timer.subdevice);
+    int err = snd_seq_get_queue_timer(z->seq, z->q, qtimer);
+    if (err < 0)
+        return err;
+    snd_seq_queue_timer_set_type(qtimer, SND_SEQ_TIMER_ALSA);
+    snd_seq_queue_timer_set_id(qtimer, id);
+    if (timer_freq > 0)
+        snd_seq_queue_timer_set_resolution(qtimer, timer_freq);
+    return snd_seq_set_queue_timer(z->seq, z->q, qtimer);
+}   // end applyTimer
+
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int SEQ_SESSION::calibrateTimer(double *drift_ppm, double *jitter_us) {
+    // run the stopped zone 0 queue for ~200ms and compare its real time with
+    // CLOCK_MONOTONIC; drift is the rate error, jitter the worst deviation
+    // of a single sample from the straight line between the end points
+    const int samples = 20;
+    const long step_ns = 10000000;
+    double q_time[samples + 1], m_time[samples + 1];
+    snd_seq_queue_status_t *qstatus;
+    snd_seq_queue_status_alloca(&qstatus);
+    if (!seq || zones.empty())
+        return -EBADFD;
+    SEQ_ZONE *z = zones[0];
+    int q = z->q;
+    z->lockOutput();
+    int err = snd_seq_start_queue(z->seq, q, NULL);
+    if (err >= 0)
+        snd_seq_drain_output(z->seq);
+    z->unlockOutput();
+    if (err < 0)
+        return err;
+    struct timespec pause = { 0, step_ns };
+    for (int i = 0; i <= samples; ++i) {
+        if (i)
+            nanosleep(&pause, NULL);
+        err = snd_seq_get_queue_status(z->seq, q, qstatus);
+        m_time[i] = monotonic_seconds();
+        if (err < 0)
+            break;
+        const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(qstatus);
+        q_time[i] = rt->tv_sec + rt->tv_nsec / 1e9;
+    }
+    z->lockOutput();
+    snd_seq_stop_queue(z->seq, q, NULL);
+    snd_seq_drain_output(z->seq);
+    z->unlockOutput();
+    if (err < 0)
+        return err;
+    double dq = q_time[samples] - q_time[0];
+    double dm = m_time[samples] - m_time[0];
+    if (dm <= 0)
+        return -EINVAL;
+    double rate = dq / dm;
+    *drift_ppm = (rate - 1.0) * 1e6;
+    double worst = 0;
+    for (int i = 1; i < samples; ++i) {
+        double expect = q_time[0] + (m_time[i] - m_time[0]) * rate;
+        worst = fmax(worst, fabs(q_time[i] - expect));
+    }
+    *jitter_us = worst * 1e6;
+    return 0;
+}   // end calibrateTimer
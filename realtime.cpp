@@ -0,0 +1,123 @@
+// realtime.cpp -- part of MIDI_PLAYER
+// opt-in real-time support for the player process: scheduling class,
+// locked and pre-faulted memory, and a wakeup latency self-test.
+// contains:
+//      rt_policy()  -- "fifo"/"rr" to SCHED_FIFO/SCHED_RR
+//      rt_enter()   -- switch the calling thread to a real-time policy
+//      rt_leave()   -- and back, before a pool thread is handed on
+//      rt_lock()    -- touch every page of a range, then mlock it
+//      rt_unlock()
+//      rt_prefault_stack() -- fault in and lock stack the hot loop will use
+//      rt_selftest() -- periodic sleeps on a real-time thread, worst wakeup late
+
+#include "realtime.h"
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+int rt_policy(const char *name) {
+    if (!strcmp(name, "fifo"))
+        return SCHED_FIFO;
+    if (!strcmp(name, "rr"))
+        return SCHED_RR;
+    return -EINVAL;
+}
+
+int rt_enter(int policy, int priority) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    int lo = sched_get_priority_min(policy);
+    int hi = sched_get_priority_max(policy);
+    param.sched_priority = priority < lo ? lo : priority > hi ? hi : priority;
+    return -pthread_setschedparam(pthread_self(), policy, &param);
+}
+
+int rt_leave() {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    return -pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+}
+
+int rt_lock(const void *addr, size_t len) {
+    // read only: the GUI thread may be writing next to the range
+    if (!addr || !len)
+        return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    volatile const char *p = (volatile const char *)((unsigned long)addr & ~(page - 1));
+    volatile const char *end = (volatile const char *)addr + len;
+    for (; p < end; p += page)
+        (void)*p;
+    if (mlock(addr, len) < 0)
+        return -errno;
+    return 0;
+}   // end rt_lock
+
+int rt_unlock(const void *addr, size_t len) {
+    if (!addr || !len)
+        return 0;
+    if (munlock(addr, len) < 0)
+        return -errno;
+    return 0;
+}
+
+int rt_prefault_stack(size_t len) {
+    char *buf = (char *)alloca(len);
+    memset(buf, 0, len);
+    return rt_lock(buf, len);
+}
+
+struct selftest_args {
+    double seconds;
+    RT_LATENCY *result;
+};
+
+static void *selftest_thread(void *p) {
+    // 1 ms period absolute sleeps, lateness is the wakeup latency
+    selftest_args *args = (selftest_args *)p;
+    const long period_ns = 1000000;
+    long loops = (long)(args->seconds * 1e9 / period_ns);
+    double sum = 0, worst = 0;
+    struct timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (long i = 0; i < loops; ++i) {
+        next.tv_nsec += period_ns;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            ++next.tv_sec;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double late = (now.tv_sec - next.tv_sec) * 1e6 + (now.tv_nsec - next.tv_nsec) / 1e3;
+        sum += late;
+        if (late > worst)
+            worst = late;
+    }
+    args->result->loops = loops;
+    args->result->avg_us = loops ? sum / loops : 0;
+    args->result->max_us = worst;
+    return 0;
+}   // end selftest_thread
+
+int rt_selftest(int policy, int priority, double seconds, RT_LATENCY *result) {
+    pthread_attr_t attr;
+    struct sched_param param;
+    pthread_t thread;
+    selftest_args args = { seconds, result };
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, policy);
+    pthread_attr_setschedparam(&attr, &param);
+    int err = pthread_create(&thread, &attr, selftest_thread, &args);
+    pthread_attr_destroy(&attr);
+    if (err)
+        return -err;
+    pthread_join(thread, NULL);
+    return 0;
+}   // end rt_selftest
@@ -0,0 +1,22 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+// real-time helpers for the playback threads, all return 0 or -errno
+// SCHED_FIFO for "fifo", SCHED_RR for "rr"
+int rt_policy(const char *name);
+int rt_enter(int policy, int priority);
+int rt_leave();
+int rt_lock(const void *addr, size_t len);
+int rt_unlock(const void *addr, size_t len);
+int rt_prefault_stack(size_t len);
+
+struct RT_LATENCY {
+    long loops;
+    double avg_us;
+    double max_us;
+};
+int rt_selftest(int policy, int priority, double seconds, RT_LATENCY *result);
+
+#endif // REALTIME_H
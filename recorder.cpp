@@ -0,0 +1,307 @@
+// recorder.cpp -- part of MIDI_PLAYER
+// MIDI input capture to a Standard MIDI File, see recorder.h
+// contains:
+//      MIDI_RECORDER() -- constructor
+//      sources()       -- readable ports for the source picker
+//      start()         -- client, stamping port and queue, both threads
+//      stop()          -- capture off, writer drains and closes the file
+//      capture()       -- capture thread: input, decode, push
+//      push()          -- producer side of the ring
+//      writer()        -- writer thread: drain, write, checkpoint
+//      writeRecord()   -- one ring entry to the SMF
+//      cleanup()
+
+#include "recorder.h"
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+static const int RECORD_PPQ = 480;
+static const int RECORD_TEMPO = 500000;     // 120 BPM, ticks map to time
+static const unsigned int RING_SIZE = 1 << 17;  // 4 MB, minutes of a fader bank
+static const long WRITER_PERIOD_NS = 10000000;
+static const long long CHECKPOINT_NS = 1000000000LL;
+
+static long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+MIDI_RECORDER::MIDI_RECORDER() :
+    seq(0), port(-1), queue(-1), decoder(0), mask(RING_SIZE - 1), head(0), tail(0),
+    capture_running(false), writer_running(false), captured(0), lost(0), last_tick(0),
+    sysex_open(false), sysex_broken(false), sysex_tick(0)
+{
+}
+
+MIDI_RECORDER::~MIDI_RECORDER() {
+    stop();
+}
+
+QStringList MIDI_RECORDER::sources(snd_seq_t *handle) {
+    QStringList names;
+    snd_seq_client_info_t *cinfo;
+    snd_seq_port_info_t *pinfo;
+    snd_seq_client_info_alloca(&cinfo);
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_client_info_set_client(cinfo, -1);
+    while (snd_seq_query_next_client(handle, cinfo) >= 0) {
+        int client = snd_seq_client_info_get_client(cinfo);
+        snd_seq_port_info_set_client(pinfo, client);
+        snd_seq_port_info_set_port(pinfo, -1);
+        while (snd_seq_query_next_port(handle, pinfo) >= 0) {
+            unsigned int caps = snd_seq_port_info_get_capability(pinfo);
+            if ((caps & (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ)) !=
+                (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ) || (caps & SND_SEQ_PORT_CAP_NO_EXPORT))
+                continue;
+            names << QString("%1:%2 %3") .arg(client) .arg(snd_seq_port_info_get_port(pinfo))
+                     .arg(snd_seq_port_info_get_name(pinfo));
+        }
+    }
+    return names;
+}   // end sources
+
+bool MIDI_RECORDER::start(const char *path, const char *source) {
+    if (capture_running)
+        return true;
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+    if (err < 0) {
+        seq = 0;
+        error = QString("Cannot open the sequencer\n%1") .arg(snd_strerror(err));
+        return false;
+    }
+    snd_seq_set_client_name(seq, "midi_player capture");
+    // room in the kernel for a burst while the capture thread is scheduled out
+    snd_seq_set_client_pool_input(seq, 1000);
+    queue = snd_seq_alloc_named_queue(seq, "capture");
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_port_info_set_name(pinfo, "capture");
+    snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping(pinfo, 1);
+    snd_seq_port_info_set_timestamp_real(pinfo, 0);
+    snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+    err = queue < 0 ? queue : snd_seq_create_port(seq, pinfo);
+    if (err < 0) {
+        error = QString("Cannot create the capture port\n%1") .arg(snd_strerror(err));
+        cleanup();
+        return false;
+    }
+    port = snd_seq_port_info_get_port(pinfo);
+    snd_seq_addr_t addr;
+    err = snd_seq_parse_address(seq, &addr, source);
+    if (err >= 0)
+        err = snd_seq_connect_from(seq, port, addr.client, addr.port);
+    if (err < 0) {
+        error = QString("Cannot record from %1\n%2") .arg(source) .arg(snd_strerror(err));
+        cleanup();
+        return false;
+    }
+    snd_seq_queue_tempo_t *tempo;
+    snd_seq_queue_tempo_alloca(&tempo);
+    snd_seq_queue_tempo_set_tempo(tempo, RECORD_TEMPO);
+    snd_seq_queue_tempo_set_ppq(tempo, RECORD_PPQ);
+    snd_seq_set_queue_tempo(seq, queue, tempo);
+    // status bytes on every message, the writer applies running status itself
+    snd_midi_event_new(32, &decoder);
+    snd_midi_event_no_status(decoder, 1);
+
+    err = smf.open(path, 0, RECORD_PPQ);
+    if (!err)
+        err = smf.beginTrack();
+    if (err) {
+        error = QString("Cannot write %1\n%2") .arg(path) .arg(strerror(-err));
+        cleanup();
+        return false;
+    }
+    static const unsigned char name[] = "midi_player capture";
+    static const unsigned char us[3] = { RECORD_TEMPO >> 16, (RECORD_TEMPO >> 8) & 0xff, RECORD_TEMPO & 0xff };
+    smf.meta(0, 0x03, name, sizeof(name) - 1);
+    smf.meta(0, 0x51, us, 3);
+    smf.checkpoint();
+
+    ring.resize(RING_SIZE);
+    head = tail = 0;
+    captured = lost = 0;
+    last_tick = 0;
+    sysex_open = sysex_broken = false;
+    sysex_buf.clear();
+    snd_seq_start_queue(seq, queue, NULL);
+    snd_seq_drain_output(seq);
+    capture_running = writer_running = true;
+    pthread_create(&capture_thread, NULL, capture_main, this);
+    pthread_create(&writer_thread, NULL, writer_main, this);
+    return true;
+}   // end start
+
+void MIDI_RECORDER::stop() {
+    if (!capture_running)
+        return;
+    // capture first, so the writer sees every event that made it in
+    __atomic_store_n(&capture_running, false, __ATOMIC_RELEASE);
+    pthread_join(capture_thread, NULL);
+    __atomic_store_n(&writer_running, false, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    smf.endTrack(last_tick);
+    smf.close();
+    cleanup();
+}   // end stop
+
+void MIDI_RECORDER::cleanup() {
+    if (decoder)
+        snd_midi_event_free(decoder);
+    decoder = 0;
+    if (seq)
+        snd_seq_close(seq);     // frees the queue and the port
+    seq = 0;
+    port = queue = -1;
+    if (smf.isOpen())
+        smf.close();
+}
+
+void *MIDI_RECORDER::capture_main(void *self) {
+    static_cast<MIDI_RECORDER *>(self)->capture();
+    return 0;
+}
+
+void *MIDI_RECORDER::writer_main(void *self) {
+    static_cast<MIDI_RECORDER *>(self)->writer();
+    return 0;
+}
+
+bool MIDI_RECORDER::push(unsigned int tick, int sysex, const unsigned char *data, int len) {
+    unsigned int t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (head - t > mask) {
+        ++lost;     // the writer is seconds behind; never wait for it
+        return false;
+    }
+    record &r = ring[head & mask];
+    r.tick = tick;
+    r.sysex = sysex;
+    r.len = len;
+    memcpy(r.data, data, len);
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void MIDI_RECORDER::capture() {
+    int npfd = snd_seq_poll_descriptors_count(seq, POLLIN);
+    struct pollfd pfd[4];
+    if (npfd > 4)
+        npfd = 4;
+    snd_seq_poll_descriptors(seq, pfd, npfd, POLLIN);
+    unsigned char bytes[sizeof(((record *)0)->data)];
+    while (__atomic_load_n(&capture_running, __ATOMIC_ACQUIRE)) {
+        snd_seq_event_t *ev;
+        int err = snd_seq_event_input(seq, &ev);
+        if (err == -EAGAIN) {
+            poll(pfd, npfd, 100);   // wakes up to notice stop()
+            continue;
+        }
+        if (err == -ENOSPC) {
+            ++lost;     // the kernel pool overran before we got here
+            continue;
+        }
+        if (err < 0)
+            continue;
+        switch (ev->type) {
+        case SND_SEQ_EVENT_SYSEX: {
+            // pieces of at most one record; the last one ends in F7.  Once
+            // a piece is lost the rest of its message is too: the writer
+            // must not join what is left into a sysex that was never sent
+            const unsigned char *p = static_cast<const unsigned char *>(ev->data.ext.ptr);
+            unsigned int len = ev->data.ext.len;
+            for (unsigned int at = 0; at < len; at += sizeof(bytes)) {
+                unsigned int n = std::min<unsigned int>(sizeof(bytes), len - at);
+                bool last = at + n == len && p[len - 1] == 0xf7;
+                if (at == 0 && p[0] == 0xf0)
+                    sysex_open = sysex_broken = false;  // a new message, whatever came before
+                if (sysex_broken) {
+                    ++lost;
+                } else if (push(ev->time.tick, PIECE | (last ? LAST : 0) | (sysex_open ? 0 : FIRST), p + at, n)) {
+                    ++captured;
+                    sysex_open = true;
+                } else {
+                    sysex_broken = true;    // counted by push()
+                }
+                if (last)
+                    sysex_open = sysex_broken = false;
+            }
+            break;
+        }
+        case SND_SEQ_EVENT_NOTEON:
+        case SND_SEQ_EVENT_NOTEOFF:
+        case SND_SEQ_EVENT_KEYPRESS:
+        case SND_SEQ_EVENT_CONTROLLER:
+        case SND_SEQ_EVENT_PGMCHANGE:
+        case SND_SEQ_EVENT_CHANPRESS:
+        case SND_SEQ_EVENT_PITCHBEND:
+        case SND_SEQ_EVENT_CONTROL14:
+        case SND_SEQ_EVENT_NONREGPARAM:
+        case SND_SEQ_EVENT_REGPARAM: {
+            // clock, active sensing and the like have no place in a file
+            long n = snd_midi_event_decode(decoder, bytes, sizeof(bytes), ev);
+            if (n > 0 && push(ev->time.tick, 0, bytes, n))
+                ++captured;
+            break;
+        }
+        }
+    }   // end WHILE (capture_running)
+}   // end capture
+
+void MIDI_RECORDER::writeRecord(const record &r) {
+    if (r.tick > last_tick)
+        last_tick = r.tick;
+    if (r.sysex) {
+        // FIRST: pieces still held belong to a message that lost its end
+        if (r.sysex & FIRST)
+            sysex_buf.clear();
+        if (sysex_buf.empty())
+            sysex_tick = r.tick;
+        sysex_buf.insert(sysex_buf.end(), r.data, r.data + r.len);
+        if (r.sysex & LAST) {
+            // F0 came with the first piece; anything else goes out escaped
+            if (sysex_buf[0] != 0xf0)
+                sysex_buf.insert(sysex_buf.begin(), 0xf7);
+            smf.sysex(sysex_tick, &sysex_buf[0], sysex_buf.size());
+            sysex_buf.clear();
+        }
+        return;
+    }
+    // the decoder may return several messages, each with its status byte
+    for (int i = 0; i < r.len; ) {
+        int status = r.data[i] & 0xf0;
+        int len = (status == 0xc0 || status == 0xd0) ? 2 : 3;
+        if (r.data[i] < 0x80 || i + len > r.len)
+            break;
+        smf.channel(r.tick, r.data + i, len);
+        i += len;
+    }
+}   // end writeRecord
+
+void MIDI_RECORDER::writer() {
+    struct timespec ts = { 0, WRITER_PERIOD_NS };
+    long long last_checkpoint = monotonic_ns();
+    for (;;) {
+        bool last_round = !__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+        unsigned int h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        for (unsigned int t = tail; t != h; ++t) {
+            writeRecord(ring[t & mask]);
+            __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        }
+        if (last_round)
+            break;
+        smf.flush();
+        // a slow disk stretches the period, so go by the clock
+        long long now = monotonic_ns();
+        if (now - last_checkpoint >= CHECKPOINT_NS) {
+            smf.checkpoint();
+            last_checkpoint = now;
+        }
+        nanosleep(&ts, NULL);
+    }   // end FOR (until stop)
+}   // end writer
@@ -0,0 +1,73 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <QString>
+#include <QStringList>
+#include <vector>
+#include "smf_writer.h"
+
+// Records a MIDI input port to a Standard MIDI File.  It has its own
+// sequencer client, so its reads never compete with the session's
+// announce handling.  The input port stamps events with ticks of its own
+// queue; the capture thread only decodes and pushes them into a
+// single-producer/single-consumer ring, never waiting on the disk.  The
+// writer thread drains the ring into an SMF_WRITER, which leaves a valid
+// file after each 10 ms flush, and syncs it to disk every second.
+// Implemented in recorder.cpp.
+class MIDI_RECORDER {
+public:
+    MIDI_RECORDER();
+    ~MIDI_RECORDER();
+
+    // readable ports as "client:port name", for the source picker
+    static QStringList sources(snd_seq_t *);
+
+    bool start(const char *path, const char *source);   // false with errorString() set
+    void stop();
+    bool isRecording() const { return capture_running; }
+    const QString &errorString() const { return error; }
+
+    unsigned long long events() const { return captured; }
+    unsigned long long overflows() const { return lost; }
+    long long bytes() const { return smf.bytes(); }
+
+private:
+    // one decoded event, or a piece of a sysex message
+    enum { PIECE = 1, LAST = 2, FIRST = 4 };
+    struct record {
+        unsigned int tick;
+        unsigned char sysex;    // PIECE, LAST and FIRST bits, 0 for channel events
+        unsigned char len;
+        unsigned char data[26]; // a 14-bit/NRPN controller decodes to up to 12 bytes
+    };
+
+    static void *capture_main(void *);
+    static void *writer_main(void *);
+    void capture();
+    void writer();
+    bool push(unsigned int tick, int sysex, const unsigned char *data, int len);
+    void writeRecord(const record &);
+    void cleanup();
+
+    snd_seq_t *seq;
+    int port, queue;
+    snd_midi_event_t *decoder;
+    SMF_WRITER smf;
+    std::vector<record> ring;
+    unsigned int mask;
+    unsigned int head;      // written by the capture thread only
+    unsigned int tail;      // written by the writer thread only
+    bool capture_running, writer_running;
+    pthread_t capture_thread, writer_thread;
+    unsigned long long captured, lost;
+    unsigned int last_tick;
+    bool sysex_open;        // capture side: a message has pieces in the ring
+    bool sysex_broken;      // capture side: one of its pieces was lost
+    std::vector<unsigned char> sysex_buf;   // writer side, one message
+    unsigned int sysex_tick;
+    QString error;
+};
+
+#endif // RECORDER_H
@@ -0,0 +1,554 @@
+// render.cpp -- part of MIDI_PLAYER
+// offline render of a song to a WAV file, see render.h
+// contains:
+//      PATCH, patches[], drum_patch() -- the sounds
+//      TIMELINE        -- one controller of one channel over the song
+//      make_voices()   -- every note as a voice in samples
+//      envelope()      -- ADSR level of a voice at a sample
+//      mix_scalar(), mix_sse2(), mix_avx2() -- one voice into a block
+//      render_block()  -- all voices of one time block
+//      write_wav()
+//      render_file()   -- "--render FILE OUT.wav [RATE]"
+
+#include "render.h"
+#include "midi_file.h"
+#include "midi_decoder.h"
+#include "tempo_map.h"
+#include "player_stats.h"
+#include <alsa/asoundlib.h>
+#include <QtConcurrentMap>
+#include <QThread>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+
+static const int BLOCK_SAMPLES = 32768;     // samples a worker renders at once
+static const int SUB = 32;          // envelope steps linearly within this
+static const float MASTER = 0.25f;
+static const float CEILING = 0.89f; // -1 dBFS, louder mixes are scaled down
+
+enum WAVE { SINE, TRIANGLE, SAW, SQUARE, ORGAN, NOISE };
+
+struct PATCH {
+    int wave;
+    float attack, decay, sustain, release;  // seconds, sustain is a level
+    float gain;
+};
+
+// one per family of eight General MIDI programs
+static const PATCH patches[16] = {
+    { TRIANGLE, 0.005f, 2.0f,  0.1f,  0.25f, 1.0f },    // piano
+    { SINE,     0.002f, 0.8f,  0.0f,  0.3f,  1.0f },    // chromatic percussion
+    { ORGAN,    0.01f,  0.1f,  0.9f,  0.08f, 0.8f },    // organ
+    { TRIANGLE, 0.003f, 1.0f,  0.05f, 0.2f,  1.0f },    // guitar
+    { TRIANGLE, 0.005f, 0.6f,  0.4f,  0.1f,  1.2f },    // bass
+    { SAW,      0.08f,  0.2f,  0.8f,  0.3f,  0.5f },    // strings
+    { SAW,      0.1f,   0.2f,  0.8f,  0.4f,  0.5f },    // ensemble
+    { SAW,      0.03f,  0.2f,  0.7f,  0.15f, 0.5f },    // brass
+    { SQUARE,   0.03f,  0.1f,  0.8f,  0.1f,  0.4f },    // reed
+    { SINE,     0.05f,  0.1f,  0.9f,  0.15f, 1.0f },    // pipe
+    { SQUARE,   0.01f,  0.1f,  0.8f,  0.1f,  0.4f },    // synth lead
+    { SAW,      0.3f,   0.5f,  0.7f,  0.8f,  0.5f },    // synth pad
+    { TRIANGLE, 0.2f,   0.5f,  0.6f,  0.6f,  0.8f },    // synth effects
+    { TRIANGLE, 0.005f, 0.6f,  0.1f,  0.2f,  1.0f },    // ethnic
+    { SINE,     0.001f, 0.4f,  0.0f,  0.1f,  1.0f },    // percussive
+    { NOISE,    0.05f,  0.3f,  0.5f,  0.3f,  0.3f }     // sound effects
+};
+
+static const PATCH *drum_patch(int key, double *freq) {
+    // channel 10: the keys of the GM kit that matter most, the rest clicks
+    static const PATCH kick     = { SINE,  0.001f, 0.25f, 0, 0.05f, 1.6f };
+    static const PATCH tom      = { SINE,  0.001f, 0.35f, 0, 0.1f,  1.2f };
+    static const PATCH snare    = { NOISE, 0.001f, 0.18f, 0, 0.05f, 0.6f };
+    static const PATCH hat      = { NOISE, 0.001f, 0.05f, 0, 0.02f, 0.3f };
+    static const PATCH open_hat = { NOISE, 0.001f, 0.35f, 0, 0.1f,  0.3f };
+    static const PATCH cymbal   = { NOISE, 0.002f, 1.2f,  0, 0.3f,  0.35f };
+    static const PATCH click    = { NOISE, 0.001f, 0.1f,  0, 0.05f, 0.4f };
+    *freq = 0;
+    switch (key) {
+    case 35: case 36:
+        *freq = 55;
+        return &kick;
+    case 41: case 43: case 45: case 47: case 48: case 50:
+        *freq = 80 + (key - 41) * 15;
+        return &tom;
+    case 37: case 38: case 39: case 40:
+        return &snare;
+    case 42: case 44:
+        return &hat;
+    case 46:
+        return &open_hat;
+    case 49: case 51: case 52: case 53: case 55: case 57: case 59:
+        return &cymbal;
+    }
+    return &click;
+}   // end drum_patch
+
+// the values one controller of one channel takes over the song
+struct TIMELINE {
+    std::vector<unsigned int> ticks;
+    std::vector<unsigned char> values;
+    unsigned char initial;
+
+    TIMELINE(int value = 0) : initial(value) {}
+    void add(unsigned int tick, int value) {
+        ticks.push_back(tick);
+        values.push_back(value);
+    }
+    // the value at tick, changes at the same tick included
+    int at(unsigned int tick) const {
+        size_t i = std::upper_bound(ticks.begin(), ticks.end(), tick) - ticks.begin();
+        return i ? values[i-1] : initial;
+    }
+    // for the pedal: the first tick from 'tick' on where it is up
+    unsigned int releasedAt(unsigned int tick, unsigned int song_end) const {
+        size_t i = std::upper_bound(ticks.begin(), ticks.end(), tick) - ticks.begin();
+        if ((i ? values[i-1] : initial) < 64)
+            return tick;
+        for (; i < ticks.size(); ++i)
+            if (values[i] < 64)
+                return ticks[i];
+        return song_end;
+    }
+};
+
+struct VOICE {
+    long long start, hold, end;     // samples: note-on, release starts, silent
+    float attack, decay, sustain, release;  // in samples, sustain a level
+    float gain_l, gain_r;
+    unsigned int inc;               // oscillator phase step, 2^32 is a period
+    unsigned int seed;              // noise
+    int wave;
+};
+
+static void make_voices(const MIDI_FILE &song, int rate, std::vector<VOICE> &voices) {
+    TIMELINE program[16], volume[16], expression[16], pan[16], pedal[16];
+    for (int ch = 0; ch < 16; ++ch) {
+        volume[ch].initial = 100;
+        expression[ch].initial = 127;
+        pan[ch].initial = 64;
+    }
+    for (size_t i = 0; i < song.events.size(); ++i) {
+        const MIDI_FILE::event &e = song.events[i];
+        int ch = e.data.d[0] & 0x0f;
+        if (e.type == SND_SEQ_EVENT_PGMCHANGE)
+            program[ch].add(e.tick, e.data.d[1] & 0x7f);
+        if (e.type != SND_SEQ_EVENT_CONTROLLER)
+            continue;
+        switch (e.data.d[1]) {
+        case 7:  volume[ch].add(e.tick, e.data.d[2] & 0x7f); break;
+        case 10: pan[ch].add(e.tick, e.data.d[2] & 0x7f); break;
+        case 11: expression[ch].add(e.tick, e.data.d[2] & 0x7f); break;
+        case 64: pedal[ch].add(e.tick, e.data.d[2] & 0x7f); break;
+        }
+    }
+    TEMPO_MAP tempo(song);
+    voices.clear();
+    voices.reserve(song.notes.count());
+    for (int i = 0; i < song.notes.count(); ++i) {
+        const NOTE_INDEX::note &n = song.notes.at(i);
+        if (!n.velocity)
+            continue;
+        int ch = n.channel;
+        double freq;
+        const PATCH *patch;
+        if (ch == 9)
+            patch = drum_patch(n.key, &freq);
+        else {
+            patch = &patches[program[ch].at(n.start) >> 3];
+            freq = 440 * pow(2, (n.key - 69) / 12.0);
+        }
+        VOICE v;
+        v.start = llround(tempo.seconds(n.start) * rate);
+        v.attack = std::max(1.0f, patch->attack * rate);
+        v.decay = std::max(1.0f, patch->decay * rate);
+        v.sustain = patch->sustain;
+        v.release = std::max(1.0f, patch->release * rate);
+        if (ch == 9)    // one-shots, drum note-offs mean nothing
+            v.hold = v.start + static_cast<long long>(v.attack + v.decay);
+        else
+            v.hold = llround(tempo.seconds(pedal[ch].releasedAt(n.end, song.lastTick())) * rate);
+        v.hold = std::max(v.hold, v.start + 1);
+        // a sound that has decayed to nothing needs no release
+        long long decayed = v.start + static_cast<long long>(v.attack + v.decay);
+        v.end = (v.sustain == 0 && v.hold > decayed ? decayed : v.hold) + static_cast<long long>(v.release);
+        float level = n.velocity / 127.0f;
+        float vol = volume[ch].at(n.start) / 127.0f, expr = expression[ch].at(n.start) / 127.0f;
+        level = level * level * vol * vol * expr * expr * patch->gain * MASTER;
+        double angle = pan[ch].at(n.start) / 127.0 * M_PI / 2;
+        v.gain_l = level * cos(angle);
+        v.gain_r = level * sin(angle);
+        v.inc = static_cast<unsigned int>(std::min(freq / rate, 0.49) * 4294967296.0);
+        v.seed = (i * 2654435761u) | 1;
+        v.wave = patch->wave;
+        voices.push_back(v);
+    }
+}   // end make_voices
+
+static float envelope(const VOICE &v, long long at) {
+    double t = at - v.start, hold = v.hold - v.start;
+    double held = std::min(t, hold), level;
+    if (held < v.attack)
+        level = held / v.attack;
+    else if (held < v.attack + v.decay)
+        level = 1 - (1 - v.sustain) * (held - v.attack) / v.decay;
+    else
+        level = v.sustain;
+    if (t > hold)
+        level *= std::max(0.0, 1 - (t - hold) / v.release);
+    return level;
+}
+
+// one voice over 'count' samples, a multiple of 8, added to the block
+struct MIX_JOB {
+    float *left, *right;
+    int count;
+    unsigned int phase, inc;
+    float env, denv;        // envelope at the first sample and per sample
+    float gain_l, gain_r;
+    unsigned int seed;
+    int wave;
+};
+
+static const float PHASE_SCALE = 1.0f / 2147483648.0f;  // phase to [-1, 1)
+
+static inline float sine_of(float x) {
+    // sin(pi * x) for x in [-1, 1): a parabola and one correction, 0.1% off
+    float y = 4 * x * (1 - fabsf(x));
+    return y * (0.775f + 0.225f * fabsf(y));
+}
+
+static void mix_scalar(const MIX_JOB &j) {
+    unsigned int phase = j.phase, noise = j.seed;
+    float env = j.env;
+    for (int i = 0; i < j.count; ++i) {
+        float x = static_cast<int>(phase) * PHASE_SCALE, s;
+        switch (j.wave) {
+        case SINE:     s = sine_of(x); break;
+        case TRIANGLE: s = 1 - 2 * fabsf(x); break;
+        case SAW:      s = x; break;
+        case SQUARE:   s = x < 0 ? -1.0f : 1.0f; break;
+        case ORGAN:
+            s = (sine_of(x) + 0.5f * sine_of(static_cast<int>(phase << 1) * PHASE_SCALE) +
+                 0.25f * sine_of(static_cast<int>(phase << 2) * PHASE_SCALE)) * (1 / 1.75f);
+            break;
+        default:
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            s = static_cast<int>(noise) * PHASE_SCALE;
+        }
+        s *= env;
+        j.left[i] += s * j.gain_l;
+        j.right[i] += s * j.gain_r;
+        phase += j.inc;
+        env += j.denv;
+    }
+}   // end mix_scalar
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+
+static inline __m128 sine_sse2(__m128 x) {
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 y = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), x), _mm_sub_ps(_mm_set1_ps(1.0f), _mm_and_ps(x, abs_mask)));
+    return _mm_mul_ps(y, _mm_add_ps(_mm_set1_ps(0.775f), _mm_mul_ps(_mm_set1_ps(0.225f), _mm_and_ps(y, abs_mask))));
+}
+
+static inline __m128 phase_sse2(__m128i phase) {
+    return _mm_mul_ps(_mm_cvtepi32_ps(phase), _mm_set1_ps(PHASE_SCALE));
+}
+
+template <int WAVE>
+static void mix_sse2_wave(const MIX_JOB &j) {
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i phase = _mm_add_epi32(_mm_set1_epi32(j.phase), _mm_setr_epi32(0, j.inc, j.inc * 2, j.inc * 3));
+    const __m128i step = _mm_set1_epi32(j.inc * 4);
+    __m128i noise = _mm_or_si128(_mm_setr_epi32(j.seed, j.seed ^ 0x9e3779b9, j.seed ^ 0x7f4a7c15, j.seed ^ 0x94d049bb),
+                                 _mm_set1_epi32(1));
+    __m128 env = _mm_add_ps(_mm_set1_ps(j.env), _mm_mul_ps(_mm_set1_ps(j.denv), _mm_setr_ps(0, 1, 2, 3)));
+    const __m128 denv = _mm_set1_ps(j.denv * 4);
+    const __m128 gain_l = _mm_set1_ps(j.gain_l), gain_r = _mm_set1_ps(j.gain_r);
+    for (int i = 0; i < j.count; i += 4) {
+        __m128 s;
+        if (WAVE == NOISE) {
+            noise = _mm_xor_si128(noise, _mm_slli_epi32(noise, 13));
+            noise = _mm_xor_si128(noise, _mm_srli_epi32(noise, 17));
+            noise = _mm_xor_si128(noise, _mm_slli_epi32(noise, 5));
+            s = phase_sse2(noise);
+        } else {
+            __m128 x = phase_sse2(phase);
+            if (WAVE == SINE)
+                s = sine_sse2(x);
+            else if (WAVE == TRIANGLE)
+                s = _mm_sub_ps(one, _mm_add_ps(_mm_and_ps(x, abs_mask), _mm_and_ps(x, abs_mask)));
+            else if (WAVE == SAW)
+                s = x;
+            else if (WAVE == SQUARE)
+                s = _mm_or_ps(_mm_and_ps(x, sign_mask), one);
+            else
+                s = _mm_mul_ps(_mm_add_ps(sine_sse2(x),
+                               _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.5f), sine_sse2(phase_sse2(_mm_slli_epi32(phase, 1)))),
+                                          _mm_mul_ps(_mm_set1_ps(0.25f), sine_sse2(phase_sse2(_mm_slli_epi32(phase, 2)))))),
+                               _mm_set1_ps(1 / 1.75f));
+            phase = _mm_add_epi32(phase, step);
+        }
+        s = _mm_mul_ps(s, env);
+        _mm_storeu_ps(j.left + i, _mm_add_ps(_mm_loadu_ps(j.left + i), _mm_mul_ps(s, gain_l)));
+        _mm_storeu_ps(j.right + i, _mm_add_ps(_mm_loadu_ps(j.right + i), _mm_mul_ps(s, gain_r)));
+        env = _mm_add_ps(env, denv);
+    }
+}   // end mix_sse2_wave
+
+static void mix_sse2(const MIX_JOB &j) {
+    switch (j.wave) {
+    case SINE:     mix_sse2_wave<SINE>(j); break;
+    case TRIANGLE: mix_sse2_wave<TRIANGLE>(j); break;
+    case SAW:      mix_sse2_wave<SAW>(j); break;
+    case SQUARE:   mix_sse2_wave<SQUARE>(j); break;
+    case ORGAN:    mix_sse2_wave<ORGAN>(j); break;
+    default:       mix_sse2_wave<NOISE>(j); break;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256 sine_avx2(__m256 x) {
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 y = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), x), _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_and_ps(x, abs_mask)));
+    return _mm256_mul_ps(y, _mm256_add_ps(_mm256_set1_ps(0.775f), _mm256_mul_ps(_mm256_set1_ps(0.225f), _mm256_and_ps(y, abs_mask))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 phase_avx2(__m256i phase) {
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(phase), _mm256_set1_ps(PHASE_SCALE));
+}
+
+template <int WAVE>
+__attribute__((target("avx2")))
+static void mix_avx2_wave(const MIX_JOB &j) {
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 sign_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const unsigned int inc = j.inc;
+    __m256i phase = _mm256_add_epi32(_mm256_set1_epi32(j.phase),
+                                     _mm256_setr_epi32(0, inc, inc * 2, inc * 3, inc * 4, inc * 5, inc * 6, inc * 7));
+    const __m256i step = _mm256_set1_epi32(inc * 8);
+    const unsigned int seed = j.seed;
+    __m256i noise = _mm256_or_si256(_mm256_setr_epi32(seed, seed ^ 0x9e3779b9, seed ^ 0x7f4a7c15, seed ^ 0x94d049bb,
+                                                      seed ^ 0x2545f491, seed ^ 0x6c8e9cf5, seed ^ 0x3c6ef372, seed ^ 0xa54ff53a),
+                                    _mm256_set1_epi32(1));
+    __m256 env = _mm256_add_ps(_mm256_set1_ps(j.env), _mm256_mul_ps(_mm256_set1_ps(j.denv), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    const __m256 denv = _mm256_set1_ps(j.denv * 8);
+    const __m256 gain_l = _mm256_set1_ps(j.gain_l), gain_r = _mm256_set1_ps(j.gain_r);
+    for (int i = 0; i < j.count; i += 8) {
+        __m256 s;
+        if (WAVE == NOISE) {
+            noise = _mm256_xor_si256(noise, _mm256_slli_epi32(noise, 13));
+            noise = _mm256_xor_si256(noise, _mm256_srli_epi32(noise, 17));
+            noise = _mm256_xor_si256(noise, _mm256_slli_epi32(noise, 5));
+            s = phase_avx2(noise);
+        } else {
+            __m256 x = phase_avx2(phase);
+            if (WAVE == SINE)
+                s = sine_avx2(x);
+            else if (WAVE == TRIANGLE)
+                s = _mm256_sub_ps(one, _mm256_add_ps(_mm256_and_ps(x, abs_mask), _mm256_and_ps(x, abs_mask)));
+            else if (WAVE == SAW)
+                s = x;
+            else if (WAVE == SQUARE)
+                s = _mm256_or_ps(_mm256_and_ps(x, sign_mask), one);
+            else
+                s = _mm256_mul_ps(_mm256_add_ps(sine_avx2(x),
+                                  _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), sine_avx2(phase_avx2(_mm256_slli_epi32(phase, 1)))),
+                                                _mm256_mul_ps(_mm256_set1_ps(0.25f), sine_avx2(phase_avx2(_mm256_slli_epi32(phase, 2)))))),
+                                  _mm256_set1_ps(1 / 1.75f));
+            phase = _mm256_add_epi32(phase, step);
+        }
+        s = _mm256_mul_ps(s, env);
+        _mm256_storeu_ps(j.left + i, _mm256_add_ps(_mm256_loadu_ps(j.left + i), _mm256_mul_ps(s, gain_l)));
+        _mm256_storeu_ps(j.right + i, _mm256_add_ps(_mm256_loadu_ps(j.right + i), _mm256_mul_ps(s, gain_r)));
+        env = _mm256_add_ps(env, denv);
+    }
+}   // end mix_avx2_wave
+
+__attribute__((target("avx2")))
+static void mix_avx2(const MIX_JOB &j) {
+    switch (j.wave) {
+    case SINE:     mix_avx2_wave<SINE>(j); break;
+    case TRIANGLE: mix_avx2_wave<TRIANGLE>(j); break;
+    case SAW:      mix_avx2_wave<SAW>(j); break;
+    case SQUARE:   mix_avx2_wave<SQUARE>(j); break;
+    case ORGAN:    mix_avx2_wave<ORGAN>(j); break;
+    default:       mix_avx2_wave<NOISE>(j); break;
+    }
+}
+#endif
+
+static void mix(const MIX_JOB &j, int isa) {
+    switch (isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SCAN_AVX2:
+        mix_avx2(j);
+        break;
+    case SCAN_SSE2:
+        mix_sse2(j);
+        break;
+#endif
+    default:
+        mix_scalar(j);
+        break;
+    }
+}
+
+struct BLOCK {
+    long long first;        // sample
+    int count;
+    std::vector<int> voices;
+    const std::vector<VOICE> *all;
+    float *out;             // interleaved stereo, 'count' frames
+    int isa;
+    float peak;
+};
+
+static void render_block(BLOCK &b) {
+    // planar while mixing, padded so a voice can always finish its vector
+    std::vector<float> left(b.count + SUB, 0.0f), right(b.count + SUB, 0.0f);
+    long long last = b.first + b.count;
+    for (size_t k = 0; k < b.voices.size(); ++k) {
+        const VOICE &v = (*b.all)[b.voices[k]];
+        long long from = std::max(v.start, b.first), to = std::min(v.end, last);
+        for (long long s = from; s < to; s += SUB) {
+            MIX_JOB j;
+            j.count = (std::min<long long>(SUB, to - s) + 7) & ~7;
+            j.left = &left[s - b.first];
+            j.right = &right[s - b.first];
+            // the phase follows from the sample number, no state carries over
+            j.phase = static_cast<unsigned int>(v.inc * static_cast<unsigned long long>(s - v.start));
+            j.inc = v.inc;
+            j.env = envelope(v, s);
+            j.denv = (envelope(v, s + j.count) - j.env) / j.count;
+            j.gain_l = v.gain_l;
+            j.gain_r = v.gain_r;
+            j.seed = (v.seed ^ static_cast<unsigned int>(s * 0x9e3779b1u)) | 1;
+            j.wave = v.wave;
+            mix(j, b.isa);
+        }
+    }
+    float peak = 0;
+    for (int i = 0; i < b.count; ++i) {
+        b.out[2*i] = left[i];
+        b.out[2*i + 1] = right[i];
+        peak = std::max(peak, std::max(fabsf(left[i]), fabsf(right[i])));
+    }
+    b.peak = peak;
+}   // end render_block
+
+static int write_wav(const char *path, int rate, const std::vector<float> &mix, float gain) {
+    // 16-bit stereo PCM, little-endian whatever the host
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -errno;
+    unsigned int data_bytes = mix.size() * 2;
+    unsigned char header[44];
+    memcpy(header, "RIFF\0\0\0\0WAVEfmt \20\0\0\0\1\0\2\0\0\0\0\0\0\0\0\0\4\0\20\0data\0\0\0\0", 44);
+    unsigned int fields[4][2] = { { 4, 36 + data_bytes }, { 24, static_cast<unsigned int>(rate) },
+                                  { 28, static_cast<unsigned int>(rate) * 4 }, { 40, data_bytes } };
+    for (int i = 0; i < 4; ++i)
+        for (int b = 0; b < 4; ++b)
+            header[fields[i][0] + b] = fields[i][1] >> (8 * b);
+    fwrite(header, 1, sizeof(header), f);
+    std::vector<unsigned char> bytes(BLOCK_SAMPLES * 4);
+    for (size_t at = 0; at < mix.size(); ) {
+        size_t n = std::min(mix.size() - at, bytes.size() / 2);
+        for (size_t i = 0; i < n; ++i) {
+            float x = std::max(-1.0f, std::min(1.0f, mix[at + i] * gain));
+            short s = static_cast<short>(lrintf(x * 32767));
+            bytes[2*i] = s & 0xff;
+            bytes[2*i + 1] = (s >> 8) & 0xff;
+        }
+        fwrite(&bytes[0], 1, n * 2, f);
+        at += n;
+    }
+    if (ferror(f)) {
+        fclose(f);
+        return -EIO;
+    }
+    return fclose(f) ? -errno : 0;
+}   // end write_wav
+
+int render_file(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: --render FILE OUT.wav [RATE]\n");
+        return 1;
+    }
+    int rate = argc > 2 ? atoi(argv[2]) : 44100;
+    if (rate < 8000 || rate > 192000) {
+        fprintf(stderr, "sample rate %s is not in 8000-192000\n", argv[2]);
+        return 1;
+    }
+    long long t0 = stats_now();
+    MIDI_FILE song;
+    if (!song.load(argv[0], false)) {
+        fprintf(stderr, "%s\n", song.errorString().toLocal8Bit().data());
+        return 1;
+    }
+    long long t_load = stats_now();
+    std::vector<VOICE> voices;
+    make_voices(song, rate, voices);
+    TEMPO_MAP tempo(song);
+    long long frames = llround(tempo.seconds(song.lastTick()) * rate);
+    for (size_t i = 0; i < voices.size(); ++i)
+        frames = std::max(frames, voices[i].end);
+
+    // each voice is listed in every block it sounds in
+    std::vector<float> out(frames * 2);
+    std::vector<BLOCK> blocks((frames + BLOCK_SAMPLES - 1) / BLOCK_SAMPLES);
+    int isa = scan_best_isa();      // the decoder's CPU probe
+    for (size_t k = 0; k < blocks.size(); ++k) {
+        BLOCK &b = blocks[k];
+        b.first = static_cast<long long>(k) * BLOCK_SAMPLES;
+        b.count = std::min<long long>(BLOCK_SAMPLES, frames - b.first);
+        b.all = &voices;
+        b.out = &out[b.first * 2];
+        b.isa = isa;
+        b.peak = 0;
+    }
+    for (size_t i = 0; i < voices.size(); ++i)
+        for (long long k = voices[i].start / BLOCK_SAMPLES; k * BLOCK_SAMPLES < voices[i].end; ++k)
+            blocks[k].voices.push_back(i);
+    if (blocks.size() > 1)
+        QtConcurrent::blockingMap(blocks, render_block);
+    else if (!blocks.empty())
+        render_block(blocks[0]);
+    float peak = 0;
+    for (size_t k = 0; k < blocks.size(); ++k)
+        peak = std::max(peak, blocks[k].peak);
+    float gain = peak > CEILING ? CEILING / peak : 1.0f;
+    long long t_mix = stats_now();
+
+    int err = write_wav(argv[1], rate, out, gain);
+    if (err < 0) {
+        fprintf(stderr, "cannot write %s: %s\n", argv[1], strerror(-err));
+        return 1;
+    }
+    long long t_end = stats_now();
+    double seconds = static_cast<double>(frames) / rate;
+    printf("%s: %.1f s of audio in %.2f s (%.0fx real time)\n", argv[1], seconds, (t_end - t0) / 1e9,
+           seconds / std::max(1e-9, (t_end - t0) / 1e9));
+    printf("  load %.0f ms, mix %.0f ms, write %.0f ms; %d voices in %d blocks on %d threads, %s\n",
+           (t_load - t0) / 1e6, (t_mix - t_load) / 1e6, (t_end - t_mix) / 1e6,
+           static_cast<int>(voices.size()), static_cast<int>(blocks.size()), QThread::idealThreadCount(),
+           scan_isa_name(isa));
+    if (gain < 1)
+        printf("  peak %.1f dBFS, scaled by %.1f dB\n", 20 * log10(peak * gain), 20 * log10(gain));
+    else
+        printf("  peak %.1f dBFS\n", peak > 0 ? 20 * log10(peak) : -INFINITY);
+    return 0;
+}   // end render_file
@@ -0,0 +1,19 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+// Offline rendering of a song to a 16-bit stereo WAV file through a small
+// built-in synth: one oscillator and a linear ADSR envelope per note, a
+// patch for each General MIDI family of eight programs and a few noise
+// and sine drums on channel 10.  Program, volume, expression, pan and
+// the sustain pedal are taken as they are when each note starts.
+//
+// Every note becomes a voice with its start, release and end in samples
+// and its oscillator phase a function of the sample number, so time
+// blocks of the song are rendered on all cores independently.  The voice
+// loop is vectorized with SSE2 or AVX2, whichever the CPU has.
+// Implemented in render.cpp.
+
+// --render FILE OUT.wav [RATE]: returns the exit code
+int render_file(int argc, char **argv);
+
+#endif // RENDER_H
@@ -0,0 +1,312 @@
+// seq_session.cpp -- part of MIDI_PLAYER
+// process-wide ALSA sequencer session: its client and one zone per
+// player window are created once and kept until exit.  A zone is a
+// client of its own with a queue, a source port and the subscription
+// to its destination; transport code only changes their state.
+// A private port of the session's client is subscribed to the system
+// announce port so the device registry follows hot-plugged clients
+// and ports.
+// contains:
+//      instance()   -- the one session object
+//      open()       -- open the client and zone 0 (once)
+//      close()      -- release everything, called at process exit
+//      addZone()    -- another zone, with its own client
+//      zone()       -- look up a zone by index
+//      pollFd()     -- descriptor to watch for announce events
+//      readInput()  -- drain pending announce events into the registry
+//      SEQ_ZONE()   -- constructor, the output lock
+//      SEQ_ZONE::open(), close() -- the zone's client, queue and port
+//      SEQ_ZONE::connectDest()    -- subscribe the source port, no-op if unchanged
+//      SEQ_ZONE::disconnectDest() -- drop the current subscription
+//      SEQ_ZONE::dropOutput()     -- discard what this zone has scheduled
+//      SEQ_ZONE::resetQueue()     -- stop the queue and discard pending output
+//      SEQ_ZONE::withdrawNoteOff() -- take back the queued note-offs of one key
+//      SEQ_ZONE::withdrawTempo()   -- take back the queued tempo changes
+
+#include "seq_session.h"
+#include <stdio.h>
+#include <QtDebug>
+
+SEQ_SESSION::SEQ_SESSION() :
+    seq(0), client_id(-1), announce_port(-1), port_serial(0), timer_freq(0), timer_set(false)
+{
+    strcpy(timer_name, "system");
+    timer_res_ns = 0;
+}
+
+SEQ_SESSION::~SEQ_SESSION() {
+    close();
+}
+
+SEQ_SESSION *SEQ_SESSION::instance() {
+    static SEQ_SESSION session;
+    return &session;
+}
+
+int SEQ_SESSION::open(const char *client_name) {
+    // returns 0 or a negative ALSA error code, callers report it
+    if (seq)
+        return 0;
+    // this client only reads announcements, the zones' clients write
+    char name[64];
+    snprintf(name, sizeof(name), "%s devices", client_name);
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, 0);
+    if (err < 0) {
+        seq = 0;
+        return err;
+    }
+    err = snd_seq_set_client_name(seq, name);
+    if (err < 0) goto _error;
+    client_id = snd_seq_client_id(seq);
+    if (client_id < 0) {
+        err = client_id;
+        goto _error;
+    }
+    // zone 0 has the program's name and port 0, so existing connections
+    // by name still work
+    err = createZone(client_name, 0);
+    if (err < 0) goto _error;
+    // private input port for client/port start, exit and change events
+    announce_port = snd_seq_create_simple_port(seq, "announce",
+           SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+           SND_SEQ_PORT_TYPE_APPLICATION);
+    if (announce_port < 0) {
+        err = announce_port;
+        goto _error;
+    }
+    err = snd_seq_connect_from(seq, announce_port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+    if (err < 0) goto _error;
+    registry.build(seq);
+    qDebug() << "Session opened, client" << client_id;
+    return 0;
+_error:
+    close();
+    return err;
+}   // end open
+
+void SEQ_SESSION::close() {
+    if (!seq)
+        return;
+    for (size_t i = 0; i < zones.size(); ++i)
+        delete zones[i];
+    zones.clear();
+    snd_seq_close(seq);
+    seq = 0;
+    client_id = announce_port = -1;
+    qDebug() << "Session closed";
+}   // end close
+
+int SEQ_SESSION::createZone(const char *name, int port) {
+    // port < 0 lets ALSA pick the port number; returns the zone index
+    SEQ_ZONE *z = new SEQ_ZONE;
+    int err = z->open(name, port);
+    if (err < 0) {
+        delete z;
+        return err;
+    }
+    zones.push_back(z);
+    qDebug() << "Zone" << zones.size() - 1 << "client" << snd_seq_client_id(z->seq)
+             << "queue" << z->q << "port" << z->src_port;
+    return zones.size() - 1;
+}   // end createZone
+
+int SEQ_SESSION::addZone(const char *name) {
+    // the new queue runs on whatever timer the other zones use
+    if (!seq)
+        return -EBADFD;
+    int index = createZone(name, -1);
+    if (index >= 0 && timer_set) {
+        int err = applyTimer(zones[index]);
+        if (err < 0)
+            qDebug() << "Zone" << index << "keeps the default timer:" << snd_strerror(err);
+    }
+    return index;
+}
+
+SEQ_ZONE *SEQ_SESSION::zone(int index) const {
+    if (index < 0 || index >= static_cast<int>(zones.size()))
+        return 0;
+    return zones[index];
+}
+
+int SEQ_SESSION::pollFd() const {
+    if (!seq)
+        return -1;
+    struct pollfd pfd;
+    if (snd_seq_poll_descriptors(seq, &pfd, 1, POLLIN) != 1)
+        return -1;
+    return pfd.fd;
+}
+
+bool SEQ_SESSION::readInput() {
+    // called from the notifier on pollFd(); every zone window calls it,
+    // so return at once when an earlier call already drained the input.
+    // Returns true if the port list changed
+    if (!seq)
+        return false;
+    struct pollfd pfd;
+    if (snd_seq_event_input_pending(seq, 0) <= 0 &&
+        (snd_seq_poll_descriptors(seq, &pfd, 1, POLLIN) != 1 || poll(&pfd, 1, 0) <= 0))
+        return false;
+    bool changed = false;
+    snd_seq_event_t *ev;
+    do {
+        if (snd_seq_event_input(seq, &ev) < 0)
+            break;
+        if (ev->dest.port != announce_port)
+            continue;
+        changed |= registry.handleEvent(seq, ev);
+        if (ev->type != SND_SEQ_EVENT_PORT_EXIT && ev->type != SND_SEQ_EVENT_CLIENT_EXIT)
+            continue;
+        // a subscription does not survive its destination
+        for (size_t i = 0; i < zones.size(); ++i) {
+            SEQ_ZONE *z = zones[i];
+            if (z->connected && ev->data.addr.client == z->dest_addr.client &&
+                (ev->type == SND_SEQ_EVENT_CLIENT_EXIT || ev->data.addr.port == z->dest_addr.port))
+                z->connected = false;
+        }
+    } while (snd_seq_event_input_pending(seq, 0) > 0);
+    if (changed)
+        ++port_serial;
+    return changed;
+}   // end readInput
+
+SEQ_ZONE::SEQ_ZONE() :
+    seq(0), q(-1), src_port(-1), connected(false)
+{
+    dest_addr.client = dest_addr.port = 0;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&output_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+SEQ_ZONE::~SEQ_ZONE() {
+    close();
+    pthread_mutex_destroy(&output_lock);
+}
+
+int SEQ_ZONE::open(const char *name, int port) {
+    // output only: the session's client reads the announcements.  The
+    // zone's events, drains and removals touch nothing of another zone
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+    if (err < 0) {
+        seq = 0;
+        return err;
+    }
+    snd_seq_port_info_t *pinfo;
+    snd_seq_port_info_alloca(&pinfo);
+    err = snd_seq_set_client_name(seq, name);
+    if (err < 0) goto _error;
+    q = snd_seq_alloc_named_queue(seq, name);
+    if (q < 0) {
+        err = q;
+        goto _error;
+    }
+    if (port >= 0) {
+        snd_seq_port_info_set_port(pinfo, port);
+        snd_seq_port_info_set_port_specified(pinfo, 1);
+    }
+    snd_seq_port_info_set_name(pinfo, name);
+    snd_seq_port_info_set_capability(pinfo, 0);
+    snd_seq_port_info_set_type(pinfo,
+           SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+           SND_SEQ_PORT_TYPE_APPLICATION);
+    err = snd_seq_create_port(seq, pinfo);
+    if (err < 0) goto _error;
+    src_port = snd_seq_port_info_get_port(pinfo);
+    return 0;
+_error:
+    close();
+    return err;
+}   // end open
+
+void SEQ_ZONE::close() {
+    if (!seq)
+        return;
+    lockOutput();
+    snd_seq_drop_output(seq);
+    unlockOutput();
+    snd_seq_close(seq);     // frees the queue and the port
+    seq = 0;
+    q = src_port = -1;
+    connected = false;
+}
+
+int SEQ_ZONE::connectDest(const char *addr_name) {
+    // addr_name is "client:port"; an unchanged destination costs nothing
+    snd_seq_addr_t addr;
+    int err = snd_seq_parse_address(seq, &addr, addr_name);
+    if (err < 0)
+        return err;
+    if (connected && addr.client == dest_addr.client && addr.port == dest_addr.port)
+        return 0;
+    disconnectDest();
+    err = snd_seq_connect_to(seq, src_port, addr.client, addr.port);
+    if (err < 0 && err != -EBUSY)
+        return err;
+    dest_addr = addr;
+    connected = true;
+    qDebug() << "Connected port" << addr_name << "to queue" << q;
+    return 0;
+}   // end connectDest
+
+int SEQ_ZONE::disconnectDest() {
+    if (!connected)
+        return 0;
+    connected = false;
+    return snd_seq_disconnect_to(seq, src_port, dest_addr.client, dest_addr.port);
+}
+
+void SEQ_ZONE::dropOutput() {
+    // the client is the zone's own, so everything it has scheduled, in
+    // the output buffer and in the kernel, is this zone's
+    lockOutput();
+    snd_seq_drop_output(seq);
+    unlockOutput();
+}   // end dropOutput
+
+void SEQ_ZONE::resetQueue() {
+    // stop the queue where it is and throw away anything not yet delivered
+    lockOutput();
+    snd_seq_drop_output(seq);
+    snd_seq_stop_queue(seq, q, NULL);
+    snd_seq_drain_output(seq);
+    unlockOutput();
+}
+
+void SEQ_ZONE::withdrawNoteOff(int channel, int key) {
+    // only the cells of this zone's client match, whichever thread queued
+    // them; the library output buffer of the handle is searched too
+    snd_seq_remove_events_t *rm;
+    snd_seq_remove_events_alloca(&rm);
+    snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_DEST |
+        SND_SEQ_REMOVE_DEST_CHANNEL | SND_SEQ_REMOVE_EVENT_TYPE | SND_SEQ_REMOVE_TAG_MATCH);
+    snd_seq_remove_events_set_queue(rm, q);
+    snd_seq_remove_events_set_dest(rm, &dest_addr);
+    snd_seq_remove_events_set_channel(rm, channel);
+    snd_seq_remove_events_set_event_type(rm, SND_SEQ_EVENT_NOTEOFF);
+    snd_seq_remove_events_set_tag(rm, NOTE_OFF_TAG | key);
+    lockOutput();
+    snd_seq_remove_events(seq, rm);
+    unlockOutput();
+}
+
+void SEQ_ZONE::withdrawTempo() {
+    // for the player, which drains the output buffer first
+    snd_seq_remove_events_t *rm;
+    snd_seq_remove_events_alloca(&rm);
+    snd_seq_addr_t addr;
+    addr.client = SND_SEQ_CLIENT_SYSTEM;
+    addr.port = SND_SEQ_PORT_SYSTEM_TIMER;
+    snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_DEST |
+        SND_SEQ_REMOVE_EVENT_TYPE | SND_SEQ_REMOVE_TAG_MATCH);
+    snd_seq_remove_events_set_queue(rm, q);
+    snd_seq_remove_events_set_dest(rm, &addr);
+    snd_seq_remove_events_set_event_type(rm, SND_SEQ_EVENT_TEMPO);
+    snd_seq_remove_events_set_tag(rm, TEMPO_TAG);
+    lockOutput();
+    snd_seq_remove_events(seq, rm);
+    unlockOutput();
+}
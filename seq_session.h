@@ -0,0 +1,114 @@
+#ifndef SEQ_SESSION_H
+#define SEQ_SESSION_H
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <vector>
+#include "device_registry.h"
+
+// An ALSA timer as snd_seq_set_queue_timer() wants it.
+struct SEQ_TIMER {
+    int tclass, card, device, subdevice;
+};
+
+// The player tags the note-offs it schedules with NOTE_OFF_TAG | key,
+// so one of them can be taken back while it waits in the queue.
+const int NOTE_OFF_TAG = 0x80;
+// Its tempo changes carry TEMPO_TAG, so the ones still queued can be
+// scaled again when the tempo transform changes.
+const int TEMPO_TAG = 0x01;
+
+// One playback zone: a sequencer client of its own with a queue, a
+// source port and the destination subscription, so zones start, stop
+// and seek without touching each other.  The window, the player thread
+// and the live thru all use the zone's output buffer; whoever writes to
+// it, drains it or removes events holds lockOutput().  The lock is the
+// zone's, so a zone blocked on a full pool never holds up another one.
+class SEQ_ZONE {
+public:
+    snd_seq_t *handle() const { return seq; }
+    int queue() const { return q; }
+    int port() const { return src_port; }
+
+    // recursive
+    void lockOutput() { pthread_mutex_lock(&output_lock); }
+    void unlockOutput() { pthread_mutex_unlock(&output_lock); }
+
+    int connectDest(const char *addr_name);
+    int disconnectDest();
+    bool hasDest() const { return connected; }
+    const snd_seq_addr_t *dest() const { return &dest_addr; }
+
+    void dropOutput();
+    void resetQueue();
+    void withdrawNoteOff(int channel, int key);
+    void withdrawTempo();
+
+private:
+    friend class SEQ_SESSION;
+    SEQ_ZONE();
+    ~SEQ_ZONE();
+    int open(const char *name, int port);
+    void close();
+
+    snd_seq_t *seq;
+    int q;
+    int src_port;
+    snd_seq_addr_t dest_addr;
+    bool connected;
+    pthread_mutex_t output_lock;
+};
+
+// One ALSA sequencer session for the life of the process.
+// Owns the zones, so transport changes never reopen any of them.
+// Zone 0 is created by open(), more with addZone().  Its own client
+// listens on the system announce port to keep the device registry
+// current.
+class SEQ_SESSION {
+public:
+    static SEQ_SESSION *instance();
+
+    int open(const char *client_name="midi_player");
+    void close();
+    bool isOpen() const { return seq != 0; }
+
+    snd_seq_t *handle() const { return seq; }
+    int client() const { return client_id; }
+
+    int addZone(const char *name);
+    SEQ_ZONE *zone(int index) const;
+    int zoneCount() const { return zones.size(); }
+
+    // queue_timer.cpp
+    int selectTimer(const char *source, int freq=0);
+    int calibrateTimer(double *drift_ppm, double *jitter_us);
+    const char *timerName() const { return timer_name; }
+    long timerResolution() const { return timer_res_ns; }
+
+    const DEVICE_REGISTRY &devices() const { return registry; }
+    int pollFd() const;
+    bool readInput();
+    unsigned int portSerial() const { return port_serial; }
+
+private:
+    SEQ_SESSION();
+    ~SEQ_SESSION();
+    SEQ_SESSION(const SEQ_SESSION &);
+    SEQ_SESSION &operator=(const SEQ_SESSION &);
+    int createZone(const char *name, int port);
+    int applyTimer(SEQ_ZONE *);
+
+    snd_seq_t *seq;
+    int client_id;
+    int announce_port;
+    std::vector<SEQ_ZONE *> zones;
+    DEVICE_REGISTRY registry;
+    unsigned int port_serial;   // bumped whenever the registry changes
+    SEQ_TIMER timer;
+    int timer_freq;
+    bool timer_set;             // selectTimer() succeeded, new zones follow it
+    char timer_name[32];
+    long timer_res_ns;
+};
+
+#endif // SEQ_SESSION_H
@@ -0,0 +1,410 @@
+// smf_convert.cpp -- part of MIDI_PLAYER
+// type 0 conversion of single songs and whole directories, see smf_convert.h
+// contains:
+//      META            -- one meta event to put back between the events
+//      CHANNEL_SHADOW  -- what each channel is set to, for strip mode
+//      redundant()     -- would this event change nothing
+//      convert_song()  -- one parsed song into one track
+//      CONVERT_JOB, convert_one() -- one file, run on the worker pool
+//      convert_files() -- "--convert [--strip] DIR OUTDIR"
+//      verify_convert() -- "--verify-convert", what strip mode drops
+
+#include "smf_convert.h"
+#include "midi_file.h"
+#include "smf_writer.h"
+#include "player_stats.h"
+#include <alsa/asoundlib.h>
+#include <QtConcurrentMap>
+#include <QDir>
+#include <QHash>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QThread>
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+static const size_t FLUSH_BYTES = 65536;    // write out the track in pieces this size
+
+struct META {
+    unsigned int tick;
+    unsigned char type;
+    const unsigned char *data;
+    int len;
+};
+
+static bool meta_comp(const META &m1, const META &m2) {
+    return m1.tick < m2.tick;
+}
+
+struct CHANNEL_SHADOW {
+    short cc[16][128];      // -1 until set
+    short program[16], pressure[16], bend[16];
+    bool bank_set[16];      // bank select since the last program change
+    unsigned char held[16][128];    // note-ons not yet released
+
+    CHANNEL_SHADOW() {
+        forget();
+        memset(held, 0, sizeof(held));
+    }
+    // the device state is not known any more, notes still sound
+    void forget() {
+        memset(cc, -1, sizeof(cc));
+        memset(program, -1, sizeof(program));
+        memset(pressure, -1, sizeof(pressure));
+        memset(bend, -1, sizeof(bend));
+        memset(bank_set, 0, sizeof(bank_set));
+    }
+    // reset all controllers: the controllers, pressure and bend of ch
+    void resetControllers(int ch) {
+        memset(cc[ch], -1, sizeof(cc[ch]));
+        pressure[ch] = bend[ch] = -1;
+    }
+};
+
+static bool kept_controller(int param) {
+    // their meaning depends on what comes before or after them
+    return param == 0 || param == 32 || param == 6 || param == 38 ||
+           (param >= 96 && param <= 101) || param >= 120;
+}
+
+// updates the shadow with e and says whether e can be dropped
+static bool redundant(CHANNEL_SHADOW &s, const MIDI_FILE &song, const MIDI_FILE::event &e) {
+    int ch = e.data.d[0] & 0x0f, d1 = e.data.d[1], d2 = e.data.d[2];
+    switch (e.type) {
+    case SND_SEQ_EVENT_NOTEON:
+        if (d2) {
+            if (s.held[ch][d1] < 255)
+                ++s.held[ch][d1];
+            return false;
+        }
+        // fall through, velocity 0 is a note-off
+    case SND_SEQ_EVENT_NOTEOFF:
+        if (!s.held[ch][d1])
+            return true;
+        --s.held[ch][d1];
+        return false;
+    case SND_SEQ_EVENT_CONTROLLER:
+        if (d1 == 121)
+            s.resetControllers(ch);
+        if (d1 == 0 || d1 == 32)
+            s.bank_set[ch] = true;
+        if (kept_controller(d1))
+            return false;
+        if (s.cc[ch][d1] == d2)
+            return true;
+        s.cc[ch][d1] = d2;
+        return false;
+    case SND_SEQ_EVENT_PGMCHANGE:
+        if (s.program[ch] == d1 && !s.bank_set[ch])
+            return true;
+        s.program[ch] = d1;
+        s.bank_set[ch] = false;
+        return false;
+    case SND_SEQ_EVENT_CHANPRESS:
+        if (s.pressure[ch] == d1)
+            return true;
+        s.pressure[ch] = d1;
+        return false;
+    case SND_SEQ_EVENT_PITCHBEND:
+        if (s.bend[ch] == (d1 | d2 << 7))
+            return true;
+        s.bend[ch] = d1 | d2 << 7;
+        return false;
+    case SND_SEQ_EVENT_SYSEX: {
+        // GM, GS and XG resets, and the part settings of GS and XG that
+        // stand for controllers and programs; only universal real-time
+        // messages such as master volume leave the channels alone
+        const unsigned char *p = song.sysex_arena.data() + e.data.sysex.offset;
+        if (e.data.sysex.length < 2 || p[0] != 0xf0 || p[1] != 0x7f)
+            s.forget();
+        return false;
+    }
+    }
+    return false;
+}   // end redundant
+
+void convert_song(const MIDI_FILE &song, SMF_WRITER &w, bool strip, CONVERT_COUNTS &counts) {
+    // the meta events the parser keeps apart, merged back by tick
+    std::vector<META> metas;
+    for (size_t i = 0; i < song.signatures.size(); ++i) {
+        const MIDI_FILE::signature &sig = song.signatures[i];
+        META m = { sig.tick, sig.type, sig.data, sig.type == 0x58 ? 4 : 2 };
+        metas.push_back(m);
+    }
+    static const unsigned char text_type[META_TEXT::KINDS] = { 0x01, 0x05, 0x06, 0x07 };
+    for (int kind = 0; kind < META_TEXT::KINDS; ++kind)
+        for (int i = 0; i < song.texts.count(kind); ++i) {
+            const META_TEXT::entry &t = song.texts.at(kind, i);
+            META m = { t.tick, text_type[kind],
+                       reinterpret_cast<const unsigned char *>(song.texts.data(kind, i)), static_cast<int>(t.length) };
+            metas.push_back(m);
+        }
+    std::stable_sort(metas.begin(), metas.end(), meta_comp);
+    counts.events_in = song.events.size() + metas.size();
+    counts.events_out = 0;
+
+    CHANNEL_SHADOW shadow;
+    int tempo = -1;
+    const unsigned char *last_sig[2] = { 0, 0 };   // time, key
+    // SMPTE files start at a tempo of their own, which no event sets
+    bool tempo_at_0 = false;
+    for (size_t i = 0; i < song.events.size() && !song.events[i].tick; ++i)
+        tempo_at_0 |= song.events[i].type == SND_SEQ_EVENT_TEMPO;
+    if (song.init_tempo != 500000 && !tempo_at_0) {
+        tempo = song.init_tempo;
+        unsigned char t[3] = { static_cast<unsigned char>(tempo >> 16), static_cast<unsigned char>(tempo >> 8),
+                               static_cast<unsigned char>(tempo) };
+        w.meta(0, 0x51, t, 3);
+        ++counts.events_out;
+    }
+    size_t m = 0;
+    for (size_t i = 0; i <= song.events.size(); ++i) {
+        bool last = i == song.events.size();
+        for (; m < metas.size() && (last || metas[m].tick <= song.events[i].tick); ++m) {
+            const META &meta = metas[m];
+            if (meta.type == 0x58 || meta.type == 0x59) {
+                const unsigned char *&prev = last_sig[meta.type - 0x58];
+                if (strip && prev && !memcmp(prev, meta.data, meta.len))
+                    continue;
+                prev = meta.data;
+            }
+            w.meta(meta.tick, meta.type, meta.data, meta.len);
+            ++counts.events_out;
+        }
+        if (last)
+            break;
+        const MIDI_FILE::event &e = song.events[i];
+        if (strip && redundant(shadow, song, e))
+            continue;
+        unsigned char msg[3] = { e.data.d[0], e.data.d[1], e.data.d[2] };
+        int len = 3;
+        switch (e.type) {
+        case SND_SEQ_EVENT_NOTEOFF:
+            msg[0] |= 0x80;
+            if (strip && (msg[2] == 64 || msg[2] == 0)) {
+                msg[0] ^= 0x10;
+                msg[2] = 0;
+            }
+            break;
+        case SND_SEQ_EVENT_NOTEON:      msg[0] |= 0x90; break;
+        case SND_SEQ_EVENT_KEYPRESS:    msg[0] |= 0xa0; break;
+        case SND_SEQ_EVENT_CONTROLLER:  msg[0] |= 0xb0; break;
+        case SND_SEQ_EVENT_PGMCHANGE:   msg[0] |= 0xc0; len = 2; break;
+        case SND_SEQ_EVENT_CHANPRESS:   msg[0] |= 0xd0; len = 2; break;
+        case SND_SEQ_EVENT_PITCHBEND:   msg[0] |= 0xe0; break;
+        case SND_SEQ_EVENT_TEMPO: {
+            if (strip && e.data.tempo == tempo)
+                continue;
+            tempo = e.data.tempo;
+            unsigned char t[3] = { static_cast<unsigned char>(tempo >> 16), static_cast<unsigned char>(tempo >> 8),
+                                   static_cast<unsigned char>(tempo) };
+            w.meta(e.tick, 0x51, t, 3);
+            ++counts.events_out;
+            continue;
+        }
+        case SND_SEQ_EVENT_SYSEX: {
+            const unsigned char *p = song.sysex_arena.data() + e.data.sysex.offset;
+            unsigned int n = e.data.sysex.length;
+            if (n && p[0] == 0xf0)
+                w.sysex(e.tick, p, n);
+            else {
+                // an escaped sequence, stored without its F7
+                std::vector<unsigned char> escape(1, 0xf7);
+                escape.insert(escape.end(), p, p + n);
+                w.sysex(e.tick, &escape[0], escape.size());
+            }
+            ++counts.events_out;
+            continue;
+        }
+        default:
+            continue;
+        }
+        w.channel(e.tick, msg, len);
+        ++counts.events_out;
+        if (w.buffered() >= FLUSH_BYTES)
+            w.flush();
+    }
+}   // end convert_song
+
+struct CONVERT_JOB {
+    QString in, out;
+    bool strip;
+    long long in_bytes, out_bytes;
+    CONVERT_COUNTS counts;
+    QString error;
+};
+
+static void convert_one(CONVERT_JOB &job) {
+    if (!job.error.isEmpty())
+        return;     // turned down before the workers started
+    MIDI_FILE song;
+    QByteArray in = job.in.toLocal8Bit(), out = job.out.toLocal8Bit();
+    if (!song.load(in.data(), false)) {
+        job.error = song.errorString();
+        return;
+    }
+    job.in_bytes = song.file_bytes;
+    if (song.PPQ > 0x7fff) {
+        job.error = QString("%1: %2 ticks per quarter don't fit a type 0 header") .arg(job.in) .arg(song.PPQ);
+        return;
+    }
+    SMF_WRITER w;
+    if (w.open(out.data(), 0, static_cast<int>(song.PPQ)) < 0 || w.beginTrack() < 0) {
+        job.error = QString("Cannot write %1 - %2") .arg(job.out) .arg(strerror(-w.error()));
+        return;
+    }
+    convert_song(song, w, job.strip, job.counts);
+    w.endTrack(song.lastTick());
+    job.out_bytes = w.bytes();
+    // thousands of files: leave write-back to the OS instead of a sync each
+    if (w.close(false) < 0)
+        job.error = QString("Cannot write %1 - %2") .arg(job.out) .arg(strerror(-w.error()));
+}   // end convert_one
+
+int convert_files(int argc, char **argv) {
+    bool strip = argc > 0 && !strcmp(argv[0], "--strip");
+    if (strip) {
+        --argc;
+        ++argv;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: --convert [--strip] DIR OUTDIR\n");
+        return 1;
+    }
+    QDir src(argv[0]), dst(argv[1]);
+    if (!src.exists()) {
+        fprintf(stderr, "%s is not a directory\n", argv[0]);
+        return 1;
+    }
+    if (!dst.mkpath(".") || dst.canonicalPath() == src.canonicalPath()) {
+        fprintf(stderr, "cannot write to %s\n", argv[1]);
+        return 1;
+    }
+    long long t0 = stats_now();
+    std::vector<CONVERT_JOB> jobs;
+    QHash<QString, QString> writers;    // output path -> the input that writes it
+    QDirIterator it(src.absolutePath(), QStringList() << "*.mid" << "*.midi" << "*.kar" << "*.rmi"
+                    << "*.MID" << "*.MIDI" << "*.KAR" << "*.RMI", QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        CONVERT_JOB job;
+        job.in = it.next();
+        QString rel = src.relativeFilePath(job.in);
+        if (rel.endsWith(".rmi", Qt::CaseInsensitive))     // the RIFF wrapper is gone
+            rel = rel.left(rel.length() - 4) + ".mid";
+        job.out = dst.filePath(rel);
+        job.strip = strip;
+        job.in_bytes = job.out_bytes = 0;
+        job.counts.events_in = job.counts.events_out = 0;
+        // song.mid and song.rmi side by side both become song.mid: the
+        // first one found is converted, two workers never share a file
+        if (writers.contains(job.out))
+            job.error = QString("%1: skipped, %2 is converted to %3 as well")
+                        .arg(job.in) .arg(writers.value(job.out)) .arg(job.out);
+        else
+            writers.insert(job.out, job.in);
+        // directories first, the workers only create files
+        dst.mkpath(QFileInfo(rel).path());
+        jobs.push_back(job);
+    }
+    QtConcurrent::blockingMap(jobs, convert_one);
+
+    int failed = 0;
+    long long in_bytes = 0, out_bytes = 0, events_in = 0, events_out = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        const CONVERT_JOB &job = jobs[i];
+        if (!job.error.isEmpty()) {
+            fprintf(stderr, "%s\n", job.error.toLocal8Bit().data());
+            ++failed;
+            continue;
+        }
+        in_bytes += job.in_bytes;
+        out_bytes += job.out_bytes;
+        events_in += job.counts.events_in;
+        events_out += job.counts.events_out;
+    }
+    double seconds = std::max(1e-9, (stats_now() - t0) / 1e9);
+    int done = jobs.size() - failed;
+    printf("%d files converted, %d failed, in %.2f s on %d threads\n", done, failed, seconds,
+           QThread::idealThreadCount());
+    printf("  %.0f files/s, %.1f MB/s read, %.1f MB/s written\n", done / seconds, in_bytes / seconds / 1e6,
+           out_bytes / seconds / 1e6);
+    printf("  %lld -> %lld bytes, %lld -> %lld events%s\n", in_bytes, out_bytes, events_in, events_out,
+           strip ? " (redundant events stripped)" : "");
+    return failed ? 1 : 0;
+}   // end convert_files
+
+int verify_convert() {
+    // event lists with what strip mode must keep: '+' kept, '-' dropped
+    static const struct {
+        const char *name;
+        const char *keep;
+        unsigned char events[6][4];     // type, then the data bytes; 0xff is the sysex below
+    } cases[] = {
+        { "repeated controller", "+-", {
+            { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 }, { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 } } },
+        { "controller after reset all controllers", "+++", {
+            { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 }, { SND_SEQ_EVENT_CONTROLLER, 0, 121, 0 },
+            { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 } } },
+        { "reset on another channel", "++-", {
+            { SND_SEQ_EVENT_CONTROLLER, 1, 11, 80 }, { SND_SEQ_EVENT_CONTROLLER, 0, 121, 0 },
+            { SND_SEQ_EVENT_CONTROLLER, 1, 11, 80 } } },
+        { "bend and pressure after reset all controllers", "+++++", {
+            { SND_SEQ_EVENT_PITCHBEND, 2, 0, 0x40 }, { SND_SEQ_EVENT_CHANPRESS, 2, 90 },
+            { SND_SEQ_EVENT_CONTROLLER, 2, 121, 0 }, { SND_SEQ_EVENT_PITCHBEND, 2, 0, 0x40 },
+            { SND_SEQ_EVENT_CHANPRESS, 2, 90 } } },
+        { "program after reset all controllers", "++-", {
+            { SND_SEQ_EVENT_PGMCHANGE, 3, 5 }, { SND_SEQ_EVENT_CONTROLLER, 3, 121, 0 },
+            { SND_SEQ_EVENT_PGMCHANGE, 3, 5 } } },
+        { "volume and program after GM reset", "++++", {
+            { SND_SEQ_EVENT_CONTROLLER, 0, 7, 100 }, { SND_SEQ_EVENT_PGMCHANGE, 9, 16 },
+            { SND_SEQ_EVENT_SYSEX, 0 }, { SND_SEQ_EVENT_CONTROLLER, 0, 7, 100 } } },
+        { "GS reset", "+++", {
+            { SND_SEQ_EVENT_PGMCHANGE, 4, 30 }, { SND_SEQ_EVENT_SYSEX, 1 }, { SND_SEQ_EVENT_PGMCHANGE, 4, 30 } } },
+        { "XG system on", "+++", {
+            { SND_SEQ_EVENT_CONTROLLER, 5, 10, 20 }, { SND_SEQ_EVENT_SYSEX, 2 }, { SND_SEQ_EVENT_CONTROLLER, 5, 10, 20 } } },
+        { "master volume", "++-", {
+            { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 }, { SND_SEQ_EVENT_SYSEX, 3 }, { SND_SEQ_EVENT_CONTROLLER, 0, 11, 80 } } },
+    };
+    static const unsigned char sysex[][11] = {
+        { 0xf0, 0x7e, 0x7f, 0x09, 0x01, 0xf7 },                                 // GM system on
+        { 0xf0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x7f, 0x00, 0x41, 0xf7 },   // GS reset
+        { 0xf0, 0x43, 0x10, 0x4c, 0x00, 0x00, 0x7e, 0x00, 0xf7 },               // XG system on
+        { 0xf0, 0x7f, 0x7f, 0x04, 0x01, 0x00, 0x7f, 0xf7 },                     // master volume
+    };
+    static const unsigned int sysex_len[] = { 6, 11, 9, 8 };
+    MIDI_FILE song;
+    for (int i = 0; i < 4; ++i)
+        song.sysex_arena.insert(song.sysex_arena.end(), sysex[i], sysex[i] + sysex_len[i]);
+    int failures = 0, count = sizeof(cases) / sizeof(cases[0]);
+    for (int c = 0; c < count; ++c) {
+        CHANNEL_SHADOW shadow;
+        int n = strlen(cases[c].keep);
+        char got[8];
+        for (int i = 0; i < n; ++i) {
+            const unsigned char *d = cases[c].events[i];
+            MIDI_FILE::event e;
+            memset(&e, 0, sizeof(e));
+            e.type = d[0];
+            if (e.type == SND_SEQ_EVENT_SYSEX) {
+                e.data.sysex.offset = 0;
+                for (int k = 0; k < d[1]; ++k)
+                    e.data.sysex.offset += sysex_len[k];
+                e.data.sysex.length = sysex_len[d[1]];
+            } else {
+                e.data.d[0] = d[1];
+                e.data.d[1] = d[2];
+                e.data.d[2] = d[3];
+            }
+            got[i] = redundant(shadow, song, e) ? '-' : '+';
+        }
+        got[n] = 0;
+        if (strcmp(got, cases[c].keep)) {
+            printf("%s: %s, expected %s\n", cases[c].name, got, cases[c].keep);
+            ++failures;
+        }
+    }
+    printf("%d strip cases: %s\n", count, failures ? "FAILED" : "as expected");
+    return failures ? 1 : 0;
+}   // end verify_convert
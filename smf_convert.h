@@ -0,0 +1,37 @@
+#ifndef SMF_CONVERT_H
+#define SMF_CONVERT_H
+
+class MIDI_FILE;
+class SMF_WRITER;
+
+// Batch conversion of Standard MIDI Files to type 0 for players that take
+// nothing else.  Each file is read with MIDI_FILE, which already merges
+// the tracks in tick order, and written back as one track by SMF_WRITER
+// with running status.  Tempo, time and key signatures, markers, cue
+// points, lyrics and text are kept; track names, port numbers and the
+// other meta events are not.
+//
+// With strip set, events that change nothing are dropped: controllers,
+// programs, pressure and bends that repeat the channel's current value,
+// tempo and signatures that repeat the last one, note-offs of keys that
+// are not sounding.  Reset all controllers forgets the channel's
+// controllers, pressure and bend, and any sysex but a universal real-time
+// one (GM/GS/XG resets, part settings) forgets all channels, so what
+// follows is kept.  Note-offs with the default release velocity become
+// note-ons with velocity 0, so running status covers them.  Bank select,
+// (N)RPN, data entry and channel mode controllers are always kept.
+// Implemented in smf_convert.cpp.
+
+struct CONVERT_COUNTS {
+    int events_in, events_out;
+};
+
+// song to the open track of w, which the caller ends
+void convert_song(const MIDI_FILE &song, SMF_WRITER &w, bool strip, CONVERT_COUNTS &counts);
+// --convert [--strip] DIR OUTDIR: every MIDI file under DIR, on all
+// cores, to the same relative path under OUTDIR; returns the exit code
+int convert_files(int argc, char **argv);
+// --verify-convert: what strip mode keeps around resets, returns the exit code
+int verify_convert();
+
+#endif // SMF_CONVERT_H
@@ -0,0 +1,175 @@
+// smf_writer.cpp -- part of MIDI_PLAYER
+// streaming Standard MIDI File output, see smf_writer.h
+// contains:
+//      SMF_WRITER()    -- constructor
+//      open()          -- create the file and write MThd
+//      beginTrack()    -- MTrk header with a length patched later
+//      channel(), sysex(), meta()  -- append one event
+//      flush()         -- write the buffered events and a closing end-of-track
+//      checkpoint()    -- the same, synced to disk
+//      endTrack()
+//      close()         -- final MThd track count, close
+//      varlen(), delta(), put(), write(), patchLength() -- helpers
+
+#include "smf_writer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const unsigned char END_OF_TRACK[] = { 0x00, 0xff, 0x2f, 0x00 };
+
+SMF_WRITER::SMF_WRITER() :
+    fd(-1), err(0), tracks(0), track_start(-1), track_end(0), last_tick(0), running(0)
+{
+}
+
+SMF_WRITER::~SMF_WRITER() {
+    if (fd >= 0)
+        close();
+}
+
+int SMF_WRITER::put(off_t at, const void *data, size_t len) {
+    const char *p = static_cast<const char *>(data);
+    while (len > 0 && !err) {
+        ssize_t n = pwrite(fd, p, len, at);
+        if (n < 0) {
+            if (errno != EINTR)
+                err = -errno;
+            continue;
+        }
+        p += n;
+        at += n;
+        len -= n;
+    }
+    return err;
+}
+
+int SMF_WRITER::open(const char *path, int format, int ppq) {
+    err = 0;
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return err = -errno;
+    // the track count is patched by close()
+    unsigned char mthd[14] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6,
+                               0, static_cast<unsigned char>(format), 0, 0,
+                               static_cast<unsigned char>(ppq >> 8), static_cast<unsigned char>(ppq) };
+    tracks = 0;
+    track_start = -1;
+    track_end = sizeof(mthd);
+    return put(0, mthd, sizeof(mthd));
+}
+
+int SMF_WRITER::beginTrack() {
+    static const unsigned char mtrk[8] = { 'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+    if (put(track_end, mtrk, sizeof(mtrk)))
+        return err;
+    track_start = track_end;
+    track_end += sizeof(mtrk);
+    last_tick = 0;
+    running = 0;
+    ++tracks;
+    unsigned char count[2] = { static_cast<unsigned char>(tracks >> 8), static_cast<unsigned char>(tracks) };
+    return put(10, count, 2);
+}
+
+void SMF_WRITER::varlen(unsigned int value) {
+    unsigned char bytes[5];
+    int n = 0;
+    bytes[n++] = value & 0x7f;
+    while (value >>= 7)
+        bytes[n++] = 0x80 | (value & 0x7f);
+    while (n)
+        buf.push_back(bytes[--n]);
+}
+
+void SMF_WRITER::delta(unsigned int tick) {
+    // events arrive in time order; a late one is written at the same time
+    varlen(tick > last_tick ? tick - last_tick : 0);
+    if (tick > last_tick)
+        last_tick = tick;
+}
+
+void SMF_WRITER::channel(unsigned int tick, const unsigned char *msg, int len) {
+    delta(tick);
+    if (msg[0] != running)
+        buf.push_back(msg[0]);
+    running = msg[0];
+    buf.insert(buf.end(), msg + 1, msg + len);
+}
+
+void SMF_WRITER::sysex(unsigned int tick, const unsigned char *data, int len) {
+    // F0 <length> rest of the message, the length counts the closing F7
+    delta(tick);
+    buf.push_back(data[0]);
+    varlen(len - 1);
+    buf.insert(buf.end(), data + 1, data + len);
+    running = 0;
+}
+
+void SMF_WRITER::meta(unsigned int tick, int type, const unsigned char *data, int len) {
+    delta(tick);
+    buf.push_back(0xff);
+    buf.push_back(type);
+    varlen(len);
+    buf.insert(buf.end(), data, data + len);
+    running = 0;
+}
+
+int SMF_WRITER::write(bool end_mark) {
+    // with end_mark the events go out in one write with an end-of-track
+    // after them, left outside track_end for the next write to replace
+    if (buf.empty() || err)
+        return err;
+    size_t events = buf.size();
+    end_mark = end_mark && track_start >= 0;
+    if (end_mark)
+        buf.insert(buf.end(), END_OF_TRACK, END_OF_TRACK + sizeof(END_OF_TRACK));
+    put(track_end, &buf[0], buf.size());
+    track_end += events;
+    buf.clear();
+    if (end_mark)
+        patchLength(track_end + sizeof(END_OF_TRACK));
+    return err;
+}
+
+int SMF_WRITER::flush() {
+    return write(true);
+}
+
+int SMF_WRITER::patchLength(off_t end) {
+    unsigned int len = end - track_start - 8;
+    unsigned char bytes[4] = { static_cast<unsigned char>(len >> 24), static_cast<unsigned char>(len >> 16),
+                               static_cast<unsigned char>(len >> 8), static_cast<unsigned char>(len) };
+    return put(track_start + 4, bytes, 4);
+}
+
+int SMF_WRITER::checkpoint() {
+    // flush() leaves nothing to close when nothing was buffered, a track
+    // just begun still needs its end-of-track
+    if (flush() || track_start < 0)
+        return err;
+    put(track_end, END_OF_TRACK, sizeof(END_OF_TRACK));
+    patchLength(track_end + sizeof(END_OF_TRACK));
+    if (!err && fdatasync(fd) < 0)
+        err = -errno;
+    return err;
+}
+
+int SMF_WRITER::endTrack(unsigned int tick) {
+    meta(tick, 0x2f, 0, 0);
+    write(false);
+    patchLength(track_end);
+    track_start = -1;
+    return err;
+}
+
+int SMF_WRITER::close(bool sync) {
+    if (track_start >= 0)
+        endTrack(last_tick);
+    if (sync && !err && fdatasync(fd) < 0)
+        err = -errno;
+    if (::close(fd) < 0 && !err)
+        err = -errno;
+    fd = -1;
+    return err;
+}
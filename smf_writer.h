@@ -0,0 +1,55 @@
+#ifndef SMF_WRITER_H
+#define SMF_WRITER_H
+
+#include <sys/types.h>
+#include <vector>
+
+// Streaming Standard MIDI File writer.  Events are appended to the open
+// track with running status.  flush() writes what is buffered followed by
+// an end-of-track meta event, which the next flush overwrites, and then
+// patches the chunk length to cover both, so the file on disk is valid
+// after every flush.  checkpoint() also fdatasyncs it: a file that is cut
+// off later is valid up to the last flush, and after a power cut up to
+// the last checkpoint.
+// Implemented in smf_writer.cpp.  Errors are negative errno values; the
+// first one sticks and is returned by every later call.
+class SMF_WRITER {
+public:
+    SMF_WRITER();
+    ~SMF_WRITER();
+
+    int open(const char *path, int format, int ppq);
+    int beginTrack();
+    // one channel message, status byte first
+    void channel(unsigned int tick, const unsigned char *msg, int len);
+    // a complete F0 ... F7 message, or an F7 escape when data[0] is F7
+    void sysex(unsigned int tick, const unsigned char *data, int len);
+    void meta(unsigned int tick, int type, const unsigned char *data, int len);
+    int flush();
+    int checkpoint();
+    int endTrack(unsigned int tick);
+    int close(bool sync = true);    // sync=false leaves write-back to the OS
+
+    bool isOpen() const { return fd >= 0; }
+    long long bytes() const { return track_end + buf.size(); }
+    size_t buffered() const { return buf.size(); }
+    int error() const { return err; }
+
+private:
+    void varlen(unsigned int);
+    void delta(unsigned int tick);
+    int put(off_t at, const void *data, size_t len);
+    int write(bool end_mark);
+    int patchLength(off_t end);
+
+    int fd;
+    int err;
+    int tracks;
+    std::vector<unsigned char> buf;     // events not yet written
+    off_t track_start;      // the MTrk header of the open track, -1 if none
+    off_t track_end;        // file offset for the next buffered byte
+    unsigned int last_tick;
+    unsigned char running;  // running status, 0 after sysex and meta events
+};
+
+#endif // SMF_WRITER_H
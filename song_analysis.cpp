@@ -0,0 +1,442 @@
+// song_analysis.cpp -- part of MIDI_PLAYER
+// polyphony, bandwidth and burst analysis of a parsed song
+// contains:
+//      SONG_ANALYSIS::clear()
+//      SLICE           -- one time slice and its partial results
+//      analyze_slice() -- the pass over the events of one slice
+//      wire_bytes()    -- what an event costs on a MIDI cable
+//      analyze_song()  -- splits, runs and merges the slices
+//      analysis_text() -- multi-line report for the panel and the CLI
+//      analyze_files() -- "--analyze FILE..."
+//      make_song()     -- a generated song for verify_analysis()
+//      same_analysis() -- two results equal, sums to rounding
+//      verify_analysis() -- "--verify-analysis", serial against parallel
+
+#include "song_analysis.h"
+#include "midi_file.h"
+#include "tempo_map.h"
+#include "player_stats.h"
+#include <alsa/asoundlib.h>
+#include <QtConcurrentMap>
+#include <QThread>
+#include <algorithm>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+// below this many events one thread is faster than starting several
+static const size_t PARALLEL_EVENTS = 100000;
+static const int BURSTS = 5;
+
+void SONG_ANALYSIS::clear() {
+    for (int ch = 0; ch < 16; ++ch) {
+        peak_poly[ch] = 0;
+        peak_poly_at[ch] = avg_poly[ch] = 0;
+    }
+    peak_total = 0;
+    peak_total_at = avg_total = 0;
+    window_events.clear();
+    window_bytes.clear();
+    peak_events = peak_bytes = 0;
+    avg_bytes = 0;
+    sysex_count = 0;
+    sysex_bytes = 0;
+    bpm_min = bpm_max = 0;
+    bursts.clear();
+    seconds = 0;
+    slices = 0;
+    ns = 0;
+}
+
+struct SLICE {
+    const MIDI_FILE *song;
+    const TEMPO_MAP *tempo;
+    SONG_ANALYSIS *out;     // only window_events/window_bytes of its windows are written
+    size_t first, last;     // event range
+    unsigned int tick_start, tick_end;  // the ticks of its windows, end exclusive
+    double t_start, t_end;
+    // partial results
+    int peak[16];
+    double peak_at[16];
+    double poly_seconds[16];
+    int peak_total;
+    double peak_total_at, total_seconds;
+    int sysex_count;
+    long long sysex_bytes;
+    int tempo_min, tempo_max;
+};
+
+static int wire_bytes(const MIDI_FILE::event &e) {
+    switch (e.type) {
+    case SND_SEQ_EVENT_PGMCHANGE:
+    case SND_SEQ_EVENT_CHANPRESS:
+        return 2;
+    case SND_SEQ_EVENT_SYSEX:
+        return e.data.sysex.length;
+    case SND_SEQ_EVENT_TEMPO:
+        return 0;   // never leaves the sequencer
+    default:
+        return 3;
+    }
+}
+
+static void analyze_slice(SLICE &s) {
+    const std::vector<MIDI_FILE::event> &events = s.song->events;
+    const TEMPO_MAP &tempo = *s.tempo;
+    int windows = s.out->window_events.size();
+    memset(s.peak, 0, sizeof(s.peak));
+    memset(s.peak_at, 0, sizeof(s.peak_at));
+    memset(s.poly_seconds, 0, sizeof(s.poly_seconds));
+    s.peak_total = 0;
+    s.peak_total_at = s.total_seconds = 0;
+    s.sysex_count = 0;
+    s.sysex_bytes = 0;
+    s.tempo_min = s.tempo_max = 0;
+
+    // polyphony from the note index, for the whole song and for each slice
+    // alike: a note that ends on the tick it starts sounds for that tick,
+    // one still held ends with its track.  The notes on before the slice
+    // are the ones it starts with, the rest are a start and an end in
+    // tick order, ends first so a note ending where another starts does
+    // not count as two voices
+    const NOTE_INDEX &notes = s.song->notes;
+    std::vector<int> ids;
+    notes.overlapping(s.tick_start ? s.tick_start - 1 : 0, s.tick_end, ids);
+    std::vector<unsigned long long> changes;    // tick, then 0x10 for a start, channel
+    int poly[16], total = 0;
+    memset(poly, 0, sizeof(poly));
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const NOTE_INDEX::note &n = notes.at(ids[i]);
+        if (n.start < s.tick_start) {
+            ++poly[n.channel];
+            ++total;
+        } else
+            changes.push_back(static_cast<unsigned long long>(n.start) << 8 | 0x10 | n.channel);
+        if (n.end < s.tick_end)
+            changes.push_back(static_cast<unsigned long long>(n.end) << 8 | n.channel);
+    }
+    std::sort(changes.begin(), changes.end());
+    int at = tempo.search(s.tick_start);
+    double before = s.t_start;
+    for (size_t i = 0; i < changes.size(); ++i) {
+        unsigned int tick = changes[i] >> 8;
+        int ch = changes[i] & 0x0f;
+        at = tempo.find(tick, at);
+        // a note held past the last event stops counting at the song end
+        double now = std::min(tempo.seconds(tick, at), s.t_end);
+        for (int c = 0; c < 16; ++c)
+            s.poly_seconds[c] += poly[c] * (now - before);
+        s.total_seconds += total * (now - before);
+        before = now;
+        if (!(changes[i] & 0x10)) {
+            --poly[ch];
+            --total;
+            continue;
+        }
+        if (++poly[ch] > s.peak[ch]) {
+            s.peak[ch] = poly[ch];
+            s.peak_at[ch] = now;
+        }
+        if (++total > s.peak_total) {
+            s.peak_total = total;
+            s.peak_total_at = now;
+        }
+    }   // end FOR (note starts and ends of the slice)
+    for (int ch = 0; ch < 16; ++ch)
+        s.poly_seconds[ch] += poly[ch] * (s.t_end - before);
+    s.total_seconds += total * (s.t_end - before);
+
+    // the wire: events per window, sysex and tempo
+    at = s.first < s.last ? tempo.search(events[s.first].tick) : 0;
+    for (size_t i = s.first; i < s.last; ++i) {
+        const MIDI_FILE::event &e = events[i];
+        at = tempo.find(e.tick, at);
+        int w = std::min(windows - 1, static_cast<int>(tempo.seconds(e.tick, at) / ANALYSIS_WINDOW));
+        switch (e.type) {
+        case SND_SEQ_EVENT_SYSEX:
+            ++s.sysex_count;
+            s.sysex_bytes += e.data.sysex.length;
+            break;
+        case SND_SEQ_EVENT_TEMPO:
+            if (!s.tempo_min || e.data.tempo < s.tempo_min)
+                s.tempo_min = e.data.tempo;
+            s.tempo_max = std::max(s.tempo_max, e.data.tempo);
+            continue;   // not a wire event
+        }
+        ++s.out->window_events[w];
+        s.out->window_bytes[w] += wire_bytes(e);
+    }
+}   // end analyze_slice
+
+void analyze_song(const MIDI_FILE &song, SONG_ANALYSIS &a, int slice_count) {
+    long long t0 = stats_now();
+    a.clear();
+    if (song.events.empty() || song.PPQ <= 0)
+        return;
+    TEMPO_MAP tempo(song);
+    a.seconds = tempo.seconds(song.lastTick(), tempo.search(song.lastTick()));
+    int windows = static_cast<int>(a.seconds / ANALYSIS_WINDOW) + 1;
+    a.window_events.assign(windows, 0);
+    a.window_bytes.assign(windows, 0);
+
+    // slices cover whole windows, so each one writes its own counters;
+    // events of one tick always share a window and so a slice
+    int count = slice_count;
+    if (count <= 0)
+        count = song.events.size() >= PARALLEL_EVENTS ? QThread::idealThreadCount() : 1;
+    count = std::max(1, std::min(count, windows));
+    std::vector<SLICE> slices(count);
+    size_t first = 0;
+    for (int k = 0; k < count; ++k) {
+        SLICE &s = slices[k];
+        s.song = &song;
+        s.tempo = &tempo;
+        s.out = &a;
+        int w1 = static_cast<int>(static_cast<long long>(windows) * (k + 1) / count);
+        s.first = first;
+        s.tick_start = k ? slices[k-1].tick_end : 0;
+        if (k == count - 1) {
+            s.last = song.events.size();
+            s.tick_end = UINT_MAX;
+        } else {
+            // first event in window w1 or later
+            size_t lo = first, hi = song.events.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (tempo.window(song.events[mid].tick, ANALYSIS_WINDOW) < w1)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            s.last = lo;
+            // and the first tick of window w1, for the notes
+            unsigned int tlo = s.tick_start, thi = song.lastTick() + 1;
+            while (tlo < thi) {
+                unsigned int mid = tlo + (thi - tlo) / 2;
+                if (tempo.window(mid, ANALYSIS_WINDOW) < w1)
+                    tlo = mid + 1;
+                else
+                    thi = mid;
+            }
+            s.tick_end = tlo;
+        }
+        s.t_start = k ? slices[k-1].t_end : 0;
+        s.t_end = k == count - 1 ? a.seconds : std::min(a.seconds, w1 * ANALYSIS_WINDOW);
+        first = s.last;
+    }
+    if (count > 1)
+        QtConcurrent::blockingMap(slices, analyze_slice);
+    else
+        analyze_slice(slices[0]);
+
+    // merge, slices in time order so the first peak wins
+    int tempo_min = song.init_tempo, tempo_max = song.init_tempo;
+    double total_seconds = 0, poly_seconds[16] = { 0 };
+    for (int k = 0; k < count; ++k) {
+        const SLICE &s = slices[k];
+        for (int ch = 0; ch < 16; ++ch) {
+            if (s.peak[ch] > a.peak_poly[ch]) {
+                a.peak_poly[ch] = s.peak[ch];
+                a.peak_poly_at[ch] = s.peak_at[ch];
+            }
+            poly_seconds[ch] += s.poly_seconds[ch];
+        }
+        if (s.peak_total > a.peak_total) {
+            a.peak_total = s.peak_total;
+            a.peak_total_at = s.peak_total_at;
+        }
+        total_seconds += s.total_seconds;
+        a.sysex_count += s.sysex_count;
+        a.sysex_bytes += s.sysex_bytes;
+        if (s.tempo_min) {
+            tempo_min = std::min(tempo_min, s.tempo_min);
+            tempo_max = std::max(tempo_max, s.tempo_max);
+        }
+    }
+    if (a.seconds > 0) {
+        for (int ch = 0; ch < 16; ++ch)
+            a.avg_poly[ch] = poly_seconds[ch] / a.seconds;
+        a.avg_total = total_seconds / a.seconds;
+    }
+    a.bpm_min = 60000000.0 / tempo_max;
+    a.bpm_max = 60000000.0 / tempo_min;
+
+    // bandwidth and the worst windows
+    long long bytes = 0;
+    std::vector<int> worst;
+    for (int w = 0; w < windows; ++w) {
+        a.peak_events = std::max(a.peak_events, a.window_events[w]);
+        a.peak_bytes = std::max(a.peak_bytes, a.window_bytes[w]);
+        bytes += a.window_bytes[w];
+        // keep the BURSTS busiest, by bytes, earlier first on ties
+        if (static_cast<int>(worst.size()) == BURSTS && a.window_bytes[w] <= a.window_bytes[worst.back()])
+            continue;
+        if (static_cast<int>(worst.size()) == BURSTS)
+            worst.pop_back();
+        std::vector<int>::iterator it = worst.begin();
+        while (it != worst.end() && a.window_bytes[*it] >= a.window_bytes[w])
+            ++it;
+        worst.insert(it, w);
+    }
+    a.avg_bytes = static_cast<double>(bytes) / windows;
+    for (size_t i = 0; i < worst.size(); ++i) {
+        if (!a.window_bytes[worst[i]])
+            break;
+        SONG_ANALYSIS::burst b = { worst[i] * ANALYSIS_WINDOW, a.window_events[worst[i]], a.window_bytes[worst[i]] };
+        a.bursts.push_back(b);
+    }
+    a.slices = count;
+    a.ns = stats_now() - t0;
+}   // end analyze_song
+
+static QString at_time(double seconds) {
+    int s = static_cast<int>(seconds);
+    return QString("%1:%2.%3") .arg(s/60) .arg(s%60, 2, 10, QChar('0'))
+            .arg(static_cast<int>((seconds - s) * 10));
+}
+
+QString analysis_text(const SONG_ANALYSIS &a) {
+    QString text;
+    text += QString("Polyphony: peak %1 at %2, average %3\n")
+            .arg(a.peak_total) .arg(at_time(a.peak_total_at)) .arg(a.avg_total, 0, 'f', 1);
+    for (int ch = 0; ch < 16; ++ch) {
+        if (a.peak_poly[ch])
+            text += QString("  channel %1: peak %2 at %3, average %4\n") .arg(ch + 1)
+                    .arg(a.peak_poly[ch]) .arg(at_time(a.peak_poly_at[ch])) .arg(a.avg_poly[ch], 0, 'f', 1);
+    }
+    text += QString("Bandwidth per %1 ms: peak %2 events, %3 bytes (%4% of a DIN link), average %5 bytes\n")
+            .arg(static_cast<int>(ANALYSIS_WINDOW * 1000)) .arg(a.peak_events) .arg(a.peak_bytes)
+            .arg(100 * a.peak_bytes / DIN_BYTES_PER_WINDOW) .arg(a.avg_bytes, 0, 'f', 1);
+    for (size_t i = 0; i < a.bursts.size(); ++i)
+        text += QString("  burst at %1: %2 events, %3 bytes%4\n") .arg(at_time(a.bursts[i].seconds))
+                .arg(a.bursts[i].events) .arg(a.bursts[i].bytes)
+                .arg(a.bursts[i].bytes > DIN_BYTES_PER_WINDOW ? " - overruns DIN" : "");
+    text += QString("Sysex: %1 messages, %2 bytes\n") .arg(a.sysex_count) .arg(a.sysex_bytes);
+    text += QString("Tempo: %1 to %2 BPM\n") .arg(a.bpm_min, 0, 'f', 1) .arg(a.bpm_max, 0, 'f', 1);
+    text += QString("Analysed %1 s of song in %2 ms (%3 slices)")
+            .arg(a.seconds, 0, 'f', 1) .arg(a.ns / 1e6, 0, 'f', 2) .arg(a.slices);
+    return text;
+}   // end analysis_text
+
+int analyze_files(int count, char **files) {
+    int rc = 0;
+    for (int i = 0; i < count; ++i) {
+        MIDI_FILE song;
+        if (!song.load(files[i])) {
+            fprintf(stderr, "%s\n", song.errorString().toLocal8Bit().data());
+            rc = 1;
+            continue;
+        }
+        printf("%s\n%s\n\n", files[i], analysis_text(song.analysis).toLocal8Bit().data());
+    }
+    return rc;
+}   // end analyze_files
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void make_song(MIDI_FILE &song, unsigned int seed, int count) {
+    // one track: notes that overlap, retrigger, end on the tick they start
+    // or never end, stray note-offs, controllers and tempo changes, often
+    // many on one tick
+    song.events.clear();
+    song.notes.clear();
+    song.PPQ = 96;
+    song.init_tempo = 500000;
+    MIDI_FILE::event e;
+    memset(&e, 0, sizeof(e));
+    unsigned int tick = 0;
+    while (static_cast<int>(song.events.size()) < count) {
+        unsigned int r = next_random(&seed);
+        if (r % 4 == 0)
+            tick += r % 24 + 1;
+        r = next_random(&seed);
+        int ch = r % 16, key = 36 + r / 16 % 48, kind = r / 1024 % 20;
+        e.tick = tick;
+        e.data.d[0] = ch;
+        e.data.d[1] = key;
+        e.data.d[2] = 1 + r / 32768 % 127;
+        if (kind < 8 || kind >= 16) {
+            e.type = SND_SEQ_EVENT_NOTEON;
+            song.events.push_back(e);
+            song.notes.noteOn(0, tick, ch, key, e.data.d[2]);
+        }
+        if (kind >= 8) {
+            // a note-off, after the note-on of the same tick for kind >= 16
+            e.type = kind % 2 ? SND_SEQ_EVENT_NOTEOFF : SND_SEQ_EVENT_NOTEON;
+            e.data.d[2] = kind % 2 ? 64 : 0;
+            song.events.push_back(e);
+            song.notes.noteOff(tick, ch, key);
+        }
+        if (kind == 15 && r % 7 == 0) {
+            e.type = SND_SEQ_EVENT_TEMPO;
+            e.data.tempo = 300000 + r % 400000;
+            song.events.push_back(e);
+        }
+    }   // end WHILE (events)
+    song.notes.endTrack(tick);
+    song.notes.finish();
+}   // end make_song
+
+static bool near(double a, double b) {
+    return fabs(a - b) <= 1e-9 * std::max(1.0, fabs(a));
+}
+
+static bool same_analysis(const SONG_ANALYSIS &a, const SONG_ANALYSIS &b) {
+    for (int ch = 0; ch < 16; ++ch)
+        if (a.peak_poly[ch] != b.peak_poly[ch] || a.peak_poly_at[ch] != b.peak_poly_at[ch] ||
+            !near(a.avg_poly[ch], b.avg_poly[ch]))
+            return false;
+    return a.peak_total == b.peak_total && a.peak_total_at == b.peak_total_at && near(a.avg_total, b.avg_total) &&
+           a.window_events == b.window_events && a.window_bytes == b.window_bytes &&
+           a.sysex_count == b.sysex_count && a.bpm_min == b.bpm_min && a.bpm_max == b.bpm_max;
+}
+
+int verify_analysis(int songs) {
+    const int SLICES = 8;
+    int failures = 0;
+    long events = 0;
+    MIDI_FILE song;
+    SONG_ANALYSIS serial, parallel;
+    for (int n = 0; n < songs; ++n) {
+        // the last one is big enough to go parallel by itself
+        make_song(song, n + 1, n == songs - 1 ? PARALLEL_EVENTS : 1000 + 5000 * n);
+        events += song.events.size();
+        analyze_song(song, serial, 1);
+        analyze_song(song, parallel, SLICES);
+        if (!same_analysis(serial, parallel)) {
+            printf("song %d: %d slices differ from one: peak %d/%d, average %.4f/%.4f\n", n, parallel.slices,
+                   serial.peak_total, parallel.peak_total, serial.avg_total, parallel.avg_total);
+            ++failures;
+        }
+    }
+    // notes that end on the tick they start sound for that tick only
+    song.events.clear();
+    song.notes.clear();
+    MIDI_FILE::event e;
+    memset(&e, 0, sizeof(e));
+    for (unsigned int tick = 0; tick < 20 * 96; tick += 96) {
+        e.tick = tick;
+        e.data.d[1] = 60;
+        e.data.d[2] = 100;
+        e.type = SND_SEQ_EVENT_NOTEON;
+        song.events.push_back(e);
+        song.notes.noteOn(0, tick, 0, 60, 100);
+        e.type = SND_SEQ_EVENT_NOTEOFF;
+        song.events.push_back(e);
+        song.notes.noteOff(tick, 0, 60);
+    }
+    song.notes.endTrack(e.tick);
+    song.notes.finish();
+    analyze_song(song, serial, 1);
+    if (serial.peak_total != 1 || serial.avg_total > 0.02) {
+        printf("zero-length notes: peak %d, average %.4f, expected 1 and about 0.01\n",
+               serial.peak_total, serial.avg_total);
+        ++failures;
+    }
+    printf("%d songs, %ld events, one slice against %d: %s\n",
+           songs, events, SLICES, failures ? "FAILED" : "identical");
+    return failures ? 1 : 0;
+}   // end verify_analysis
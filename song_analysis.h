@@ -0,0 +1,53 @@
+#ifndef SONG_ANALYSIS_H
+#define SONG_ANALYSIS_H
+
+#include <QString>
+#include <vector>
+
+class MIDI_FILE;
+
+// What a song asks of the hardware: how many voices it holds at once and
+// how many bytes it pushes down the wire per 100 ms window.  Computed once
+// per load in one pass over the events; long songs are split into time
+// slices that are analysed in parallel.  Implemented in song_analysis.cpp.
+struct SONG_ANALYSIS {
+    struct burst {
+        double seconds;     // start of the window
+        int events;
+        int bytes;
+    };
+
+    int peak_poly[16];          // most notes sounding at once, per channel
+    double peak_poly_at[16];    // first time that peak was reached
+    double avg_poly[16];        // time-weighted over the song
+    int peak_total;
+    double peak_total_at;
+    double avg_total;
+    std::vector<int> window_events;     // per 100 ms window
+    std::vector<int> window_bytes;      // MIDI wire bytes, no running status
+    int peak_events, peak_bytes;
+    double avg_bytes;
+    int sysex_count;
+    long long sysex_bytes;
+    double bpm_min, bpm_max;
+    std::vector<burst> bursts;  // the busiest windows, worst first
+    double seconds;             // song length
+    int slices;                 // how many parts ran in parallel
+    long long ns;               // what the analysis cost
+
+    SONG_ANALYSIS() { clear(); }
+    void clear();
+};
+
+static const double ANALYSIS_WINDOW = 0.1;      // seconds
+static const int DIN_BYTES_PER_WINDOW = 312;    // 31250 baud, 10 bits a byte
+
+// slices > 0 splits the song into that many, 0 decides by its size
+void analyze_song(const MIDI_FILE &, SONG_ANALYSIS &, int slices = 0);
+QString analysis_text(const SONG_ANALYSIS &);
+// --analyze FILE...: prints the report of each file, returns the exit code
+int analyze_files(int count, char **files);
+// --verify-analysis: one slice against several on generated songs, returns the exit code
+int verify_analysis(int songs);
+
+#endif // SONG_ANALYSIS_H
@@ -0,0 +1,65 @@
+#ifndef TEMPO_MAP_H
+#define TEMPO_MAP_H
+
+#include <vector>
+
+class MIDI_FILE;
+
+// Tick to seconds over the tempo changes of a song, built in one pass.
+// Every MIDI_FILE keeps one made by load() for tickToSeconds() and
+// secondsToTick(); code that converts every event of a song walks the
+// changes with find() instead of searching for each one.
+// build() is implemented in file_parser.cpp.
+struct TEMPO_MAP {
+    struct change {
+        unsigned int tick;
+        double seconds;
+        double sec_per_tick;
+    };
+    std::vector<change> changes;
+
+    TEMPO_MAP() {}
+    explicit TEMPO_MAP(const MIDI_FILE &song) { build(song); }
+    void build(const MIDI_FILE &song);
+    // index of the change in effect at tick
+    int find(unsigned int tick, int from = 0) const {
+        while (from + 1 < static_cast<int>(changes.size()) && changes[from + 1].tick <= tick)
+            ++from;
+        return from;
+    }
+    int search(unsigned int tick) const {
+        int lo = 0, hi = changes.size() - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (changes[mid].tick <= tick)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        return lo;
+    }
+    double seconds(unsigned int tick, int at) const {
+        return changes[at].seconds + (tick - changes[at].tick) * changes[at].sec_per_tick;
+    }
+    double seconds(unsigned int tick) const {
+        return seconds(tick, search(tick));
+    }
+    // the other way round: the tick 'seconds' into the song
+    unsigned int tick(double seconds) const {
+        int lo = 0, hi = changes.size() - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (changes[mid].seconds <= seconds)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        return changes[lo].tick + static_cast<unsigned int>((seconds - changes[lo].seconds) / changes[lo].sec_per_tick);
+    }
+    // which of the 'width' second windows tick falls in
+    int window(unsigned int tick, double width) const {
+        return static_cast<int>(seconds(tick) / width);
+    }
+};
+
+#endif // TEMPO_MAP_H
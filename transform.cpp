@@ -0,0 +1,103 @@
+// transform.cpp -- part of MIDI_PLAYER
+// playback transforms shared with the player thread, see transform.h
+// contains:
+//      transforms_create()  -- the block the window and the player thread share
+//      transforms_destroy()
+//      transforms_set()     -- the window's side
+//      parse_channels(), format_channels() -- channel lists
+//      TRANSFORMER()   -- constructor, the player's first copy
+//      changed(), update() -- the player's side
+
+#include "transform.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+TRANSFORMS *transforms_create() {
+    // nothing muted or moved, the song plays as written
+    TRANSFORMS *t = static_cast<TRANSFORMS *>(calloc(1, sizeof(TRANSFORMS)));
+    if (t)
+        t->tempo_percent = 100;
+    return t;
+}
+
+void transforms_destroy(TRANSFORMS *t) {
+    free(t);
+}
+
+void transforms_set(TRANSFORMS *t, int tempo_percent, int transpose, unsigned int mute, unsigned int solo) {
+    if (!t)
+        return;
+    if (tempo_percent < TRANSFORMS::MIN_TEMPO)
+        tempo_percent = TRANSFORMS::MIN_TEMPO;
+    if (tempo_percent > TRANSFORMS::MAX_TEMPO)
+        tempo_percent = TRANSFORMS::MAX_TEMPO;
+    if (transpose < -TRANSFORMS::MAX_TRANSPOSE)
+        transpose = -TRANSFORMS::MAX_TRANSPOSE;
+    if (transpose > TRANSFORMS::MAX_TRANSPOSE)
+        transpose = TRANSFORMS::MAX_TRANSPOSE;
+    __atomic_store_n(&t->tempo_percent, tempo_percent, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->transpose, transpose, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->mute, mute & 0xffff, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->solo, solo & 0xffff, __ATOMIC_RELAXED);
+    // the player reads the fields after it has seen the new serial
+    __atomic_add_fetch(&t->serial, 1, __ATOMIC_RELEASE);
+}   // end transforms_set
+
+bool parse_channels(const char *list, unsigned int *bits) {
+    *bits = 0;
+    if (!strcmp(list, "none"))
+        return true;
+    for (const char *p = list; *p; ) {
+        char *end;
+        long ch = strtol(p, &end, 10);
+        if (end == p || ch < 1 || ch > 16 || (*end && *end != ','))
+            return false;
+        *bits |= 1u << (ch - 1);
+        p = *end ? end + 1 : end;
+    }
+    return *list != 0;
+}
+
+void format_channels(unsigned int bits, char *out, int size) {
+    int n = snprintf(out, size, "none");
+    for (int ch = 0, first = 1; ch < 16; ++ch) {
+        if (!(bits >> ch & 1))
+            continue;
+        if (first)
+            n = 0;
+        if (n < size)
+            n += snprintf(out + n, size - n, first ? "%d" : ",%d", ch + 1);
+        first = 0;
+    }
+}
+
+TRANSFORMER::TRANSFORMER(const TRANSFORMS *t) :
+    shared(t), last_serial(0), tempo_percent(100), transpose(0), mute(0), solo(0)
+{
+    update();
+}
+
+bool TRANSFORMER::changed() const {
+    return shared && __atomic_load_n(&shared->serial, __ATOMIC_ACQUIRE) != last_serial;
+}
+
+int TRANSFORMER::update() {
+    if (!shared)
+        return 0;
+    last_serial = __atomic_load_n(&shared->serial, __ATOMIC_ACQUIRE);
+    int percent = __atomic_load_n(&shared->tempo_percent, __ATOMIC_RELAXED);
+    int semitones = __atomic_load_n(&shared->transpose, __ATOMIC_RELAXED);
+    unsigned int m = __atomic_load_n(&shared->mute, __ATOMIC_RELAXED);
+    unsigned int s = __atomic_load_n(&shared->solo, __ATOMIC_RELAXED);
+    int what = 0;
+    if (percent != tempo_percent)
+        what |= TEMPO;
+    if (semitones != transpose || m != mute || s != solo)
+        what |= NOTES;
+    tempo_percent = percent;
+    transpose = semitones;
+    mute = m;
+    solo = s;
+    return what;
+}   // end update
@@ -0,0 +1,68 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+// Tempo scale, transposition and channel mute/solo of one zone, applied
+// by the player thread as it schedules each event.  The window (or its
+// control socket) writes the block with transforms_set(), which bumps
+// serial last; the player polls serial before every song event and
+// while it waits for the queue, so a change reaches the output within
+// the lookahead.
+struct TRANSFORMS {
+    enum { MIN_TEMPO = 25, MAX_TEMPO = 400, MAX_TRANSPOSE = 24, DRUMS = 9 };
+    int tempo_percent;      // 100 plays as written
+    int transpose;          // semitones, channel 10 (DRUMS) is never moved
+    unsigned int mute;      // channel bits
+    unsigned int solo;      // channel bits; when any is set only those play
+    unsigned int serial;    // changes after every update
+};
+
+TRANSFORMS *transforms_create();
+void transforms_destroy(TRANSFORMS *);
+// clamps tempo and transpose; callers hold the window's transport lock
+void transforms_set(TRANSFORMS *, int tempo_percent, int transpose, unsigned int mute, unsigned int solo);
+// "1,2,10" or "none" to channel bits and back, false on a bad list
+bool parse_channels(const char *list, unsigned int *bits);
+void format_channels(unsigned int bits, char *out, int size);
+
+// The player thread's view of the block.  It keeps a copy of the settings
+// it schedules with, so a change shows up as a difference to act on:
+// notes that are muted or would now sound on another key get their
+// note-off, tempo changes already queued are scaled again.
+// Implemented in transform.cpp.
+class TRANSFORMER {
+public:
+    enum { TEMPO = 1, NOTES = 2 };  // what update() found changed
+
+    TRANSFORMER(const TRANSFORMS *shared);
+
+    bool changed() const;
+    int update();
+    // for LOOKAHEAD::reach(), which gives up waiting when this changes
+    const unsigned int *serial() const { return shared ? &shared->serial : 0; }
+    unsigned int seen() const { return last_serial; }
+
+    bool audible(int channel) const {
+        return !(mute >> channel & 1) && (!solo || (solo >> channel & 1));
+    }
+    // the key a note of the file sounds on, -1 if moved off the keyboard
+    int key(int channel, int key) const {
+        if (channel == TRANSFORMS::DRUMS)
+            return key;
+        key += transpose;
+        return key >= 0 && key < 128 ? key : -1;
+    }
+    // queue tempo for a tempo of the song, in us per quarter
+    int tempo(int us_per_quarter) const {
+        if (tempo_percent == 100)
+            return us_per_quarter;
+        return static_cast<int>(static_cast<long long>(us_per_quarter) * 100 / tempo_percent);
+    }
+
+private:
+    const TRANSFORMS *shared;
+    unsigned int last_serial;
+    int tempo_percent, transpose;
+    unsigned int mute, solo;
+};
+
+#endif // TRANSFORM_H
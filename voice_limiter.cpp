@@ -0,0 +1,180 @@
+// voice_limiter.cpp -- part of MIDI_PLAYER
+// voice allocation for the player thread, see voice_limiter.h
+// contains:
+//      VOICE_LIMITER() -- constructor, reads the voice options
+//      noteOn()        -- play, steal or drop
+//      noteOff()
+//      newPass()
+//      bucketOf()      -- steal class of a note
+//      link(), unlink(), release()
+//      lowestBucket()  -- bitmap scan
+
+#include "voice_limiter.h"
+#include "options.h"
+#include <stdlib.h>
+#include <string.h>
+
+VOICE_LIMITER::VOICE_LIMITER(PLAYER_STATS *s) :
+    limit(options.voices > MAX_VOICES ? MAX_VOICES : options.voices),
+    policy(OLDEST), stats(s), used(0), peak_used(0), steals(0), drops(0)
+{
+    if (!strcmp(options.voice_steal, "quietest"))
+        policy = QUIETEST;
+    else if (!strcmp(options.voice_steal, "priority"))
+        policy = PRIORITY;
+    else if (!strcmp(options.voice_steal, "drop"))
+        policy = DROP;
+    // --voice-priority lists channels most important first; the ones not
+    // listed follow in channel order.  rank 0 is the first to lose voices
+    bool listed[16] = { false };
+    int next = 15;
+    if (options.voice_priority) {
+        for (const char *p = options.voice_priority; *p; ) {
+            char *end;
+            long ch = strtol(p, &end, 10) - 1;
+            if (end == p)
+                break;
+            if (ch >= 0 && ch < 16 && !listed[ch]) {
+                listed[ch] = true;
+                rank[ch] = next--;
+            }
+            p = *end ? end + 1 : end;
+        }
+    }
+    for (int ch = 0; ch < 16; ++ch)
+        if (!listed[ch])
+            rank[ch] = next--;
+    for (int i = 0; i < MAX_VOICES; ++i)
+        voices[i].next = i + 1 < MAX_VOICES ? i + 1 : -1;
+    free_list = 0;
+    for (int b = 0; b < 128; ++b)
+        head[b] = tail[b] = -1;
+    bits[0] = bits[1] = 0;
+    memset(voice_of, -1, sizeof(voice_of));
+    memset(muted, 0, sizeof(muted));
+}   // end constructor
+
+void VOICE_LIMITER::newPass() {
+    memset(muted, 0, sizeof(muted));
+}
+
+int VOICE_LIMITER::bucketOf(int channel, int velocity) const {
+    switch (policy) {
+    case QUIETEST: return velocity;
+    case PRIORITY: return rank[channel];
+    default:       return 0;
+    }
+}
+
+void VOICE_LIMITER::link(int v) {
+    // newest at the tail of its bucket
+    int b = voices[v].bucket;
+    voices[v].prev = tail[b];
+    voices[v].next = -1;
+    if (tail[b] >= 0)
+        voices[tail[b]].next = v;
+    else
+        head[b] = v;
+    tail[b] = v;
+    bits[b >> 6] |= 1ULL << (b & 63);
+}
+
+void VOICE_LIMITER::unlink(int v) {
+    int b = voices[v].bucket;
+    if (voices[v].prev >= 0)
+        voices[voices[v].prev].next = voices[v].next;
+    else
+        head[b] = voices[v].next;
+    if (voices[v].next >= 0)
+        voices[voices[v].next].prev = voices[v].prev;
+    else
+        tail[b] = voices[v].prev;
+    if (head[b] < 0)
+        bits[b >> 6] &= ~(1ULL << (b & 63));
+}
+
+void VOICE_LIMITER::release(int v) {
+    unlink(v);
+    voice_of[voices[v].channel][voices[v].key] = -1;
+    voices[v].next = free_list;
+    free_list = v;
+    --used;
+}
+
+int VOICE_LIMITER::lowestBucket() const {
+    if (bits[0])
+        return __builtin_ctzll(bits[0]);
+    if (bits[1])
+        return 64 + __builtin_ctzll(bits[1]);
+    return -1;
+}
+
+VOICE_LIMITER::Verdict VOICE_LIMITER::noteOn(int channel, int key, int velocity, int *victim_channel, int *victim_key) {
+    channel &= 0x0f;
+    key &= 0x7f;
+    if (!limit)
+        return PLAY;
+    int v = voice_of[channel][key];
+    int bucket = bucketOf(channel, velocity);
+    if (v >= 0) {
+        // retriggered key: the synth reuses the voice, it is the newest now
+        unlink(v);
+        voices[v].bucket = bucket;
+        link(v);
+        return PLAY;
+    }
+    Verdict verdict = PLAY;
+    if (used >= limit) {
+        // the victim is the oldest note of the lowest bucket, as long as it
+        // matters no more than the new note
+        int b = lowestBucket();
+        if (policy == DROP || b > bucket) {
+            if (muted[channel][key] < 255)
+                ++muted[channel][key];
+            ++drops;
+            if (stats)
+                ++stats->voices_dropped;
+            return SKIP;
+        }
+        int victim = head[b];
+        *victim_channel = voices[victim].channel;
+        *victim_key = voices[victim].key;
+        if (muted[*victim_channel][*victim_key] < 255)
+            ++muted[*victim_channel][*victim_key];
+        release(victim);
+        ++steals;
+        if (stats)
+            ++stats->voices_stolen;
+        verdict = STEAL;
+    }
+    v = free_list;
+    free_list = voices[v].next;
+    voices[v].channel = channel;
+    voices[v].key = key;
+    voices[v].bucket = bucket;
+    link(v);
+    voice_of[channel][key] = v;
+    if (++used > peak_used) {
+        peak_used = used;
+        if (stats)
+            stats->voices_peak = used;
+    }
+    return verdict;
+}   // end noteOn
+
+bool VOICE_LIMITER::noteOff(int channel, int key) {
+    channel &= 0x0f;
+    key &= 0x7f;
+    if (!limit)
+        return true;
+    // note-offs pair first in, first out: a stolen or dropped note of
+    // this key came before the one sounding now
+    if (muted[channel][key]) {
+        --muted[channel][key];
+        return false;
+    }
+    int v = voice_of[channel][key];
+    if (v >= 0)
+        release(v);
+    return true;    // a stray note-off is harmless to pass on
+}   // end noteOff
@@ -0,0 +1,65 @@
+#ifndef VOICE_LIMITER_H
+#define VOICE_LIMITER_H
+
+#include "player_stats.h"
+
+// Output stage of the player thread for synths with a fixed number of
+// voices.  It counts the notes sounding on the zone's destination and,
+// when a note-on would go over --voices, either steals a voice (the
+// caller sends its note-off first) or drops the new note.  The note-off
+// the file later sends for a stolen or dropped note is swallowed.
+// Sounding voices sit in buckets by the steal class: one bucket for
+// "oldest", the velocity for "quietest", the channel rank for
+// "priority".  A bitmap finds the lowest bucket and each bucket is
+// oldest first, so every call is O(1) and nothing allocates.
+class VOICE_LIMITER {
+public:
+    enum { MAX_VOICES = 256 };
+    enum Policy { OLDEST, QUIETEST, PRIORITY, DROP };
+    enum Verdict { PLAY, STEAL, SKIP };
+
+    // reads --voices, --voice-steal and --voice-priority
+    VOICE_LIMITER(PLAYER_STATS *stats);
+
+    bool active() const { return limit > 0; }
+    // PLAY: send it; STEAL: first send a note-off for *channel/*key of the
+    // victim (already released here), then the note; SKIP: drop it
+    Verdict noteOn(int channel, int key, int velocity, int *victim_channel, int *victim_key);
+    // false if the note-off belongs to a stolen or dropped note
+    bool noteOff(int channel, int key);
+    // the player starts a loop pass: everything sounding gets a note-off
+    // from it, the ones the file still owed will never come
+    void newPass();
+
+    unsigned long long stolen() const { return steals; }
+    unsigned long long dropped() const { return drops; }
+    int peak() const { return peak_used; }
+
+private:
+    struct voice {
+        unsigned char channel, key;
+        short bucket;
+        short prev, next;   // in the bucket, oldest first
+    };
+
+    int bucketOf(int channel, int velocity) const;
+    void link(int v);
+    void unlink(int v);
+    void release(int v);
+    int lowestBucket() const;
+
+    int limit;
+    Policy policy;
+    PLAYER_STATS *stats;
+    voice voices[MAX_VOICES];
+    short free_list;            // unused voices, chained through next
+    int used, peak_used;
+    short head[128], tail[128]; // per bucket
+    unsigned long long bits[2]; // bucket n is non-empty
+    short voice_of[16][128];    // sounding voice of a key, -1 if none
+    unsigned char muted[16][128];   // note-offs still to swallow
+    unsigned char rank[16];     // channel priority, 0 is stolen first
+    unsigned long long steals, drops;
+};
+
+#endif // VOICE_LIMITER_H